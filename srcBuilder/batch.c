@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lisafs.h"
+
+// Converts, verifies and extracts a whole directory of BLU and DC42 images at once: what fixer and wsread do, one
+// image per worker thread, each into its own output directory, with a summary of the lot at the end.
+// Each worker only ever has one image (and its conversion) in memory, so memory stays bounded by the thread count.
+
+// ---------- Constants ----------
+
+static const int MAX_THREADS = 64;
+
+// ---------- Types ----------
+
+typedef struct {
+    char name[256]; // the input file name, which is also its output directory
+    bool converted; // from BLU
+    bool ok;
+    char error[128];
+    int files;
+    long bytesExtracted;
+    double millis;
+} batchJob;
+
+typedef struct {
+    const char *inDir;
+    const char *outDir;
+    batchJob *jobs;
+    int jobCount;
+    int next;
+    pthread_mutex_t lock;
+} batchQueue;
+
+// ---------- Functions ----------
+
+static double nowMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e3) + (ts.tv_nsec / 1e6);
+}
+
+static bool makeDir(const char *path) {
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+static bytes readWholeFile(const char *path, size_t *length) {
+    FILE *input = fopen(path, "rb");
+    if (input == NULL) {
+        return NULL;
+    }
+    fseek(input, 0, SEEK_END);
+    *length = (size_t) ftell(input);
+    fseek(input, 0, SEEK_SET);
+    bytes data = malloc(*length > 0 ? *length : 1);
+    if (*length > 0 && fread(data, *length, 1, input) != 1) {
+        free(data);
+        data = NULL;
+    }
+    fclose(input);
+    return data;
+}
+
+static bool isDC42(const uint8_t *data, const size_t length) {
+    return length >= (size_t) DATA_OFFSET && data[0x52] == 0x01 && data[0x53] == 0x00;
+}
+
+// The header checksums have to be right, and every file in the s-file has to be readable and found in the catalog
+static bool verify(lisafsVolume *vol, batchJob *job) {
+    uint8_t checksums[8];
+    memcpy(checksums, vol->image + 0x48, sizeof(checksums));
+    lisafsFixHeaderChecksums(vol->image, &vol->geo);
+    if (memcmp(checksums, vol->image + 0x48, sizeof(checksums)) != 0) {
+        memcpy(vol->image + 0x48, checksums, sizeof(checksums));
+        snprintf(job->error, sizeof(job->error), "DC42 checksums don't match");
+        return false;
+    }
+    lisafsEntry *entries;
+    const int count = lisafsList(vol, &entries);
+    bool ok = true;
+    for (int e = 0; e < count && ok; e++) {
+        if (lisafsLookup(vol, entries[e].name) != entries[e].sfileid) {
+            snprintf(job->error, sizeof(job->error), "%s isn't in the catalog", entries[e].name);
+            ok = false;
+        }
+    }
+    free(entries);
+    return ok;
+}
+
+static bool extract(lisafsVolume *vol, const char *dir, batchJob *job) {
+    lisafsEntry *entries;
+    const int count = lisafsList(vol, &entries);
+    bool ok = makeDir(dir);
+    for (int e = 0; e < count && ok; e++) {
+        char *name = entries[e].name;
+        for (int n = 0; name[n] != '\0'; n++) {
+            if (name[n] == '/') {
+                name[n] = '-';
+            }
+        }
+        char path[1100]; // dir, and a name of up to 63
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        size_t length;
+        bytes contents = lisafsReadFile(vol, entries[e].sfileid, &length);
+        FILE *output = contents != NULL ? fopen(path, "wb") : NULL;
+        ok = output != NULL && fwrite(contents, 1, length, output) == length;
+        ok = (output != NULL && fclose(output) == 0) && ok;
+        if (ok) {
+            job->bytesExtracted += (long) length;
+            job->files++;
+        } else {
+            snprintf(job->error, sizeof(job->error), "could not extract %s", entries[e].name);
+        }
+        free(contents);
+    }
+    free(entries);
+    return ok;
+}
+
+static void processImage(const batchQueue *queue, batchJob *job) {
+    const double start = nowMillis();
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", queue->inDir, job->name);
+    size_t length;
+    bytes image = readWholeFile(path, &length);
+    if (image == NULL) {
+        snprintf(job->error, sizeof(job->error), "could not read it");
+        return;
+    }
+    if (!isDC42(image, length)) {
+        size_t dc42Length;
+        bytes dc42 = lisafsConvertBLU(image, length, &dc42Length);
+        free(image);
+        if (dc42 == NULL) {
+            snprintf(job->error, sizeof(job->error), "neither a DC42 nor a BLU image");
+            return;
+        }
+        image = dc42;
+        length = dc42Length;
+        job->converted = true;
+    }
+
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/%s", queue->outDir, job->name);
+    lisafsVolume *vol = makeDir(dir) ? lisafsOpenBuffer(image, length) : NULL;
+    if (vol == NULL) {
+        snprintf(job->error, sizeof(job->error), "not a volume we can read");
+        free(image);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/image.dc42", dir);
+    job->ok = lisafsSaveImageFile(image, length, path) && verify(vol, job);
+    snprintf(path, sizeof(path), "%s/extracted", dir);
+    job->ok = job->ok && extract(vol, path, job);
+    lisafsClose(vol);
+    free(image);
+    job->millis = nowMillis() - start;
+}
+
+static void *batchWorker(void *arg) {
+    batchQueue *queue = arg;
+    while (true) {
+        pthread_mutex_lock(&queue->lock);
+        const int j = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (j >= queue->jobCount) {
+            return NULL;
+        }
+        processImage(queue, &queue->jobs[j]);
+    }
+}
+
+static int compareJobName(const void *a, const void *b) {
+    return strcmp(((const batchJob *) a)->name, ((const batchJob *) b)->name);
+}
+
+// A quoted JSON string. Lisa names can have quotes, backslashes and any other byte in them; control characters and
+// bytes past ASCII go out as \u00XX so the file stays valid JSON whatever the names are.
+static void writeJsonString(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *) text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20 || *c >= 0x7F) {
+            fprintf(out, "\\u%04X", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static bool writeSummary(const char *outDir, const batchJob *jobs, const int jobCount, const int threads, const double millis) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/summary.json", outDir);
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        printf("ERROR! Could not create %s\n", path);
+        return false;
+    }
+    int failed = 0;
+    fprintf(out, "{\n  \"threads\": %d,\n  \"millis\": %.1f,\n  \"images\": [", threads, millis);
+    for (int j = 0; j < jobCount; j++) {
+        failed += jobs[j].ok ? 0 : 1;
+        fprintf(out, "%s\n    {\"image\": ", j == 0 ? "" : ",");
+        writeJsonString(out, jobs[j].name);
+        fprintf(out, ", \"ok\": %s, \"convertedFromBLU\": %s, \"files\": %d, \"bytes\": %ld, \"millis\": %.1f",
+                jobs[j].ok ? "true" : "false", jobs[j].converted ? "true" : "false", jobs[j].files, jobs[j].bytesExtracted, jobs[j].millis);
+        if (!jobs[j].ok) {
+            fprintf(out, ", \"error\": ");
+            writeJsonString(out, jobs[j].error);
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n  ],\n  \"failed\": %d\n}\n", failed);
+    fclose(out);
+    printf("%d images, %d failed, on %d threads in %.1f ms; see %s\n", jobCount, failed, threads, millis, path);
+    return failed == 0;
+}
+
+// ./batch <in dir> <out dir> [threads]
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Usage: %s <in dir> <out dir> [threads]\n", argv[0]);
+        printf("  every BLU and DC42 image in <in dir> gets <out dir>/<image>/image.dc42 and <out dir>/<image>/extracted/\n");
+        return 1;
+    }
+    lisafsSetLogLevel(LOG_QUIET); // the summary has what matters, and the threads would interleave everything else
+    DIR *in = opendir(argv[1]);
+    if (in == NULL || !makeDir(argv[2])) {
+        printf("ERROR! Could not open %s or create %s\n", argv[1], argv[2]);
+        return 1;
+    }
+    int capacity = 64;
+    batchQueue queue = {argv[1], argv[2], malloc(capacity * sizeof(batchJob)), 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    struct dirent *dirent;
+    while ((dirent = readdir(in)) != NULL) {
+        char path[1024];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", argv[1], dirent->d_name);
+        if (dirent->d_name[0] == '.' || stat(path, &st) != 0 || !S_ISREG(st.st_mode) || strlen(dirent->d_name) >= sizeof(queue.jobs[0].name)) {
+            continue;
+        }
+        if (queue.jobCount == capacity) {
+            capacity *= 2;
+            queue.jobs = realloc(queue.jobs, capacity * sizeof(batchJob));
+        }
+        batchJob *job = &queue.jobs[queue.jobCount++];
+        memset(job, 0, sizeof(*job));
+        strcpy(job->name, dirent->d_name);
+    }
+    closedir(in);
+    qsort(queue.jobs, queue.jobCount, sizeof(batchJob), compareJobName);
+
+    long threads = argc > 3 ? strtol(argv[3], NULL, 0) : sysconf(_SC_NPROCESSORS_ONLN);
+    threads = threads < 1 ? 1 : (threads > MAX_THREADS ? MAX_THREADS : threads);
+    threads = threads > queue.jobCount && queue.jobCount > 0 ? queue.jobCount : threads;
+    pthread_t workers[MAX_THREADS];
+    const double start = nowMillis();
+    for (long t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, batchWorker, &queue);
+    }
+    for (long t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    const bool ok = writeSummary(argv[2], queue.jobs, queue.jobCount, (int) threads, nowMillis() - start);
+    free(queue.jobs);
+    return ok ? 0 : 1;
+}
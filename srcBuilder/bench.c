@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "lisafs.h"
+#include "synth.h"
+
+// Times the core operations of fixer, wsread and wswrite on synthetic volumes and writes the results as JSON,
+// one record per (volume, operation), so runs can be diffed to spot regressions.
+// Everything runs in memory: extraction and insertion are timed without the host filesystem in the way.
+
+// ---------- Constants ----------
+
+typedef struct {
+    const char *name;
+    int sectors;
+    int tagSize;
+    int fileCount;
+    int maxRun; // 0 for contiguous files
+} benchConfig;
+
+static const benchConfig CONFIGS[] = {
+    {"profile-5mb", 0x2600, PROFILE_TAG_SIZE, 16, 0},
+    {"profile-5mb", 0x2600, PROFILE_TAG_SIZE, 128, 0},
+    {"profile-5mb-fragmented", 0x2600, PROFILE_TAG_SIZE, 128, 32},
+    {"widget-10mb", 0x4C00, PROFILE_TAG_SIZE, 200, 0},
+    {"priam-10mb", 0x4C00, PRIAM_TAG_SIZE, 200, 0},
+};
+static const uint32_t MIN_FILE_SIZE = 512;
+static const uint32_t MAX_FILE_SIZE = 32 * 1024;
+static const uint32_t INSERT_SIZE = 8 * 1024;
+static const int BATCH_SIZE = 16;
+static const int MAX_WRITE_THREADS = 8;
+static const uint32_t SEED = 0x4C495341; // "LISA"
+
+// ---------- Timing ----------
+
+typedef struct {
+    double min;
+    double total;
+    int reps;
+} timing;
+
+static double nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e6) + (ts.tv_nsec / 1e3);
+}
+
+static void record(timing *t, const double micros) {
+    if (t->reps == 0 || micros < t->min) {
+        t->min = micros;
+    }
+    t->total += micros;
+    t->reps++;
+}
+
+static void emit(FILE *out, bool *first, const benchConfig *cfg, const char *op, const int count, const timing *t) {
+    fprintf(out, "%s\n    {\"volume\": \"%s\", \"sectors\": %d, \"tagSize\": %d, \"files\": %d, \"op\": \"%s\", "
+                 "\"count\": %d, \"reps\": %d, \"minMicros\": %.1f, \"meanMicros\": %.1f}",
+            *first ? "" : ",", cfg->name, cfg->sectors, cfg->tagSize, cfg->fileCount, op,
+            count, t->reps, t->min, t->total / t->reps);
+    *first = false;
+}
+
+// ---------- Benchmarks ----------
+
+static void benchConfiguration(FILE *out, bool *first, const benchConfig *cfg, const int reps) {
+    synthOptions opts = {cfg->sectors, cfg->tagSize, cfg->fileCount, MIN_FILE_SIZE, MAX_FILE_SIZE, cfg->maxRun, SEED};
+    timing t = {0};
+    for (int r = 0; r < reps; r++) {
+        size_t formattedLength;
+        const double start = nowMicros();
+        bytes formatted = lisafsFormat(cfg->sectors, cfg->tagSize, "Bench", &formattedLength);
+        record(&t, nowMicros() - start);
+        free(formatted);
+    }
+    emit(out, first, cfg, "format", 1, &t);
+    memset(&t, 0, sizeof(t));
+
+    // generating the volume is itself a decent batch insert benchmark, so keep it
+    size_t length = 0;
+    bytes base = NULL;
+    for (int r = 0; r < reps; r++) {
+        free(base);
+        const double start = nowMicros();
+        base = synthImage(&opts, &length);
+        record(&t, nowMicros() - start);
+        if (base == NULL) {
+            printf("ERROR! Could not generate %s with %d files\n", cfg->name, cfg->fileCount);
+            return;
+        }
+    }
+    emit(out, first, cfg, "synthImage", cfg->fileCount, &t);
+
+    // fixer, both ways
+    size_t bluLength = 0;
+    bytes blu = NULL;
+    memset(&t, 0, sizeof(t));
+    for (int r = 0; r < reps; r++) {
+        free(blu);
+        const double start = nowMicros();
+        blu = lisafsConvertToBLU(base, length, BLU_GUESS_TYPE, &bluLength);
+        record(&t, nowMicros() - start);
+    }
+    emit(out, first, cfg, "bluExport", 1, &t);
+    memset(&t, 0, sizeof(t));
+    for (int r = 0; r < reps; r++) {
+        size_t dc42Length;
+        const double start = nowMicros();
+        bytes dc42 = lisafsConvertBLU(blu, bluLength, &dc42Length);
+        record(&t, nowMicros() - start);
+        free(dc42);
+    }
+    free(blu);
+    emit(out, first, cfg, "fixerConvert", 1, &t);
+
+    bytes image = malloc(length);
+    memcpy(image, base, length);
+    memset(&t, 0, sizeof(t));
+    lisafsVolume *vol = NULL;
+    for (int r = 0; r < reps; r++) {
+        lisafsClose(vol);
+        const double start = nowMicros();
+        vol = lisafsOpenBuffer(image, length);
+        record(&t, nowMicros() - start);
+    }
+    emit(out, first, cfg, "open", 1, &t);
+
+    // wsread: everything, then one file by name
+    lisafsEntry *entries;
+    const int entryCount = lisafsList(vol, &entries);
+    memset(&t, 0, sizeof(t));
+    for (int r = 0; r < reps; r++) {
+        const double start = nowMicros();
+        lisafsEntry *listed;
+        const int count = lisafsList(vol, &listed);
+        for (int e = 0; e < count; e++) {
+            size_t fileLength;
+            free(lisafsReadFile(vol, listed[e].sfileid, &fileLength));
+        }
+        free(listed);
+        record(&t, nowMicros() - start);
+    }
+    emit(out, first, cfg, "readAll", entryCount, &t);
+
+    const char *middleName = entryCount > 0 ? entries[entryCount / 2].name : "";
+    memset(&t, 0, sizeof(t));
+    for (int r = 0; r < reps && entryCount > 0; r++) {
+        const double start = nowMicros();
+        const int sfileid = lisafsLookup(vol, middleName);
+        size_t fileLength;
+        free(sfileid != -1 ? lisafsReadFile(vol, (uint16_t) sfileid, &fileLength) : NULL);
+        record(&t, nowMicros() - start);
+    }
+    if (entryCount > 0) {
+        emit(out, first, cfg, "readOne", 1, &t);
+    }
+
+    // every name in the catalog, one lookup each
+    memset(&t, 0, sizeof(t));
+    for (int r = 0; r < reps; r++) {
+        const double start = nowMicros();
+        for (int e = 0; e < entryCount; e++) {
+            if (lisafsLookup(vol, entries[e].name) != entries[e].sfileid) {
+                printf("ERROR! Catalog lookup of %s failed\n", entries[e].name);
+            }
+        }
+        record(&t, nowMicros() - start);
+    }
+    emit(out, first, cfg, "catalogLookup", entryCount, &t);
+    free(entries);
+
+    memset(&t, 0, sizeof(t));
+    for (int r = 0; r < reps; r++) {
+        const double start = nowMicros();
+        vol->geo.fixChecksums(vol);
+        record(&t, nowMicros() - start);
+    }
+    emit(out, first, cfg, "checksumFixup", cfg->sectors, &t);
+    lisafsClose(vol);
+
+    // wswrite: one file, then a batch, each into a fresh copy of the volume
+    for (int batch = 1; batch <= BATCH_SIZE; batch += BATCH_SIZE - 1) {
+        memset(&t, 0, sizeof(t));
+        for (int r = 0; r < reps; r++) {
+            memcpy(image, base, length);
+            vol = lisafsOpenBuffer(image, length);
+            uint32_t state = SEED + r;
+            const double start = nowMicros();
+            for (int i = 0; i < batch; i++) {
+                char name[32];
+                snprintf(name, sizeof(name), "bench/insert%03d", i);
+                bytes data = synthFileData(&state, INSERT_SIZE, DATA);
+                lisafsWriteFile(vol, data, INSERT_SIZE, name, DATA);
+                free(data);
+            }
+            record(&t, nowMicros() - start);
+            lisafsClose(vol);
+        }
+        emit(out, first, cfg, batch == 1 ? "writeOne" : "writeBatch", batch, &t);
+    }
+
+    // the same batch through lisafsWriteFiles, with the data made up front: 1 thread is the serial path without locks
+    lisafsNewFile files[BATCH_SIZE];
+    char names[BATCH_SIZE][32];
+    uint32_t state = SEED;
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        snprintf(names[i], sizeof(names[i]), "bench/insert%03d", i);
+        files[i] = (lisafsNewFile) {synthFileData(&state, INSERT_SIZE, DATA), INSERT_SIZE, names[i], DATA, -1};
+    }
+    for (int threads = 1; threads <= MAX_WRITE_THREADS; threads *= 2) {
+        memset(&t, 0, sizeof(t));
+        for (int r = 0; r < reps; r++) {
+            memcpy(image, base, length);
+            vol = lisafsOpenBuffer(image, length);
+            const double start = nowMicros();
+            if (lisafsWriteFiles(vol, files, BATCH_SIZE, threads) != BATCH_SIZE) {
+                printf("ERROR! Not every file in the batch was written\n");
+            }
+            record(&t, nowMicros() - start);
+            lisafsClose(vol);
+        }
+        char op[32];
+        snprintf(op, sizeof(op), "writeBatch%dThreads", threads);
+        emit(out, first, cfg, op, BATCH_SIZE, &t);
+    }
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        free((void *) files[i].data);
+    }
+
+    free(image);
+    free(base);
+}
+
+// ./bench [out.json] [reps]
+int main(int argc, char *argv[]) {
+    const char *outPath = argc > 1 ? argv[1] : "bench.json";
+    const int reps = argc > 2 ? atoi(argv[2]) : 5;
+    if (reps < 1) {
+        printf("ERROR! Need at least one rep\n");
+        return 1;
+    }
+    lisafsSetLogLevel(LOG_QUIET); // printing would be most of what gets timed
+    FILE *out = fopen(outPath, "w");
+    if (out == NULL) {
+        printf("ERROR! Could not create %s\n", outPath);
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"benchmark\": \"lisa_utils\",\n  \"timestamp\": %ld,\n  \"reps\": %d,\n  \"results\": [", (long) time(NULL), reps);
+    bool first = true;
+    for (size_t c = 0; c < sizeof(CONFIGS) / sizeof(CONFIGS[0]); c++) {
+        benchConfiguration(out, &first, &CONFIGS[c], reps);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    printf("Wrote %s\n", outPath);
+    return 0;
+}
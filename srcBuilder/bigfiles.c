@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lisafs.h"
+#include "synth.h"
+
+// Writes multi-megabyte DATA and text files to freshly formatted 10MB volumes, saves them, opens them again and
+// checks that every file reads back as it went in, and that the hint sector, s-file and catalog all agree on its size.
+// Exits non-zero if anything doesn't.
+
+// ---------- Constants ----------
+
+typedef struct {
+    const char *name;
+    int sectors;
+    int tagSize;
+} bigVolume;
+
+typedef struct {
+    const char *name;
+    uint32_t size;
+    enum filetype fileType;
+} bigFile;
+
+static const bigVolume VOLUMES[] = {
+    {"widget-10mb", 0x4C00, PROFILE_TAG_SIZE},
+    {"priam-10mb", 0x4C00, PRIAM_TAG_SIZE},
+};
+static const bigFile FILES[] = {
+    {"big.data", (4 * 1024 * 1024) + 123, DATA}, // 8193 sectors, far past the old one-byte counts
+    {"big.text", 1536 * 1024, NONPASCAL},
+    {"more.data", 2 * 1024 * 1024, DATA},
+};
+static const int HINT_SECTOR_COUNT = 130;
+static const int TEXT_HEADER = 1024;
+static const uint32_t SEED = 0x4C495341; // "LISA"
+
+// ---------- Checks ----------
+
+static int failures = 0;
+
+static void check(const bool ok, const char *volume, const char *name, const char *what) {
+    if (!ok) {
+        printf("FAIL %s %s: %s\n", volume, name, what);
+        failures++;
+    }
+}
+
+// Undoes the text encoding: past the 1KB header, the zeros are block padding and 0x0D is a line break.
+static bytes decodeText(const uint8_t *data, const size_t length, size_t *decodedLength) {
+    bytes text = malloc(length);
+    *decodedLength = 0;
+    for (size_t i = TEXT_HEADER; i < length; i++) {
+        if (data[i] != 0x00) {
+            text[(*decodedLength)++] = data[i] == 0x0D ? 0x0A : data[i];
+        }
+    }
+    return text;
+}
+
+static const lisafsCatalogEntry *findCatalogEntry(const lisafsCatalogEntry *entries, const int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcasecmp(entries[i].name, name) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void checkFile(lisafsVolume *vol, const char *volume, const bigFile *file, const uint8_t *original,
+                      const lisafsCatalogEntry *catalog, const int catalogCount) {
+    const int sfileid = lisafsLookup(vol, file->name);
+    check(sfileid != -1, volume, file->name, "not in the catalog");
+    if (sfileid == -1) {
+        return;
+    }
+
+    size_t length;
+    bytes contents = lisafsReadFile(vol, sfileid, &length);
+    check(contents != NULL, volume, file->name, "could not be read");
+    if (contents == NULL) {
+        return;
+    }
+    check(length % SECTOR_SIZE == 0, volume, file->name, "not read back in whole sectors");
+    const int sectors = (int) (length / SECTOR_SIZE);
+    uint32_t logicalSize = (uint32_t) length;
+    if (file->fileType == DATA) {
+        logicalSize = file->size;
+        check(length == ((file->size + SECTOR_SIZE - 1) / SECTOR_SIZE) * SECTOR_SIZE, volume, file->name, "wrong sector count");
+        check(length >= file->size && memcmp(contents, original, file->size) == 0, volume, file->name, "contents differ");
+        bool padded = true;
+        for (size_t i = file->size; i < length; i++) {
+            padded = padded && contents[i] == 0x00;
+        }
+        check(padded, volume, file->name, "last sector isn't zero padded");
+    } else {
+        size_t textLength;
+        bytes text = decodeText(contents, length, &textLength);
+        check(textLength == file->size && memcmp(text, original, file->size) == 0, volume, file->name, "text differs");
+        free(text);
+    }
+    free(contents);
+
+    // the hint sector, its extents and the s-file all count the same sectors
+    lisafsEntry *entries;
+    const int entryCount = lisafsList(vol, &entries);
+    const lisafsEntry *entry = NULL;
+    for (int i = 0; i < entryCount; i++) {
+        if (entries[i].sfileid == sfileid) {
+            entry = &entries[i];
+        }
+    }
+    check(entry != NULL, volume, file->name, "not in the s-file");
+    if (entry != NULL) {
+        const uint8_t *hint = vol->image + DATA_OFFSET + ((size_t) entry->hintSec * SECTOR_SIZE);
+        check(((hint[HINT_SECTOR_COUNT] << 8) | hint[HINT_SECTOR_COUNT + 1]) == sectors, volume, file->name, "hint sector count is wrong");
+        check(entry->size == (uint32_t) sectors * SECTOR_SIZE, volume, file->name, "s-file size is wrong");
+    }
+    free(entries);
+
+    extent *extents;
+    const int extentCount = lisafsFileExtents(vol, sfileid, &extents);
+    int extentSectors = 0;
+    for (int e = 0; e < extentCount; e++) {
+        extentSectors += extents[e].count;
+    }
+    check(extentSectors == sectors, volume, file->name, "tag chain length is wrong");
+    if (extentCount >= 0) {
+        free(extents);
+    }
+
+    const lisafsCatalogEntry *record = findCatalogEntry(catalog, catalogCount, file->name);
+    check(record != NULL && record->sfileid == sfileid, volume, file->name, "catalog entry is missing");
+    check(record != NULL && record->size == logicalSize, volume, file->name, "catalog size is wrong");
+}
+
+// ---------- Main ----------
+
+// ./bigfiles [scratch.dc42]
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "bigfiles.dc42"; // lisafsScanCatalog reads from a file
+    lisafsSetLogLevel(LOG_QUIET);
+    const int fileCount = (int) (sizeof(FILES) / sizeof(FILES[0]));
+
+    for (size_t v = 0; v < sizeof(VOLUMES) / sizeof(VOLUMES[0]); v++) {
+        const bigVolume *volume = &VOLUMES[v];
+        uint32_t state = SEED;
+        bytes originals[sizeof(FILES) / sizeof(FILES[0])];
+        for (int f = 0; f < fileCount; f++) {
+            originals[f] = synthFileData(&state, FILES[f].size, FILES[f].fileType);
+        }
+
+        size_t length;
+        bytes image = lisafsFormat(volume->sectors, volume->tagSize, "Big", &length);
+        lisafsVolume *vol = image != NULL ? lisafsOpenBuffer(image, length) : NULL;
+        check(vol != NULL, volume->name, "-", "could not format");
+        if (vol == NULL) {
+            free(image);
+            continue;
+        }
+        for (int f = 0; f < fileCount; f++) {
+            check(lisafsWriteFile(vol, originals[f], FILES[f].size, FILES[f].name, FILES[f].fileType) != -1, volume->name, FILES[f].name, "could not be written");
+        }
+        check(lisafsSaveFile(vol, path), volume->name, "-", "could not be saved");
+        lisafsClose(vol);
+        free(image);
+
+        // everything from here on is read back from the saved image
+        vol = lisafsOpenFile(path);
+        check(vol != NULL, volume->name, "-", "could not be opened again");
+        if (vol != NULL) {
+            lisafsCatalogEntry *catalog;
+            const int catalogCount = lisafsScanCatalog(path, &catalog);
+            for (int f = 0; f < fileCount; f++) {
+                checkFile(vol, volume->name, &FILES[f], originals[f], catalog, catalogCount);
+            }
+            if (catalogCount >= 0) {
+                free(catalog);
+            }
+            lisafsClose(vol);
+        }
+        for (int f = 0; f < fileCount; f++) {
+            free(originals[f]);
+        }
+        printf("%s: %d files checked\n", volume->name, fileCount);
+    }
+    remove(path);
+
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lisafs.h"
+
+// Sector level differences between two images of the same disk, and a delta format to carry them.
+// `diff` lists the changed sectors with what they belong to and can write a delta; `apply` patches an image in place.
+//
+// A delta is big-endian, like DC42: "LISADLT" and a version byte, sectors and tag size (4 bytes each), the DC42
+// checksums (8 bytes) the image has to have before and after, the new 0x54-byte DC42 header, then runs of changed
+// sectors: first sector (4 bytes, 0xFFFFFFFF ends the delta), sector count (2 bytes), what changed (1 byte,
+// DELTA_DATA and/or DELTA_TAGS), then the new data of every sector in the run and/or the new tags.
+
+// ---------- Constants ----------
+
+static const char DELTA_MAGIC[8] = {'L', 'I', 'S', 'A', 'D', 'L', 'T', 1};
+static const uint8_t DELTA_DATA = 0x01;
+static const uint8_t DELTA_TAGS = 0x02;
+static const uint32_t DELTA_END = 0xFFFFFFFF;
+static const int COMPARE_SECTORS = 64; // compare this many sectors at a go, and only look closer when they differ
+static const int MAX_DELTA_RUN = 0xFFFF;
+
+// ---------- Functions ----------
+
+static void putLong(FILE *out, const uint32_t value) {
+    const uint8_t b[4] = {(value >> 24) & 0xFF, (value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF};
+    fwrite(b, 1, 4, out);
+}
+
+static bool getLong(FILE *in, uint32_t *value) {
+    uint8_t b[4];
+    if (fread(b, 1, 4, in) != 4) {
+        return false;
+    }
+    *value = ((uint32_t) b[0] << 24) | ((uint32_t) b[1] << 16) | ((uint32_t) b[2] << 8) | b[3];
+    return true;
+}
+
+// What changed in a sector: DELTA_DATA, DELTA_TAGS, both or neither
+static uint8_t sectorChanges(const lisafsVolume *a, const lisafsVolume *b, const int sector) {
+    const int tagSize = a->geo.tagSize;
+    uint8_t changes = 0;
+    if (memcmp(a->image + DATA_OFFSET + (sector * SECTOR_SIZE), b->image + DATA_OFFSET + (sector * SECTOR_SIZE), SECTOR_SIZE) != 0) {
+        changes |= DELTA_DATA;
+    }
+    if (memcmp(a->image + a->geo.tagOffset + (sector * tagSize), b->image + b->geo.tagOffset + (sector * tagSize), tagSize) != 0) {
+        changes |= DELTA_TAGS;
+    }
+    return changes;
+}
+
+// The same for a block of sectors at once. memcmp is about as wide a compare as the machine has, and most blocks
+// are the same, so this is where nearly all the time goes.
+static bool blockChanged(const lisafsVolume *a, const lisafsVolume *b, const int first, const int count) {
+    const int tagSize = a->geo.tagSize;
+    return memcmp(a->image + DATA_OFFSET + (first * SECTOR_SIZE), b->image + DATA_OFFSET + (first * SECTOR_SIZE), (size_t) count * SECTOR_SIZE) != 0
+           || memcmp(a->image + a->geo.tagOffset + (first * tagSize), b->image + b->geo.tagOffset + (first * tagSize), (size_t) count * tagSize) != 0;
+}
+
+static void printRun(lisafsVolume *oldVol, lisafsVolume *newVol, const int first, const int count, const uint8_t changes) {
+    char was[32];
+    char now[32];
+    lisafsDescribeSectorType(oldVol, first, was, sizeof(was));
+    lisafsDescribeSectorType(newVol, first, now, sizeof(now));
+    printf("0x%04X", first);
+    if (count > 1) {
+        printf("-0x%04X", first + count - 1);
+    }
+    printf(" %s%s%s %s", (changes & DELTA_DATA) ? "data" : "", changes == (DELTA_DATA | DELTA_TAGS) ? "+" : "",
+           (changes & DELTA_TAGS) ? "tags" : "", now[0] != '\0' ? now : "free");
+    if (strcmp(was, now) != 0) {
+        printf(" (was %s)", was[0] != '\0' ? was : "free");
+    }
+    printf("\n");
+}
+
+static void writeRun(FILE *out, lisafsVolume *oldVol, lisafsVolume *newVol, const int first, const int count, const uint8_t changes) {
+    printRun(oldVol, newVol, first, count, changes);
+    if (out == NULL) {
+        return;
+    }
+    putLong(out, (uint32_t) first);
+    fputc((count >> 8) & 0xFF, out);
+    fputc(count & 0xFF, out);
+    fputc(changes, out);
+    if (changes & DELTA_DATA) {
+        fwrite(newVol->image + DATA_OFFSET + (first * SECTOR_SIZE), 1, (size_t) count * SECTOR_SIZE, out);
+    }
+    if (changes & DELTA_TAGS) {
+        fwrite(newVol->image + newVol->geo.tagOffset + (first * newVol->geo.tagSize), 1, (size_t) count * newVol->geo.tagSize, out);
+    }
+}
+
+static int diff(const char *oldPath, const char *newPath, const char *deltaPath) {
+    lisafsVolume *oldVol = lisafsOpenMapped(oldPath);
+    lisafsVolume *newVol = oldVol != NULL ? lisafsOpenMapped(newPath) : NULL;
+    if (newVol == NULL) {
+        lisafsClose(oldVol);
+        return 1;
+    }
+    const int sectors = newVol->geo.sectors;
+    const int tagSize = newVol->geo.tagSize;
+    if (oldVol->geo.sectors != sectors || oldVol->geo.tagSize != tagSize) {
+        printf("ERROR! %s and %s aren't the same kind of disk\n", oldPath, newPath);
+        lisafsClose(oldVol);
+        lisafsClose(newVol);
+        return 1;
+    }
+
+    FILE *out = NULL;
+    if (deltaPath != NULL) {
+        out = fopen(deltaPath, "wb");
+        if (out == NULL) {
+            printf("ERROR! Could not create %s\n", deltaPath);
+            lisafsClose(oldVol);
+            lisafsClose(newVol);
+            return 1;
+        }
+        fwrite(DELTA_MAGIC, 1, sizeof(DELTA_MAGIC), out);
+        putLong(out, (uint32_t) sectors);
+        putLong(out, (uint32_t) tagSize);
+        fwrite(oldVol->image + 0x48, 1, 8, out);
+        fwrite(newVol->image + 0x48, 1, 8, out);
+        fwrite(newVol->image, 1, DATA_OFFSET, out);
+    }
+
+    int changedSectors = 0;
+    int runs = 0;
+    int runStart = -1;
+    uint8_t runChanges = 0;
+    for (int block = 0; block < sectors; block += COMPARE_SECTORS) {
+        const int blockCount = (sectors - block) < COMPARE_SECTORS ? (sectors - block) : COMPARE_SECTORS;
+        const bool changed = blockChanged(oldVol, newVol, block, blockCount);
+        // an unchanged block closes off any run in progress
+        for (int sec = block; sec < (changed ? block + blockCount : block + 1); sec++) {
+            const uint8_t changes = changed ? sectorChanges(oldVol, newVol, sec) : 0;
+            const bool sameOwner = runStart != -1 && lisafsSectorOwner(newVol, sec) == lisafsSectorOwner(newVol, runStart);
+            if (runStart != -1 && (changes != runChanges || !sameOwner || sec - runStart == MAX_DELTA_RUN)) {
+                writeRun(out, oldVol, newVol, runStart, sec - runStart, runChanges);
+                changedSectors += sec - runStart;
+                runs++;
+                runStart = -1;
+            }
+            if (runStart == -1 && changes != 0) {
+                runStart = sec;
+                runChanges = changes;
+            }
+        }
+    }
+    if (runStart != -1) { // the end of the disk closes off the last one, however many sectors the last block had
+        writeRun(out, oldVol, newVol, runStart, sectors - runStart, runChanges);
+        changedSectors += sectors - runStart;
+        runs++;
+    }
+    const bool headerChanged = memcmp(oldVol->image, newVol->image, DATA_OFFSET) != 0;
+    printf("%d of %d sectors changed, in %d runs%s\n", changedSectors, sectors, runs, headerChanged ? "; DC42 header changed" : "");
+
+    bool ok = true;
+    if (out != NULL) {
+        putLong(out, DELTA_END);
+        ok = ftell(out) > 0;
+        printf("Delta is %ld bytes\n", ftell(out));
+        ok = (fclose(out) == 0) && ok;
+        if (!ok) {
+            printf("ERROR! Could not write %s\n", deltaPath);
+        }
+    }
+    lisafsClose(oldVol);
+    lisafsClose(newVol);
+    return ok ? 0 : 1;
+}
+
+// Patch in place with pwrite, only touching the sectors in the delta, then check the result against the checksums
+// the delta says it should end up with
+static int apply(const char *imagePath, const char *deltaPath) {
+    FILE *in = fopen(deltaPath, "rb");
+    if (in == NULL) {
+        printf("ERROR! Could not open %s\n", deltaPath);
+        return 1;
+    }
+    char magic[8];
+    uint32_t sectors;
+    uint32_t tagSize;
+    uint8_t before[8];
+    uint8_t after[8];
+    uint8_t header[0x54];
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, DELTA_MAGIC, 8) != 0 || !getLong(in, &sectors) || !getLong(in, &tagSize)
+        || fread(before, 1, 8, in) != 8 || fread(after, 1, 8, in) != 8 || fread(header, 1, DATA_OFFSET, in) != (size_t) DATA_OFFSET) {
+        printf("ERROR! %s is not a delta\n", deltaPath);
+        fclose(in);
+        return 1;
+    }
+
+    const int fd = open(imagePath, O_RDWR);
+    uint8_t current[0x54];
+    if (fd == -1 || pread(fd, current, DATA_OFFSET, 0) != DATA_OFFSET) {
+        printf("ERROR! Could not open %s\n", imagePath);
+        fclose(in);
+        if (fd != -1) {
+            close(fd);
+        }
+        return 1;
+    }
+    const uint32_t dataSize = ((uint32_t) current[0x40] << 24) | ((uint32_t) current[0x41] << 16) | ((uint32_t) current[0x42] << 8) | current[0x43];
+    const uint32_t tagBytes = ((uint32_t) current[0x44] << 24) | ((uint32_t) current[0x45] << 16) | ((uint32_t) current[0x46] << 8) | current[0x47];
+    if (dataSize != sectors * SECTOR_SIZE || tagBytes != sectors * tagSize) {
+        printf("ERROR! %s isn't the kind of disk %s is for\n", imagePath, deltaPath);
+        fclose(in);
+        close(fd);
+        return 1;
+    }
+    if (memcmp(current + 0x48, before, 8) != 0) {
+        const bool alreadyApplied = memcmp(current + 0x48, after, 8) == 0;
+        printf(alreadyApplied ? "%s already has %s applied\n" : "ERROR! %s isn't the image %s was made from\n", imagePath, deltaPath);
+        fclose(in);
+        close(fd);
+        return alreadyApplied ? 0 : 1;
+    }
+
+    const off_t tagOffset = DATA_OFFSET + ((off_t) sectors * SECTOR_SIZE);
+    bytes buffer = malloc((size_t) MAX_DELTA_RUN * SECTOR_SIZE);
+    bool ok = true;
+    int patched = 0;
+    uint32_t first;
+    while (ok && (ok = getLong(in, &first)) && first != DELTA_END) {
+        const int countHigh = fgetc(in);
+        const int countLow = fgetc(in);
+        const int changes = fgetc(in);
+        const int count = (countHigh << 8) | countLow;
+        if (countLow == EOF || changes == EOF || count == 0 || first + count > sectors) {
+            ok = false;
+            break;
+        }
+        if (changes & DELTA_DATA) {
+            ok = fread(buffer, SECTOR_SIZE, count, in) == (size_t) count
+                 && pwrite(fd, buffer, (size_t) count * SECTOR_SIZE, DATA_OFFSET + ((off_t) first * SECTOR_SIZE)) == (ssize_t) count * SECTOR_SIZE;
+        }
+        if (ok && (changes & DELTA_TAGS)) {
+            ok = fread(buffer, tagSize, count, in) == (size_t) count
+                 && pwrite(fd, buffer, (size_t) count * tagSize, tagOffset + ((off_t) first * tagSize)) == (ssize_t) count * tagSize;
+        }
+        patched += count;
+    }
+    fclose(in);
+    free(buffer);
+    ok = ok && pwrite(fd, header, DATA_OFFSET, 0) == DATA_OFFSET;
+    ok = (close(fd) == 0) && ok;
+    if (!ok) {
+        printf("ERROR! Could not apply %s; %s is probably damaged now\n", deltaPath, imagePath);
+        return 1;
+    }
+
+    // the header came from the delta, so recompute the checksums from what's actually in the image now
+    lisafsVolume *vol = lisafsOpenFile(imagePath);
+    if (vol == NULL) {
+        return 1;
+    }
+    lisafsFixHeaderChecksums(vol->image, &vol->geo);
+    ok = memcmp(vol->image + 0x48, after, 8) == 0;
+    lisafsClose(vol);
+    if (!ok) {
+        printf("ERROR! %s doesn't match after applying %s\n", imagePath, deltaPath);
+        return 1;
+    }
+    printf("Patched %d sectors\n", patched);
+    return 0;
+}
+
+// Round trips a one sector change through diff and apply on freshly formatted disks, including ones whose size
+// isn't a whole number of COMPARE_SECTORS blocks, so the change can land in a partial last block. apply checks the
+// patched image against the new one's checksums, so a sector diff missed shows up as a failed apply.
+static int check(const char *scratch) {
+    static const int CHECK_SECTORS[] = {0x1000, 0x1010, 0x103F};
+    char oldPath[1024];
+    char newPath[1024];
+    char patchedPath[1024];
+    char deltaPath[1024];
+    snprintf(oldPath, sizeof(oldPath), "%s.old.dc42", scratch);
+    snprintf(newPath, sizeof(newPath), "%s.new.dc42", scratch);
+    snprintf(patchedPath, sizeof(patchedPath), "%s.patched.dc42", scratch);
+    snprintf(deltaPath, sizeof(deltaPath), "%s.delta", scratch);
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(CHECK_SECTORS) / sizeof(CHECK_SECTORS[0]); i++) {
+        const int sectors = CHECK_SECTORS[i];
+        const int changedSectors[] = {0, sectors - 1};
+        for (size_t c = 0; c < sizeof(changedSectors) / sizeof(changedSectors[0]); c++) {
+            size_t length;
+            bytes image = lisafsFormat(sectors, PROFILE_TAG_SIZE, "Delta", &length);
+            lisafsVolume *vol = image != NULL ? lisafsOpenBuffer(image, length) : NULL;
+            bool ok = vol != NULL && lisafsSaveFile(vol, oldPath) && lisafsSaveFile(vol, patchedPath);
+            if (ok) {
+                vol->image[DATA_OFFSET + (changedSectors[c] * SECTOR_SIZE) + 1] ^= 0xFF;
+                ok = lisafsSaveFile(vol, newPath) && diff(oldPath, newPath, deltaPath) == 0 && apply(patchedPath, deltaPath) == 0;
+            }
+            lisafsClose(vol);
+            free(image);
+            printf("%s: 0x%X sectors, sector 0x%X changed\n", ok ? "ok" : "FAIL", sectors, changedSectors[c]);
+            failures += ok ? 0 : 1;
+        }
+    }
+    remove(oldPath);
+    remove(newPath);
+    remove(patchedPath);
+    remove(deltaPath);
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
+
+// ./delta diff <old.dc42> <new.dc42> [out.delta]
+// ./delta apply <image.dc42> <in.delta>
+// ./delta check [scratch]
+int main(int argc, char *argv[]) {
+    lisafsSetLogLevel(LOG_QUIET);
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "diff") == 0) {
+        return diff(argv[2], argv[3], argc == 5 ? argv[4] : NULL);
+    }
+    if (argc == 4 && strcmp(argv[1], "apply") == 0) {
+        return apply(argv[2], argv[3]);
+    }
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "check") == 0) {
+        return check(argc == 3 ? argv[2] : "deltacheck");
+    }
+    printf("Usage: %s diff <old.dc42> <new.dc42> [out.delta]\n", argv[0]);
+    printf("       %s apply <image.dc42> <in.delta>\n", argv[0]);
+    printf("       %s check [scratch]\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,3194 @@
+#define _GNU_SOURCE // for fallocate and copy_file_range
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef LISAFS_STATS
+#include <time.h>
+#endif
+
+#include "lisafs.h"
+
+// ---------- Instrumentation ----------
+
+// Build with -DLISAFS_STATS to count what the hot paths do and time each phase into vol->stats.
+// Without it the counting compiles away to nothing.
+#ifdef LISAFS_STATS
+static double statsNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e6) + (ts.tv_nsec / 1e3);
+}
+#define countStat(vol, counter, n) ((void) __atomic_fetch_add(&(vol)->stats.counter, (n), __ATOMIC_RELAXED)) // lisafsWriteFiles counts from many threads
+#define startPhase(start) const double start = statsNow()
+#define endPhase(vol, phase, start) ((vol)->stats.phase += statsNow() - (start))
+#else
+#define countStat(vol, counter, n) ((void) 0)
+#define startPhase(start) ((void) 0)
+#define endPhase(vol, phase, start) ((void) 0)
+#endif
+
+// Errors always print. The rest goes through these, so a batch job can run quietly and the catalog chatter
+// is only there when asked for.
+static enum loglevel logLevel = LOG_INFO;
+#define logInfo(...) do { if (logLevel >= LOG_INFO) printf(__VA_ARGS__); } while (0)
+#define logDebug(...) do { if (logLevel >= LOG_DEBUG) printf(__VA_ARGS__); } while (0)
+
+void lisafsSetLogLevel(const enum loglevel level) {
+    logLevel = level;
+}
+
+// ---------- Locking ----------
+
+// While lisafsWriteFiles runs on several threads, nothing but the catalog takes a lock:
+// - sectors are claimed straight in the free bitmap with compare-and-swap (see claimSectorRun), so two writers
+//   can't both get one, and a writer that loses a race just looks again;
+// - s-file slots and hint file IDs are handed out by atomic counters;
+// - the MDDF's free count and next empty file are kept here and written back once the batch is done.
+// The catalog keeps one lock, since a leaf split rewrites the non-leaf block and the sibling links in place.
+struct lisafsWriteLocks {
+    pthread_mutex_t catalog; // the catalog blocks and the MDDF file count
+    int freeDelta; // what the batch has done to the free count so far
+    int nextSFile; // the next s-file slot to hand out
+};
+
+static void lockCatalog(lisafsVolume *vol) {
+    if (vol->locks != NULL) {
+        pthread_mutex_lock(&vol->locks->catalog);
+    }
+}
+
+static void unlockCatalog(lisafsVolume *vol) {
+    if (vol->locks != NULL) {
+        pthread_mutex_unlock(&vol->locks->catalog);
+    }
+}
+
+void lisafsWriteStats(lisafsVolume *vol, FILE *out) {
+    const lisafsStats *st = &vol->stats;
+#ifdef LISAFS_STATS
+    const bool enabled = true;
+#else
+    const bool enabled = false;
+#endif
+    fprintf(out, "{\n  \"enabled\": %s,\n", enabled ? "true" : "false");
+    fprintf(out, "  \"counters\": {\"sectorReads\": %llu, \"sectorWrites\": %llu, \"tagReads\": %llu, \"tagWrites\": %llu, "
+                 "\"allocations\": %llu, \"sectorsAllocated\": %llu, \"bitmapProbes\": %llu, "
+                 "\"catalogBlocksVisited\": %llu, \"catalogSplits\": %llu},\n",
+            (unsigned long long) st->sectorReads, (unsigned long long) st->sectorWrites,
+            (unsigned long long) st->tagReads, (unsigned long long) st->tagWrites,
+            (unsigned long long) st->allocations, (unsigned long long) st->sectorsAllocated,
+            (unsigned long long) st->bitmapProbes, (unsigned long long) st->catalogBlocksVisited,
+            (unsigned long long) st->catalogSplits);
+    fprintf(out, "  \"phaseMicros\": {\"load\": %.1f, \"allocation\": %.1f, \"catalog\": %.1f, \"encode\": %.1f, "
+                 "\"checksum\": %.1f, \"writeOut\": %.1f}\n}\n",
+            st->loadMicros, st->allocationMicros, st->catalogMicros, st->encodeMicros, st->checksumMicros, st->writeOutMicros);
+}
+
+// ---------- Functions ----------
+
+static uint16_t readInt(const bytes data, const int offset) {
+    assert(data != NULL);
+    return ((data[offset] & 0xFF) << 8) | ((data[offset + 1] & 0xFF));
+}
+
+static uint32_t readLong(const bytes data, const int offset) {
+    assert(data != NULL);
+    return ((data[offset] & 0xFF) << 24) | ((data[offset + 1] & 0xFF) << 16) | ((data[offset + 2] & 0xFF) << 8) | ((data[offset + 3] & 0xFF));
+}
+
+// ---------- Geometry ----------
+
+// first sector at or after 'from' whose tag carries fileId, or -1
+static inline int findFileIdKernel(lisafsVolume *vol, const int from, const uint16_t fileId, const int tagSize) {
+    const uint8_t *tags = vol->image + vol->geo.tagOffset;
+    const uint8_t hi = fileId >> 8;
+    const uint8_t lo = fileId & 0xFF;
+    for (int i = from; i < vol->geo.sectors; i++) {
+        const uint8_t *tag = tags + (i * tagSize);
+        if (tag[4] == hi && tag[5] == lo) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int findFileIdProFile(lisafsVolume *vol, const int from, const uint16_t fileId) {
+    return findFileIdKernel(vol, from, fileId, PROFILE_TAG_SIZE);
+}
+
+static int findFileIdPriam(lisafsVolume *vol, const int from, const uint16_t fileId) {
+    return findFileIdKernel(vol, from, fileId, PRIAM_TAG_SIZE);
+}
+
+// the tag checksum is the XOR of every data byte and every tag byte but itself (index 11)
+static inline uint8_t checksumKernel(const uint8_t *data, const uint8_t *tag, const int tagSize) {
+    uint64_t wide = 0;
+    for (int i = 0; i < SECTOR_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        wide ^= word;
+    }
+    wide ^= wide >> 32;
+    wide ^= wide >> 16;
+    wide ^= wide >> 8;
+    uint8_t checksumByte = wide & 0xFF;
+    for (int i = 0; i < tagSize; i++) {
+        if (i != 11) { //the checksum byte isn't included
+            checksumByte ^= tag[i];
+        }
+    }
+    return checksumByte;
+}
+
+static inline void fixChecksumsKernel(lisafsVolume *vol, const int tagSize) {
+    for (int i = 0; i < vol->geo.sectors; i++) {
+        uint8_t *tag = vol->image + vol->geo.tagOffset + (i * tagSize);
+        const uint8_t checksum = checksumKernel(vol->image + DATA_OFFSET + (i * SECTOR_SIZE), tag, tagSize);
+        if (tag[11] != checksum) { // a write, even of the same value, would cost a mapped image a page copy
+            tag[11] = checksum;
+        }
+    }
+}
+
+static void fixChecksumsProFile(lisafsVolume *vol) {
+    fixChecksumsKernel(vol, PROFILE_TAG_SIZE);
+}
+
+static void fixChecksumsPriam(lisafsVolume *vol) {
+    fixChecksumsKernel(vol, PRIAM_TAG_SIZE);
+}
+
+static bool initGeometry(lisafsVolume *vol, const uint32_t dataSize, const uint32_t tagBytes) {
+    if (dataSize == 0 || dataSize % SECTOR_SIZE != 0) {
+        printf("ERROR! Data size 0x%X is not a whole number of sectors\n", dataSize);
+        return false;
+    }
+    vol->geo.sectors = (int) (dataSize / SECTOR_SIZE);
+    vol->geo.tagSize = (int) (tagBytes / vol->geo.sectors);
+    vol->geo.tagOffset = DATA_OFFSET + (int) dataSize;
+    vol->geo.fileLength = DATA_OFFSET + (int) dataSize + (int) tagBytes;
+    if (tagBytes != (uint32_t) (vol->geo.tagSize * vol->geo.sectors)) {
+        printf("ERROR! Tag size 0x%X doesn't divide evenly between 0x%X sectors\n", tagBytes, vol->geo.sectors);
+        return false;
+    }
+    if (vol->geo.tagSize == PROFILE_TAG_SIZE) {
+        vol->geo.findFileId = findFileIdProFile;
+        vol->geo.fixChecksums = fixChecksumsProFile;
+    } else if (vol->geo.tagSize == PRIAM_TAG_SIZE) {
+        vol->geo.findFileId = findFileIdPriam;
+        vol->geo.fixChecksums = fixChecksumsPriam;
+    } else {
+        printf("ERROR! Unsupported tag size 0x%X\n", vol->geo.tagSize);
+        return false;
+    }
+    return true;
+}
+
+static bytes readSector(lisafsVolume *vol, const int sector) {
+    countStat(vol, sectorReads, 1);
+    bytes sec = malloc(SECTOR_SIZE);
+    for (int i = 0; i < SECTOR_SIZE; i++) {
+        sec[i] = 0x00;
+    }
+    const int startIdx = DATA_OFFSET + (sector * SECTOR_SIZE);
+    for (int i = 0; i < SECTOR_SIZE; i++) {
+        sec[i] = vol->image[startIdx + i];
+    }
+
+    return sec;
+}
+
+static bytes read4Sectors(lisafsVolume *vol, const int sector) {
+    countStat(vol, sectorReads, 4);
+    bytes sec = malloc(SECTOR_SIZE * 4);
+    const int startIdx = DATA_OFFSET + (sector * SECTOR_SIZE);
+    for (int i = 0; i < SECTOR_SIZE * 4; i++) {
+        sec[i] = vol->image[startIdx + i];
+    }
+
+    return sec;
+}
+
+static bytes readTag(lisafsVolume *vol, const int sector) {
+    countStat(vol, tagReads, 1);
+    bytes tag = malloc(vol->geo.tagSize);
+    const int startIdx = vol->geo.tagOffset + (sector * vol->geo.tagSize);
+    for (int i = 0; i < vol->geo.tagSize; i++) {
+        tag[i] = vol->image[startIdx + i];
+    }
+
+    return tag;
+}
+
+// straight from the image: each region's MDDF fields are written under its own lock, so copying the whole
+// sector could catch another thread halfway through a different field
+static uint16_t readMDDFInt(lisafsVolume *vol, const int offset) {
+    return readInt(vol->image + DATA_OFFSET + (vol->MDDFSec * SECTOR_SIZE), offset);
+}
+
+static uint32_t readMDDFLong(lisafsVolume *vol, const int offset) {
+    return readLong(vol->image + DATA_OFFSET + (vol->MDDFSec * SECTOR_SIZE), offset);
+}
+
+static void writeTagInt(lisafsVolume *vol, const int sector, const int offset, const uint16_t data) {
+    countStat(vol, tagWrites, 1);
+    vol->image[vol->geo.tagOffset + (sector * vol->geo.tagSize) + offset] = (data >> 8) & 0xFF;
+    vol->image[vol->geo.tagOffset + (sector * vol->geo.tagSize) + offset + 1] = data & 0xFF;
+}
+
+// uses 3 LSB
+static void writeTag3Byte(lisafsVolume *vol, const int sector, const int offset, const uint32_t data) {
+    countStat(vol, tagWrites, 1);
+    vol->image[vol->geo.tagOffset + (sector * vol->geo.tagSize) + offset] = (data >> 16) & 0xFF;
+    vol->image[vol->geo.tagOffset + (sector * vol->geo.tagSize) + offset + 1] = (data >> 8) & 0xFF;
+    vol->image[vol->geo.tagOffset + (sector * vol->geo.tagSize) + offset + 2] = data & 0xFF;
+}
+
+static void writeSector(lisafsVolume *vol, const int sector, const int offset, const uint8_t data) {
+    countStat(vol, sectorWrites, 1);
+    vol->image[DATA_OFFSET + (sector * SECTOR_SIZE) + offset] = data;
+}
+
+static void writeSectorInt(lisafsVolume *vol, const int sector, const int offset, const uint16_t data) {
+    countStat(vol, sectorWrites, 1);
+    vol->image[DATA_OFFSET + (sector * SECTOR_SIZE) + offset] = (data >> 8) & 0xFF;
+    vol->image[DATA_OFFSET + (sector * SECTOR_SIZE) + offset + 1] = data & 0xFF;
+}
+
+static void writeSectorLong(lisafsVolume *vol, const int sector, const int offset, const uint32_t data) {
+    countStat(vol, sectorWrites, 1);
+    vol->image[DATA_OFFSET + (sector * SECTOR_SIZE) + offset] = (data >> 24) & 0xFF;
+    vol->image[DATA_OFFSET + (sector * SECTOR_SIZE) + offset + 1] = (data >> 16) & 0xFF;
+    vol->image[DATA_OFFSET + (sector * SECTOR_SIZE) + offset + 2] = (data >> 8) & 0xFF;
+    vol->image[DATA_OFFSET + (sector * SECTOR_SIZE) + offset + 3] = data & 0xFF;
+}
+
+static void fillSectors(lisafsVolume *vol, const int first, const int count, const uint8_t value) {
+    countStat(vol, sectorWrites, count);
+    memset(vol->image + DATA_OFFSET + ((size_t) first * SECTOR_SIZE), value, (size_t) count * SECTOR_SIZE);
+}
+
+static void zeroSectors(lisafsVolume *vol, const int first, const int count) {
+    fillSectors(vol, first, count, 0x00);
+}
+
+static void zeroTags(lisafsVolume *vol, const int first, const int count) {
+    countStat(vol, tagWrites, count);
+    memset(vol->image + vol->geo.tagOffset + ((size_t) first * vol->geo.tagSize), 0x00, (size_t) count * vol->geo.tagSize);
+}
+
+// Tag rows for count sectors in a row from first, all in one file: the fixed fields are copied from one template
+// and only abspage, relpage and the links are filled in per sector. prevAbspage and nextAbspage are the links out
+// of the two ends of the run (0xFFFFFF for none). Index 11 is the checksum, which is fixed later.
+static void writeTagRun(lisafsVolume *vol, const int first, const int count, const uint16_t fileId, const int firstRelpage, const uint32_t prevAbspage, const uint32_t nextAbspage) {
+    countStat(vol, tagWrites, count);
+    // version, volid, file ID, dataused (0x8200 is standard)
+    const uint8_t template[8] = {0x00, 0x00, 0x00, 0x00, (fileId >> 8) & 0xFF, fileId & 0xFF, 0x82, 0x00};
+    uint8_t *tag = vol->image + vol->geo.tagOffset + ((size_t) first * vol->geo.tagSize);
+    for (int i = 0; i < count; i++, tag += vol->geo.tagSize) {
+        const uint32_t abspage = (uint32_t) (first + i - vol->MDDFSec);
+        const uint32_t fwdlink = i < count - 1 ? abspage + 1 : nextAbspage;
+        const uint32_t bkwdlink = i > 0 ? abspage - 1 : prevAbspage;
+        const int relpage = firstRelpage + i;
+        memcpy(tag, template, sizeof(template));
+        tag[8] = (abspage >> 16) & 0xFF;
+        tag[9] = (abspage >> 8) & 0xFF;
+        tag[10] = abspage & 0xFF;
+        tag[12] = (relpage >> 8) & 0xFF;
+        tag[13] = relpage & 0xFF;
+        tag[14] = (fwdlink >> 16) & 0xFF;
+        tag[15] = (fwdlink >> 8) & 0xFF;
+        tag[16] = fwdlink & 0xFF;
+        tag[17] = (bkwdlink >> 16) & 0xFF;
+        tag[18] = (bkwdlink >> 8) & 0xFF;
+        tag[19] = bkwdlink & 0xFF;
+    }
+}
+
+static void findMDDFSec(lisafsVolume *vol) {
+    vol->MDDFSec = vol->geo.findFileId(vol, 0, MDDF_FILE_ID);
+    logDebug("mddfsec: 0x%02X\n", vol->MDDFSec);
+}
+
+static void findBitmapSec(lisafsVolume *vol) {
+    vol->bitmapSec = (int) readMDDFLong(vol, MDDF_BITMAP_ADDR) + vol->MDDFSec;
+}
+
+static void findSFileSec(lisafsVolume *vol) {
+    vol->sFileSec = (int) readMDDFLong(vol, MDDF_SLIST_ADDR) + vol->MDDFSec;
+    vol->sfileBlockCount = (int) readMDDFInt(vol, MDDF_SLIST_BLOCK_COUNT);
+    logDebug("emptyfile: 0x%02X\n", readMDDFInt(vol, MDDF_EMPTY_FILE));
+}
+
+void lisafsDescribeSectorType(lisafsVolume *vol, const int sector, char *description, const size_t size) {
+    bytes tag = readTag(vol, sector);
+    const uint16_t type = readInt(tag, 4);
+    free(tag);
+    // thanks, Ray
+    if (type == BOOT_SEC_FILE_ID) {
+        snprintf(description, size, "(boot sector)");
+    } else if (type == OS_LOADER_FILE_ID) {
+        snprintf(description, size, "(OS loader)");
+    } else if (type == FREE_FILE_ID) {
+        snprintf(description, size, "%s", ""); // free
+    } else if (type == MDDF_FILE_ID) {
+        snprintf(description, size, "(MDDF)");
+    } else if (type == BITMAP_FILE_ID) {
+        snprintf(description, size, "(free bitmap)");
+    } else if (type == SFILE_FILE_ID) {
+        snprintf(description, size, "(s-file)");
+    } else if (type == CATALOG_FILE_ID) {
+        snprintf(description, size, "(catalog)");
+    } else if (type == DELETED_FILE_ID) {
+        snprintf(description, size, "<deleted>");
+    } else {
+        snprintf(description, size, "file 0x%02X", type);
+    }
+}
+
+void lisafsPrintSectorType(lisafsVolume *vol, const int sector) {
+    char description[32];
+    lisafsDescribeSectorType(vol, sector, description, sizeof(description));
+    printf("%s", description);
+}
+
+// ---------- Free bitmap ----------
+// One bit per sector from the MDDF on, set when the sector is in use, least significant bit first within each byte.
+// Scans take the bitmap 8 bytes at a time as a little-endian word, so bit k of word w is sector MDDFSec + (w * 64) + k.
+// While lisafsWriteFiles has threads writing, the bitmap is read and changed 4 bytes at a time with atomics instead.
+
+static uint8_t *bitmapBytes(lisafsVolume *vol) {
+    return vol->image + DATA_OFFSET + (vol->bitmapSec * SECTOR_SIZE);
+}
+
+// the 4 bytes of the bitmap from byte word * 4, for the atomics. Only used when they're 4-byte aligned.
+static uint32_t *bitmapWord32(lisafsVolume *vol, const int word) {
+    return (uint32_t *) (bitmapBytes(vol) + (word * 4));
+}
+
+// bits [from, to) of a 32-bit bitmap word, as a mask over its bytes in memory
+static uint32_t bitmapMask32(const int from, const int to) {
+    const uint32_t mask = (to - from == 32 ? ~0U : (1U << (to - from)) - 1) << from;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(mask);
+#else
+    return mask;
+#endif
+}
+
+// the in-use bits of the 64 sectors from MDDFSec + (word * 64). Sectors past the end of the disk read as in use.
+static uint64_t bitmapWord(lisafsVolume *vol, const int word) {
+    const int bits = vol->geo.sectors - vol->MDDFSec;
+    const int byteCount = (bits + 7) / 8;
+    const uint8_t *bitmap = bitmapBytes(vol);
+    uint64_t w = 0;
+    if ((word * 8) + 8 <= byteCount) {
+        if (vol->locks != NULL) {
+            // other writers are claiming bits while we look
+            const uint32_t halves[2] = {__atomic_load_n(bitmapWord32(vol, word * 2), __ATOMIC_RELAXED),
+                                        __atomic_load_n(bitmapWord32(vol, (word * 2) + 1), __ATOMIC_RELAXED)};
+            memcpy(&w, halves, sizeof(w));
+        } else {
+            memcpy(&w, bitmap + (word * 8), sizeof(w));
+        }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+    } else {
+        for (int b = word * 8; b < byteCount; b++) {
+            w |= (uint64_t) __atomic_load_n(&bitmap[b], __ATOMIC_RELAXED) << ((b - (word * 8)) * 8);
+        }
+    }
+    const int valid = bits - (word * 64);
+    return valid >= 64 ? w : w | (~0ULL << valid);
+}
+
+static bool isFreeSector(lisafsVolume *vol, const int sector) {
+    countStat(vol, bitmapProbes, 1);
+    const int bit = sector - vol->MDDFSec;
+    if (bit < 0 || sector >= vol->geo.sectors) {
+        return false;
+    }
+    return (bitmapBytes(vol)[bit / 8] & (1 << (bit % 8))) == 0;
+}
+
+// The first sector in [from, to) that's free (or in use, if wantFree is false), or to if there isn't one.
+// Whole words that don't have one are skipped at once.
+static int nextSectorInState(lisafsVolume *vol, const int from, const int to, const bool wantFree) {
+    if (from >= to) {
+        return to;
+    }
+    const int first = (from > vol->MDDFSec ? from : vol->MDDFSec) - vol->MDDFSec;
+    const int last = to - vol->MDDFSec;
+    int word = first / 64;
+    uint64_t w = wantFree ? ~bitmapWord(vol, word) : bitmapWord(vol, word);
+    w &= ~0ULL << (first % 64);
+    countStat(vol, bitmapProbes, 1);
+    while (w == 0) {
+        word++;
+        if (word * 64 >= last) {
+            return to;
+        }
+        w = wantFree ? ~bitmapWord(vol, word) : bitmapWord(vol, word);
+        countStat(vol, bitmapProbes, 1);
+    }
+    const int found = (word * 64) + __builtin_ctzll(w);
+    return found < last ? found + vol->MDDFSec : to;
+}
+
+static int nextFreeSector(lisafsVolume *vol, const int from, const int to) {
+    return nextSectorInState(vol, from, to, true);
+}
+
+static int nextUsedSector(lisafsVolume *vol, const int from, const int to) {
+    return nextSectorInState(vol, from, to, false);
+}
+
+// how many sectors the bitmap calls free, a word at a time
+static uint32_t countFreeSectors(lisafsVolume *vol) {
+    const int words = ((vol->geo.sectors - vol->MDDFSec) + 63) / 64;
+    uint32_t used = 0;
+    for (int w = 0; w < words; w++) {
+        used += (uint32_t) __builtin_popcountll(bitmapWord(vol, w));
+    }
+    return ((uint32_t) words * 64) - used;
+}
+
+static void adjustMDDFFreeCount(lisafsVolume *vol, const int delta) {
+    if (vol->locks != NULL) {
+        __atomic_fetch_add(&vol->locks->freeDelta, delta, __ATOMIC_RELAXED); // written back when the batch is done
+        return;
+    }
+    writeSectorLong(vol, vol->MDDFSec, MDDF_FREECOUNT, readMDDFLong(vol, MDDF_FREECOUNT) + (uint32_t) delta);
+}
+
+// Set (used) or clear the bits of count sectors in a row: bit by bit up to a byte boundary, whole bytes with
+// memset, then bit by bit again. While threads write, it's an atomic or (or and) on each 4-byte word instead.
+// Doesn't touch the MDDF's free count.
+static void markSectorRun(lisafsVolume *vol, const int first, const int count, const bool used) {
+    countStat(vol, sectorWrites, 1);
+    int bit = first - vol->MDDFSec;
+    const int end = bit + count;
+    if (vol->locks != NULL) {
+        for (; bit < end; bit = ((bit / 32) + 1) * 32) {
+            const int to = end < ((bit / 32) + 1) * 32 ? end - ((bit / 32) * 32) : 32;
+            const uint32_t mask = bitmapMask32(bit % 32, to);
+            if (used) {
+                __atomic_fetch_or(bitmapWord32(vol, bit / 32), mask, __ATOMIC_ACQ_REL);
+            } else {
+                __atomic_fetch_and(bitmapWord32(vol, bit / 32), ~mask, __ATOMIC_ACQ_REL);
+            }
+        }
+        return;
+    }
+    uint8_t *bitmap = bitmapBytes(vol);
+    for (; bit < end && bit % 8 != 0; bit++) {
+        bitmap[bit / 8] = used ? bitmap[bit / 8] | (1 << (bit % 8)) : bitmap[bit / 8] & ~(1 << (bit % 8));
+    }
+    const int wholeBytes = (end - bit) / 8;
+    memset(bitmap + (bit / 8), used ? 0xFF : 0x00, wholeBytes);
+    for (bit += wholeBytes * 8; bit < end; bit++) {
+        bitmap[bit / 8] = used ? bitmap[bit / 8] | (1 << (bit % 8)) : bitmap[bit / 8] & ~(1 << (bit % 8));
+    }
+}
+
+// Mark a run of free sectors as used, and take them off the free count in one go. While threads write, each word
+// of the run is claimed with compare-and-swap, and if any of the sectors was taken since the caller looked, what
+// was claimed is given back and it returns false. On one thread it always succeeds.
+static bool claimSectorRun(lisafsVolume *vol, const int first, const int count) {
+    if (vol->locks == NULL) {
+        markSectorRun(vol, first, count, true);
+        adjustMDDFFreeCount(vol, -count);
+        return true;
+    }
+    const int start = first - vol->MDDFSec;
+    const int end = start + count;
+    for (int bit = start; bit < end; bit = ((bit / 32) + 1) * 32) {
+        const int to = end < ((bit / 32) + 1) * 32 ? end - ((bit / 32) * 32) : 32;
+        const uint32_t mask = bitmapMask32(bit % 32, to);
+        uint32_t *word = bitmapWord32(vol, bit / 32);
+        uint32_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        do {
+            if ((old & mask) != 0) {
+                if (bit > start) {
+                    markSectorRun(vol, first, bit - start, false);
+                }
+                return false;
+            }
+        } while (!__atomic_compare_exchange_n(word, &old, old | mask, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    }
+    adjustMDDFFreeCount(vol, -count);
+    return true;
+}
+
+// the inverse of claimSectorRun
+static void releaseSectorRun(lisafsVolume *vol, const int first, const int count) {
+    markSectorRun(vol, first, count, false);
+    adjustMDDFFreeCount(vol, count);
+}
+
+/*
+AABBBBBB BBBBBBBB BBBBBB00 CCCCCCCC ???????? / ________ ________ ________ ____@@@@ @@@@____ ________ ____DDDD DDDD@@@@ @@@@EEEE EEEE____ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ______## ________ ____!!!! __##____ / (0 until end of 0x200)
+0A7B7B7B 546F6D2E 4F626A00 2E4F626A 00180000 / 002E0BF8 002E0C00 000000CC 5ED4A24A 228C0100 00000015 0E009D27 FAC7A24A 22A29D27 FACB0000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 0C005407 54000C00 00000000 4E56FEFC 206E000C 00000001 00000000 00000000 00000000 00000000 0000000A 00090001 00001BF4 000A0000  00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000
+
+A = name length (bytes)
+B = name
+C = type (".Obj")
+D = creation date (aligns with catalog listing)
+E = modification date (aligns with catalog listing)
+_ = (standardized? Check more examples?)
+@ = ascending? Looks like a date, maybe?
+# = # of sectors (?)
+! = Sector offset to first sector of data (- vol->MDDFSec)
+
+The 00090001 / 00001BF4 000A reads as an extent list: 0x0001 extent, starting at offset 0x1BF4, 0x000A sectors long.
+Fragmented files get one (offset, count) pair per extent.
+*/
+
+static void writeHintExtents(lisafsVolume *vol, const int sector, const extent *extents, const int extentCount) {
+    writeSectorInt(vol, sector, HINT_EXTENT_COUNT, extentCount);
+    for (int e = 0; e < HINT_MAX_EXTENTS; e++) {
+        const int extentOffset = HINT_FIRST_EXTENT + (e * HINT_EXTENT_LENGTH);
+        if (e < extentCount) {
+            writeSectorLong(vol, sector, extentOffset, extents[e].start - vol->MDDFSec); // offset to first sector of this run (-MDDFSec)
+            writeSectorInt(vol, sector, extentOffset + 4, extents[e].count); // number of sectors in this run
+        } else {
+            writeSectorLong(vol, sector, extentOffset, 0x00000000);
+            writeSectorInt(vol, sector, extentOffset + 4, 0x0000);
+        }
+    }
+}
+
+// collapse a chain of sectors into runs. Returns the extent count, or -1 if there are more than maxExtents.
+static int sectorsToExtents(const int *sectors, const int sectorCount, extent *extents, const int maxExtents) {
+    int extentCount = 0;
+    for (int i = 0; i < sectorCount; i++) {
+        if (extentCount > 0 && sectors[i] == extents[extentCount - 1].start + extents[extentCount - 1].count) {
+            extents[extentCount - 1].count++;
+            continue;
+        }
+        if (extentCount == maxExtents) {
+            return -1;
+        }
+        extents[extentCount].start = sectors[i];
+        extents[extentCount].count = 1;
+        extentCount++;
+    }
+    return extentCount;
+}
+
+static void writeHintEntry(lisafsVolume *vol, const int sector, const extent *extents, const int extentCount, const int sectorCount, const int nameLength, const char *name) {
+    zeroSectors(vol, sector, 1);
+    writeSector(vol, sector, 0, nameLength); //name length
+    for (int i = 0; i < nameLength; i++) { //bytes we have to write
+        writeSector(vol, sector, i + 1, name[i]);
+    }
+    writeSector(vol, sector, nameLength + 1, 0x00); //padding
+    for (int i = 0; i < 4; i++) { //bytes we have to write
+        writeSector(vol, sector, nameLength + i + 2, name[nameLength - (3 - i) - 1]);
+    }
+
+    writeSectorLong(vol, sector, 34, 0xA24A228C); // date (?)
+    writeSectorLong(vol, sector, 38, 0x01000000); // standardized (?)
+    writeSectorLong(vol, sector, 42, 0x00150E00); // this may be the serial number of the Lisa, actually. http://www.applerepairmanuals.com/lisa/deserial/pg05.html
+    writeSectorLong(vol, sector, 46, 0x9D27FAC7); // creation date (should match file)
+    writeSectorLong(vol, sector, 50, 0xA24A22A2); // date (?)
+    writeSectorLong(vol, sector, 54, 0x9D27FACB); // modification date (should match file)
+
+    writeSectorLong(vol, sector, 100, 0x4E56FEFC); // standardized (?)
+    writeSectorLong(vol, sector, 104, 0x206E000C); // standardized (?)
+    writeSectorLong(vol, sector, 108, 0x00000001); // standardized (?)
+
+    assert(sectorCount <= MAX_FILE_SECTORS);
+    writeSectorInt(vol, sector, 130, sectorCount); // number of sectors
+    writeSectorInt(vol, sector, 132, 0x0009); // standardized (?)
+    writeHintExtents(vol, sector, extents, extentCount);
+}
+
+static void claimNextFreeHintSector(lisafsVolume *vol, const int sec, const extent *extents, const int extentCount, const int sectorCount, const int nameLength, const char *name) {
+    //version
+    writeTagInt(vol, sec, 0, 0x0000);
+
+    //volid (TODO 0x0100 seems standard for this type of record at least?)
+    writeTagInt(vol, sec, 2, 0x0100);
+
+    //fileid (seems to decrement)
+    writeTagInt(vol, sec, 4, __atomic_sub_fetch(&vol->lastUsedHintIndex, 1, __ATOMIC_RELAXED));
+
+    //dataused (0x8000 seems standard)
+    writeTagInt(vol, sec, 6, 0x8000);
+
+    //abspage
+    writeTag3Byte(vol, sec, 8, sec - vol->MDDFSec);
+
+    //index 11 is a checksum we'll in later
+
+    //relpage (0x0000 always)
+    writeTagInt(vol, sec, 12, 0x0000);
+
+    //fwdlink (0xFFFFFF always)
+    writeTag3Byte(vol, sec, 14, 0xFFFFFF);
+
+    //bkwdlink (0xFFFFFF always)
+    writeTag3Byte(vol, sec, 17, 0xFFFFFF);
+
+    writeHintEntry(vol, sec, extents, extentCount, sectorCount, nameLength, name);
+}
+
+static int getSectorCount(const uint32_t fileSize) {
+    return (int) ((fileSize + SECTOR_SIZE - 1) / SECTOR_SIZE);
+}
+
+static int findNextFreeSFileIndex(lisafsVolume *vol) {
+    const uint16_t slist_packing = readMDDFInt(vol, MDDF_SLIST_PACKING); //number of s_entries per block in slist
+    int lastIdx = readMDDFInt(vol, MDDF_FIRST_FILE); //the minimum sfile we can use per the MDDF
+    uint16_t idx = 0;
+    for (int i = vol->sFileSec; i < (vol->sFileSec + vol->sfileBlockCount); i++) {
+        bytes data = readSector(vol, i);
+        for (int sfileIdx = 0; sfileIdx < slist_packing; sfileIdx++) {
+            const int srec = sfileIdx * SFILE_RECORD_LENGTH;
+            const uint32_t hintAddr = readLong(data, srec);
+            /*
+            printf("IDX = 0x%02X: ", idx);
+            printf("hintAddr = 0x%08X, ", hintAddr);
+            printf("fileAddr = 0x%08X, ", readLong(data, srec + 4));
+            printf("fileSize = 0x%08X, ", readLong(data, srec + 8));
+            printf("version = 0x%04X\n", readInt(data, srec + 12));
+            */
+            if (hintAddr != 0x00000000) { // claimed s-record
+                bytes hintTag = readTag(vol, (int) hintAddr + vol->MDDFSec);
+                const uint16_t index = readInt(hintTag, 4);
+                free(hintTag);
+                if (index < vol->lastUsedHintIndex && index != 0x0000) { //index is 0x0000 for the 4 reserved S-file entries at the start of the listing
+                    vol->lastUsedHintIndex = index;
+                }
+                lastIdx = idx;
+            }
+            idx++;
+        }
+        free(data);
+    }
+
+    lastIdx++; //next one is free, then
+    return lastIdx;
+}
+
+//returns the index of the s-file (the file ID)
+static uint16_t claimNextFreeSFileIndex(lisafsVolume *vol, const extent *extents, const int extentCount, const int sectorCount, const int nameLength, const char *name) {
+    const int whereToStart = vol->sFileSec + vol->sfileBlockCount; // TODO start after this, roughly. Might need to be more stringent
+
+    // the hint sector first, so a file that can't have one doesn't use up a slot
+    int s = whereToStart;
+    do {
+        s = nextFreeSector(vol, s, vol->geo.sectors);
+        if (s == vol->geo.sectors) {
+            printf("ERROR! No free sector for the hint of %s\n", name);
+            return -1; // no space
+        }
+    } while (!claimSectorRun(vol, s, 1)); // another writer got it first
+
+    const uint16_t slist_packing = readMDDFInt(vol, MDDF_SLIST_PACKING); //number of s_entries per block in slist
+    // while threads write, each takes the next slot off the counter; the MDDF is brought up to date after the batch
+    const int emptyFile = vol->locks != NULL ? __atomic_fetch_add(&vol->locks->nextSFile, 1, __ATOMIC_RELAXED) : readMDDFInt(vol, MDDF_EMPTY_FILE);
+    if (emptyFile >= slist_packing * vol->sfileBlockCount) {
+        printf("ERROR! The s-file has no room for %s\n", name);
+        releaseSectorRun(vol, s, 1);
+        return -1;
+    }
+
+    //claim it and return it
+    const int sFileSectorToWrite = (emptyFile / slist_packing) + vol->sFileSec;
+    const int indexWithinSectorToWrite = (emptyFile - ((sFileSectorToWrite - vol->sFileSec) * slist_packing)) * SFILE_RECORD_LENGTH; //length of srecord
+    //printf("Claiming new s-file at index=0x%04X, hint sector=0x%08X, fileAddr=0x%08X, fileSize=0x%08X\n", emptyFile, s, startSector, fileSize);
+    //TODO responsibleSector could overflow to the next one if we're unlucky. For now, don't worry about it.
+    writeSectorLong(vol, sFileSectorToWrite, indexWithinSectorToWrite, s - vol->MDDFSec); //location of our hint sector
+    writeSectorLong(vol, sFileSectorToWrite, indexWithinSectorToWrite + 4, extents[0].start - vol->MDDFSec); // fileAddr
+    writeSectorLong(vol, sFileSectorToWrite, indexWithinSectorToWrite + 8, (uint32_t) sectorCount * SECTOR_SIZE); // fileSize TODO for now, use physical since it's likely safer
+    writeSectorInt(vol, sFileSectorToWrite, indexWithinSectorToWrite + 12, 0x0000); //version
+
+    claimNextFreeHintSector(vol, s, extents, extentCount, sectorCount, nameLength, name);
+
+    if (vol->locks == NULL) {
+        const int newEmptyFile = findNextFreeSFileIndex(vol);
+        writeSectorInt(vol, vol->MDDFSec, MDDF_EMPTY_FILE, newEmptyFile);
+    }
+    return emptyFile;
+}
+
+void lisafsPrintSFile(lisafsVolume *vol) {
+    const uint16_t slist_packing = readMDDFInt(vol, MDDF_SLIST_PACKING); //number of s_entries per block in slist
+    uint16_t idx = 0;
+    for (int i = vol->sFileSec; i < (vol->sFileSec + vol->sfileBlockCount); i++) {
+        bytes data = readSector(vol, i);
+        for (int sfileIdx = 0; sfileIdx < slist_packing; sfileIdx++) {
+            const int srec = sfileIdx * SFILE_RECORD_LENGTH; //length of srecord
+            const uint32_t hintAddr = readLong(data, srec);
+            printf("IDX = 0x%02X: ", idx);
+            printf("hintAddr = 0x%08X, ", hintAddr);
+            printf("fileAddr = 0x%08X, ", readLong(data, srec + 4));
+            printf("fileSize = 0x%08X, ", readLong(data, srec + 8));
+            printf("version = 0x%04X\n", readInt(data, srec + 12));
+            idx++;
+        }
+        free(data);
+    }
+}
+
+static void findNonLeafCatalogSec(lisafsVolume *vol) {
+    // for the first moved entry, fix the non-leaf
+    vol->nonLeafCatalogSec = -1;
+    for (int d = vol->geo.findFileId(vol, 0, CATALOG_FILE_ID); d != -1; d = vol->geo.findFileId(vol, d + 1, CATALOG_FILE_ID)) {
+        //in all the possible catalogSectors. They come in 4s, always
+        bytes nonleaf = read4Sectors(vol, d);
+        if (nonleaf[0] == 0x24 && nonleaf[1] == 0x00 && nonleaf[2] == 0x00) {
+            free(nonleaf);
+            d += 3;
+            continue; //leaf
+        }
+        vol->nonLeafCatalogSec = d;
+        return;
+    }
+}
+
+static void loadWriteLayout(lisafsVolume *vol) {
+    if (vol->writeLayoutKnown) {
+        return;
+    }
+    findNonLeafCatalogSec(vol);
+    findNextFreeSFileIndex(vol); // picks up the last hint file ID in use
+    vol->writeLayoutKnown = true;
+}
+
+// returns the first sector of the 4
+static int claimNextFreeCatalogBlock(lisafsVolume *vol) {
+    for (int i = CATALOG_SEC_OFFSET; i < vol->geo.sectors; i += 4) { //let's start looking after where the directories tend to begin
+        i += ((nextFreeSector(vol, i, vol->geo.sectors) - i) / 4) * 4; // blocks with nothing free are skipped
+        if (i + 4 <= vol->geo.sectors && nextUsedSector(vol, i, i + 4) == i + 4 && claimSectorRun(vol, i, 4)) {
+            // version 0, volid 0 (TODO 0x2500 is used sometimes for this disk at least?), file ID 0x0004 (always, for
+            // catalog sectors), dataused 0x8200, then relpage 0-3, linked to each other and nothing else
+            writeTagRun(vol, i, 4, CATALOG_FILE_ID, 0, 0xFFFFFF, 0xFFFFFF);
+            // "tomorrow I want you to take those sectors to Anchorhead and have their memory erased. They belong to us now"
+            zeroSectors(vol, i, 4);
+            // inscribe the ancient sigil 0x240000 into the start of the first sector to label it as a catalog sector
+            writeSector(vol, i, 0, 0x24);
+            writeSector(vol, i, 1, 0x00);
+            writeSector(vol, i, 2, 0x00);
+
+            writeSector(vol, i, SECTOR_SIZE - 11, 0x00); //0 valid entries here.
+
+            for (int j = 0; j < 32; j++) { //let's try 32
+                writeSectorInt(vol, i+3, SECTOR_SIZE - 14 - (j * 2), j * CATALOG_RECORD_LENGTH); // set up the special index entries (not sure of the actual name)
+            }
+
+            writeSectorLong(vol, i + 3, SECTOR_SIZE - 10, 0xFFFFFFFF); //10-9-8-7
+            writeSectorLong(vol, i + 3, SECTOR_SIZE - 6, 0xFFFFFFFF); //6-5-4-3
+
+            writeSectorInt(vol, i + 3, SECTOR_SIZE - 2, 0x00FF); //2-1 standard
+
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns true if a < b, false otherwise (case insensitive)
+static bool ci_a_before_b(const char *a, const int a_len, const char *b, const int b_len) {
+    int i = 0;
+    const int min_len = (a_len < b_len) ? a_len : b_len;
+
+    for (i = 0; i < min_len; i++) {
+        const int ac = toupper((unsigned char) a[i]);
+        const int bc = toupper((unsigned char) b[i]);
+        if (ac != bc) {
+            return ac < bc;
+        }
+    }
+
+    // If equal so far, decide based on length
+    return a_len < b_len;
+}
+
+static void incrementMDDFFileCount(lisafsVolume *vol) {
+    uint16_t fileCount = readMDDFInt(vol, MDDF_FILECOUNT);
+    fileCount++;
+    writeSectorInt(vol, vol->MDDFSec, MDDF_FILECOUNT, fileCount);
+}
+
+static void writeCatalogEntry(lisafsVolume *vol, const int offset, const int nextFreeSFileIndex, const uint32_t fileSize, const int sectorCount, const int nameLength, const char *name) {
+    const uint32_t physicalSize = (uint32_t) sectorCount * SECTOR_SIZE;
+
+    assert(vol->image != NULL);
+
+    vol->image[offset] = 0x24;
+
+    // write name
+    // 35 bytes total, padded with 0x00
+    vol->image[offset + 1] = 0x00;
+    vol->image[offset + 2] = 0x00;
+    int idx = 3;
+    for (int i = 0; i < nameLength; i++) {
+        vol->image[offset + idx] = name[i];
+        idx++;
+    }
+    while (idx < 36) {
+        vol->image[offset + idx] = 0x00;
+        idx++;
+    }
+
+    const uint8_t restOfEntry[] = {
+        0x03, 0x06, //we're a file (lisa says 0x0306)
+        (nextFreeSFileIndex >> 8) & 0xFF, nextFreeSFileIndex & 0xFF, //sfile
+        0x9D, 0x27, 0xFA, 0x88, //creation date (this one is random, but I know it works)
+        0x9D, 0x27, 0xFA, 0x8F, //modification date (this one is random, but I know it works)
+        (fileSize >> 24) & 0xFF, (fileSize >> 16) & 0xFF, (fileSize >> 8) & 0xFF, fileSize & 0xFF, //file size
+        (physicalSize >> 24) & 0xFF, (physicalSize >> 16) & 0xFF, (physicalSize >> 8) & 0xFF, physicalSize & 0xFF, //physical file size (plus extra to fit sector bounds)
+        0x00, 0x01, //fsOvrhd (? - I know this one works so let's just use it for now),
+        0x00, 0xF7, //flags (lisa says 0x00F7)
+        0xCE, 0x06, 0x00, 0x00 //fileUnused (lisa says 0xCE060000)
+    };
+    // write the rest
+    for (int i = 0; i < (CATALOG_RECORD_LENGTH - 36); i++) {
+        vol->image[offset + idx] = restOfEntry[i];
+        idx++;
+    }
+    incrementMDDFFileCount(vol);
+}
+
+static uint8_t getCatalogEntryCountForBlock(lisafsVolume *vol, const int dirSec) {
+    bytes sec = readSector(vol, dirSec + 3);
+    const uint8_t count = sec[SECTOR_SIZE - 11];
+    free(sec);
+    return count;
+}
+
+static void claimNewCatalogEntrySpace(lisafsVolume *vol, const int dirSec, const int entryOffset, const int sfileid, const uint32_t fileSize, const int sectorCount, const int nameLength, const char *name) {
+    const int entry = getCatalogEntryCountForBlock(vol, dirSec) + 1;
+    writeSector(vol, dirSec + 3, SECTOR_SIZE - 11, entry); //claim another valid entry in this sector
+    writeCatalogEntry(vol, DATA_OFFSET + (dirSec * SECTOR_SIZE) + entryOffset, sfileid, fileSize, sectorCount, nameLength, name);
+}
+
+// given a filename, return the beginning sector number of the relevant catalog block.
+// - if contained by an existing block, return that block regardless if it has space or not
+// - if not contained by an existing block, return the block that ends closest (alphanumerically) to the filename, regardless if it has space or not
+static int findRelevantCatalogSector(lisafsVolume *vol, const int nameLength, const char *name) {
+    int closestDirSec = -1;
+    char *closestDirName = NULL;
+    const int first = (int) readMDDFLong(vol, MDDF_ROOT_PAGE);
+    int dirSec = first;
+    while (dirSec != -1) {
+        countStat(vol, catalogBlocksVisited, 1);
+        bytes dirBlock = read4Sectors(vol, dirSec);
+        int offsetToFirstEntry = 0;
+        if (dirSec == first) {
+            closestDirSec = dirSec; // if we're the first entry, we'll need somewhere to go
+            offsetToFirstEntry = CATALOG_FIRST_BLOCK_OFFSET; //seems to be the case for the first catalog sector block only
+        }
+
+        const uint8_t validEntryCount = getCatalogEntryCountForBlock(vol, dirSec);
+        const int firstEntryOffset = offsetToFirstEntry;
+        const int lastEntryOffset = offsetToFirstEntry + ((validEntryCount - 1) * CATALOG_RECORD_LENGTH);
+
+        const bool nameBeforeFirst = ci_a_before_b(name, nameLength, (char *) dirBlock + firstEntryOffset + 3, 32);
+        const bool nameBeforeLast = ci_a_before_b(name, nameLength, (char *) dirBlock + lastEntryOffset + 3, 32);
+
+        if (!nameBeforeFirst && nameBeforeLast) {
+            free(dirBlock);
+            if (closestDirName != NULL) {
+                free(closestDirName);
+            }
+            logDebug("Contained in a block!\n");
+            return dirSec; // this block contains us
+        }
+
+        if (!nameBeforeLast) { //if this block ends before us
+            if (closestDirName == NULL) { //the first time
+                closestDirName = (char *) malloc(32 * sizeof(char));
+                for (int i = 0; i < 32; i++) {
+                    closestDirName[i] = (char) dirBlock[lastEntryOffset + 3 + i];
+                }
+                closestDirSec = dirSec;
+            } else {
+                // compare the endings to see who's closer. Keep a running count
+                const bool lastAfterRunningClosest = ci_a_before_b(closestDirName, 32, (char *) dirBlock + lastEntryOffset + 3, 32);
+                if (lastAfterRunningClosest) {
+                    for (int i = 0; i < 32; i++) {
+                        closestDirName[i] = (char) dirBlock[lastEntryOffset + 3 + i];
+                    }
+                    closestDirSec = dirSec;
+                    logDebug("closestDirSec now = %d\n", closestDirSec);
+                }
+            }
+        }
+
+        free(dirBlock);
+
+        bytes sec = readSector(vol, dirSec + 3);
+        const uint32_t next = readLong(sec, SECTOR_SIZE - 6);
+        free(sec);
+        if (next == 0xFFFFFFFF) {
+            dirSec = -1;
+        } else {
+            dirSec = (int) next + vol->MDDFSec;
+        }
+    }
+
+    if (closestDirName != NULL) {
+        free(closestDirName);
+    }
+    logDebug("Not contained in any sector\n");
+    return closestDirSec; // we weren't contained in any, so return the closest one
+}
+
+static int getEntryToMove(bytes dirBlock, const int offsetToFirstEntry, const int entryCount, const char *name, const int nameLength, const int recordLength, const int nameOffset) {
+    for (int e = 0; e < entryCount; e++) {
+        const int entryOffset = offsetToFirstEntry + (e * recordLength);
+        const bool nameBeforeExistingEntry = ci_a_before_b(name, nameLength, (char *) dirBlock + entryOffset + nameOffset, 32);
+        if (nameBeforeExistingEntry) {
+            return e;
+        }
+    }
+    return entryCount;
+}
+
+static void claimNewCatalogEntry(lisafsVolume *vol, const uint16_t sfileid, const uint32_t fileSize, const int sectorCount, const int nameLength, const char *name) {
+    const int firstCatalogSector = (int) readMDDFLong(vol, MDDF_ROOT_PAGE);
+    const int relevantCatalogSec = findRelevantCatalogSector(vol, nameLength, name);
+    uint8_t entryCount = getCatalogEntryCountForBlock(vol, relevantCatalogSec);
+    logDebug("The relevant catalog sec is: 0x%02X and the count is 0x%02X, and the variable is 0x%02X\n", relevantCatalogSec, getCatalogEntryCountForBlock(vol, relevantCatalogSec), entryCount);
+    int offsetToFirstEntry = 0;
+    const bool catalogFull = (entryCount == 0x1E);
+    if (relevantCatalogSec == firstCatalogSector) { //TODO this is a hack to handle the fact there's a directory in the first catalog block.
+        offsetToFirstEntry = CATALOG_FIRST_BLOCK_OFFSET;
+        entryCount--;
+    }
+    bytes dirBlock = read4Sectors(vol, relevantCatalogSec);
+    const int entryToMove = getEntryToMove(dirBlock, offsetToFirstEntry, entryCount, name, nameLength, CATALOG_RECORD_LENGTH, 3);
+
+    if (!catalogFull) { // if there's space to add the new entry to this block
+        if (entryToMove != -1) { // if we fit in the middle
+            const int entryOffset = offsetToFirstEntry + (entryToMove * CATALOG_RECORD_LENGTH);
+            const int catalogEntryOffset = DATA_OFFSET + (relevantCatalogSec * SECTOR_SIZE) + entryOffset; //offset to the place to write in the file
+            logDebug("Found space for a new catalog entry (shifting) at offset 0x%X\n", catalogEntryOffset);
+            //shift
+            for (int rest = entryToMove; rest < entryCount; rest++) {
+                const int originalOffsetOfEntryWithinBlock = offsetToFirstEntry + (rest * CATALOG_RECORD_LENGTH);
+                const int destinationOffsetOfEntryWithinBlock = originalOffsetOfEntryWithinBlock + CATALOG_RECORD_LENGTH;
+                for (int eIdx = 0; eIdx < CATALOG_RECORD_LENGTH; eIdx++) {
+                    const int off = originalOffsetOfEntryWithinBlock + eIdx;
+                    vol->image[DATA_OFFSET + (SECTOR_SIZE * relevantCatalogSec) + destinationOffsetOfEntryWithinBlock + eIdx] = dirBlock[off];
+                }
+            }
+
+            claimNewCatalogEntrySpace(vol, relevantCatalogSec, entryOffset, sfileid, fileSize, sectorCount, nameLength, name);
+            free(dirBlock);
+            return;
+        }
+        //if we have space at the end
+        logDebug("We fit at the end.\n");
+        const int entryOffset = offsetToFirstEntry + (CATALOG_RECORD_LENGTH * entryCount);
+        logDebug("Found space for a new catalog entry (appending) at offset 0x%X\n", entryOffset);
+        claimNewCatalogEntrySpace(vol, relevantCatalogSec, entryOffset, sfileid, fileSize, sectorCount, nameLength, name);
+        free(dirBlock);
+    } else {
+        //no space found, so let's make some
+        countStat(vol, catalogSplits, 1);
+        logDebug("No space found for a new entry (entryCount = 0x%02X). Creating some...\n", entryCount);
+        const int nextFreeBlock = claimNextFreeCatalogBlock(vol);
+        logDebug("Space to create new catalog block claimed at sector = %d\n", nextFreeBlock);
+        logDebug("Entry index to move from old block is: 0x%02X\n", entryToMove);
+        int movedEntries = 0;
+        bool first = true;
+        char *firstname = malloc(36 * sizeof(char));
+        for (int e = (3 * entryCount) / 4; e < entryCount; e++) { // move 3/4 to the new block
+            const int entryOffsetInSource = offsetToFirstEntry + (e * CATALOG_RECORD_LENGTH);
+            const int entryOffsetInDestination = (movedEntries * CATALOG_RECORD_LENGTH);
+            if (first) {
+                first = false;
+                for (int i = 0; i < 36; i++) {
+                    firstname[i] = (char) vol->image[DATA_OFFSET + (relevantCatalogSec * SECTOR_SIZE) + entryOffsetInSource + 3 + i];
+                }
+            }
+            for (int j = 0; j < CATALOG_RECORD_LENGTH; j++) {
+                vol->image[DATA_OFFSET + (nextFreeBlock * SECTOR_SIZE) + entryOffsetInDestination + j] = vol->image[DATA_OFFSET + (relevantCatalogSec * SECTOR_SIZE) + entryOffsetInSource + j];
+            }
+            movedEntries++;
+        }
+
+        // for the first moved entry, fix the non-leaf
+        bytes nonleaf = read4Sectors(vol, vol->nonLeafCatalogSec);
+        const int nonLeafEntryCount = vol->image[DATA_OFFSET + (SECTOR_SIZE * (vol->nonLeafCatalogSec + 3 + 1)) - 11];
+        const int nonLeafEntryToMove = getEntryToMove(nonleaf, 0, nonLeafEntryCount, firstname, 32, CATALOG_NONLEAF_RECORD_LENGTH, 7);
+
+        for (int rest = nonLeafEntryToMove; rest < nonLeafEntryCount; rest++) {
+            logDebug("Moving entry at index = %d: ", rest);
+            const int originalOffsetOfNonLeafEntryWithinBlock = (rest * CATALOG_NONLEAF_RECORD_LENGTH);
+            const int destinationOffsetOfNonLeafEntryWithinBlock = originalOffsetOfNonLeafEntryWithinBlock + CATALOG_NONLEAF_RECORD_LENGTH;
+            for (int eIdx = 0; eIdx < CATALOG_NONLEAF_RECORD_LENGTH; eIdx++) {
+                const int off = originalOffsetOfNonLeafEntryWithinBlock + eIdx;
+                vol->image[DATA_OFFSET + (SECTOR_SIZE * vol->nonLeafCatalogSec) + destinationOffsetOfNonLeafEntryWithinBlock + eIdx] = nonleaf[off];
+            }
+        }
+
+        const int os = nonLeafEntryToMove * CATALOG_NONLEAF_RECORD_LENGTH;
+        logDebug("Writing new nonleaf entry to offset = 0x%02X\n", DATA_OFFSET + (SECTOR_SIZE * vol->nonLeafCatalogSec) + os);
+        const uint32_t newBk = (uint32_t) (nextFreeBlock - vol->MDDFSec);
+        vol->image[DATA_OFFSET + (SECTOR_SIZE * vol->nonLeafCatalogSec) + os] = (newBk >> 24) & 0xFF;
+        vol->image[DATA_OFFSET + (SECTOR_SIZE * vol->nonLeafCatalogSec) + os + 1] = (newBk >> 16) & 0xFF;
+        vol->image[DATA_OFFSET + (SECTOR_SIZE * vol->nonLeafCatalogSec) + os + 2] = (newBk >> 8) & 0xFF;
+        vol->image[DATA_OFFSET + (SECTOR_SIZE * vol->nonLeafCatalogSec) + os + 3] = newBk & 0xFF;
+
+        vol->image[DATA_OFFSET + (SECTOR_SIZE * vol->nonLeafCatalogSec) + os + 4] = 0x24;
+        vol->image[DATA_OFFSET + (SECTOR_SIZE * vol->nonLeafCatalogSec) + os + 5] = 0x00;
+        vol->image[DATA_OFFSET + (SECTOR_SIZE * vol->nonLeafCatalogSec) + os + 6] = 0x00;
+        for (int kk = 0; kk < 32; kk++) {
+            vol->image[DATA_OFFSET + (SECTOR_SIZE * vol->nonLeafCatalogSec) + os + 7 + kk] = firstname[kk];
+        }
+        vol->image[DATA_OFFSET + (SECTOR_SIZE * (vol->nonLeafCatalogSec + 3 + 1)) - 11] = nonLeafEntryCount + 1; //increment entry count
+        free(nonleaf);
+        free(firstname);
+
+        // fix valid counts
+        writeSector(vol, relevantCatalogSec + 3, SECTOR_SIZE - 11, getCatalogEntryCountForBlock(vol, relevantCatalogSec) - movedEntries);
+        writeSector(vol, nextFreeBlock + 3, SECTOR_SIZE - 11, movedEntries);
+
+        bytes srcSec = readSector(vol, relevantCatalogSec + 3);
+        const uint32_t forward = readLong(srcSec, SECTOR_SIZE - 6);
+        free(srcSec);
+
+        // fix linked list of blocks
+        writeSectorLong(vol, relevantCatalogSec + 3, SECTOR_SIZE - 6, (uint32_t) (nextFreeBlock - vol->MDDFSec));
+        if (forward != 0xFFFFFFFF) { // splitting the last block leaves no next block to point back at us
+            writeSectorLong(vol, (int) forward + vol->MDDFSec + 3, SECTOR_SIZE - 10, (uint32_t) (nextFreeBlock - vol->MDDFSec));
+        }
+
+        writeSectorLong(vol, nextFreeBlock + 3, SECTOR_SIZE - 10, (uint32_t) (relevantCatalogSec - vol->MDDFSec));
+        writeSectorLong(vol, nextFreeBlock + 3, SECTOR_SIZE - 6, forward);
+
+        // recursively re-call this because we have more space now
+        claimNewCatalogEntry(vol, sfileid, fileSize, sectorCount, nameLength, name);
+    }
+}
+
+static void fixAllTagChecksums(lisafsVolume *vol) {
+    vol->geo.fixChecksums(vol);
+}
+
+// the sectors need to have been claimed with reserveExtents already
+static void writeFileTagBytes(lisafsVolume *vol, const extent *extents, const int extentCount, const uint16_t sfileid) {
+    int relpage = 0;
+    for (int e = 0; e < extentCount; e++) {
+        // the chain runs on from the end of the last extent to the start of the next
+        const uint32_t prevAbspage = e > 0 ? (uint32_t) (extents[e - 1].start + extents[e - 1].count - 1 - vol->MDDFSec) : 0xFFFFFF;
+        const uint32_t nextAbspage = e < extentCount - 1 ? (uint32_t) (extents[e + 1].start - vol->MDDFSec) : 0xFFFFFF;
+        writeTagRun(vol, extents[e].start, extents[e].count, sfileid, relpage, prevAbspage, nextAbspage);
+        relpage += extents[e].count;
+    }
+}
+
+// mark the data sectors as used before anything else (hint sector, catalog block) goes looking for free space
+// Returns false, with nothing claimed, if another writer took any of the sectors first
+static bool reserveExtents(lisafsVolume *vol, const extent *extents, const int extentCount) {
+    for (int e = 0; e < extentCount; e++) {
+        if (!claimSectorRun(vol, extents[e].start, extents[e].count)) {
+            for (int r = 0; r < e; r++) {
+                releaseSectorRun(vol, extents[r].start, extents[r].count);
+            }
+            return false;
+        }
+    }
+    countStat(vol, allocations, extentCount);
+    for (int e = 0; e < extentCount; e++) {
+        countStat(vol, sectorsAllocated, extents[e].count);
+    }
+    return true;
+}
+
+static void releaseExtents(lisafsVolume *vol, const extent *extents, const int extentCount) {
+    for (int e = 0; e < extentCount; e++) {
+        releaseSectorRun(vol, extents[e].start, extents[e].count);
+    }
+}
+
+// New files only go between these, and every search for free space uses the same window
+static int allocationStart(const lisafsVolume *vol) {
+    return vol->MDDFSec + 0x401; //TODO let's start a bit in to be safe. Also start at the end to avoid clobbering by Lisa
+}
+
+static int allocationEnd(const lisafsVolume *vol) {
+    return vol->geo.sectors - 0x400;
+}
+
+// the last place (as close to the end as it goes) with contiguousSectors free in a row
+static int findStartingSector(lisafsVolume *vol, const int contiguousSectors) {
+    const int from = allocationStart(vol);
+    const int to = allocationEnd(vol);
+    int found = -1;
+    for (int i = nextFreeSector(vol, from, to); i < to; ) {
+        const int runEnd = nextUsedSector(vol, i, to);
+        if (runEnd - i >= contiguousSectors) {
+            found = runEnd - contiguousSectors;
+        }
+        i = nextFreeSector(vol, runEnd, to);
+    }
+    return found;
+}
+
+static int compareExtentLengthDescending(const void *a, const void *b) {
+    return ((const extent *) b)->count - ((const extent *) a)->count;
+}
+
+static int compareExtentStart(const void *a, const void *b) {
+    return ((const extent *) a)->start - ((const extent *) b)->start;
+}
+
+// the free runs in the same window findStartingSector searches. Returns how many were found.
+static int findFreeRuns(lisafsVolume *vol, extent **runs) {
+    int runCount = 0;
+    int capacity = 64;
+    *runs = malloc(capacity * sizeof(extent));
+    const int to = allocationEnd(vol);
+    for (int i = nextFreeSector(vol, allocationStart(vol), to); i < to; ) {
+        const int runEnd = nextUsedSector(vol, i, to);
+        if (runCount == capacity) {
+            capacity *= 2;
+            *runs = realloc(*runs, capacity * sizeof(extent));
+        }
+        (*runs)[runCount].start = i;
+        (*runs)[runCount].count = runEnd - i;
+        runCount++;
+        i = nextFreeSector(vol, runEnd, to);
+    }
+    return runCount;
+}
+
+// Satisfies a request from as few free runs as possible: biggest runs first, then the tightest run that
+// holds whatever is left. Returns the number of extents (sorted by position on disk), or -1 if it can't be done.
+static int findFragmentedExtents(lisafsVolume *vol, const int sectorCount, extent *extents, const int maxExtents) {
+    extent *runs;
+    const int runCount = findFreeRuns(vol, &runs);
+    qsort(runs, runCount, sizeof(extent), compareExtentLengthDescending);
+
+    int extentCount = 0;
+    int remaining = sectorCount;
+    int r = 0;
+    while (remaining > 0 && r < runCount && extentCount < maxExtents) {
+        if (runs[r].count >= remaining) {
+            // runs are sorted longest first, so the last one that still fits is the tightest
+            int best = r;
+            while (best + 1 < runCount && runs[best + 1].count >= remaining) {
+                best++;
+            }
+            extents[extentCount].start = runs[best].start;
+            extents[extentCount].count = remaining;
+            extentCount++;
+            remaining = 0;
+        } else {
+            extents[extentCount++] = runs[r];
+            remaining -= runs[r].count;
+            r++;
+        }
+    }
+    free(runs);
+    if (remaining > 0) {
+        return -1;
+    }
+    qsort(extents, extentCount, sizeof(extent), compareExtentStart);
+    return extentCount;
+}
+
+// Text types get the 1KB header, Lisa line breaks and padding so no line crosses a 1KB block; data goes in as it is.
+// Returns the encoded contents, padded out to whole sectors, with their length in *encodedLength, or NULL if the
+// text can't be laid out that way.
+static bytes encodeFileData(const uint8_t *filedata, const size_t rawFileSize, const enum filetype fileType, size_t *encodedLength, uint32_t *encodedFileSize) {
+    const int BLOCK_SIZE = SECTOR_SIZE * 2;
+
+    // write the data to a buffer
+    // Enough memory for the file: padding only starts a new block after at least BLOCK_SIZE - 0x190 bytes of text,
+    // so text at most doubles, plus the header and the final block
+    bytes dataBuf = malloc((rawFileSize * 2) + (3 * BLOCK_SIZE));
+    size_t bytesWritten = 0;
+    if (fileType == PASCAL || fileType == NONPASCAL) {
+        for (int i = 0; i < BLOCK_SIZE; i++) { //1KB of header on text files
+            dataBuf[bytesWritten++] = 0x00;
+        }
+    }
+    uint32_t fileSize;
+    if (fileType == DATA) {
+        // data goes in byte for byte, padded out to the last sector
+        memcpy(dataBuf, filedata, rawFileSize);
+        bytesWritten = rawFileSize;
+        fileSize = (uint32_t) rawFileSize;
+        while (bytesWritten % SECTOR_SIZE != 0) {
+            dataBuf[bytesWritten++] = 0x00;
+        }
+    } else {
+        bool justWroteSemi = false;
+        bool justWroteNewline = false;
+        for (size_t i = 0; i < rawFileSize; i++) { // for every byte of the input data
+            uint8_t b = filedata[i];
+            if (b == 0x0A) {
+                b = 0x0D; //replace Mac style line breaks with Lisa style
+            }
+            if ((fileType == PASCAL || fileType == NONPASCAL) && (bytesWritten % BLOCK_SIZE == BLOCK_SIZE - 1)) {
+                printf("ERROR! There was no padding added here: a line is too long for a 1KB text block.\n");
+                free(dataBuf);
+                return NULL;
+            }
+            if (bytesWritten % BLOCK_SIZE > (BLOCK_SIZE - 0x190) && justWroteNewline) {
+                const int padding = BLOCK_SIZE - (bytesWritten % BLOCK_SIZE);
+                for (int j = 0; j < padding; j++) {
+                    //write the footer to each sector
+                    dataBuf[bytesWritten++] = 0x00;
+                }
+                dataBuf[bytesWritten++] = b;
+                justWroteNewline = false;
+            } else {
+                dataBuf[bytesWritten++] = b;
+                if (b == ';' || b == '}' || b == ')') {
+                    justWroteSemi = true;
+                    justWroteNewline = false;
+                } else if (b == 0x0D) {
+                    if (justWroteSemi || fileType != PASCAL) {
+                        justWroteNewline = true;
+                    } else {
+                        justWroteSemi = false;
+                        justWroteNewline = false;
+                    }
+                } else {
+                    justWroteSemi = false;
+                    justWroteNewline = false;
+                }
+            }
+        }
+        const int remaining = BLOCK_SIZE - (bytesWritten % BLOCK_SIZE);
+        for (int i = 0; i < remaining; i++) {
+            dataBuf[bytesWritten++] = 0x00;
+        }
+        fileSize = (uint32_t) bytesWritten;
+    }
+    *encodedLength = bytesWritten;
+    *encodedFileSize = fileSize;
+    return dataBuf;
+}
+
+// Contiguous if there's a run big enough, otherwise as few pieces as possible. The sectors are marked as used before
+// returning. Returns the extent count, or -1 if there isn't the space. While threads write, another writer can claim
+// some of what was found before this one does, so then it just looks again.
+static int allocateExtents(lisafsVolume *vol, const int sectorCount, extent *extents, const char *name) {
+    int extentCount;
+    do {
+        extentCount = 1;
+        extents[0].start = findStartingSector(vol, sectorCount); // allocate contiguously to be nice about it
+        extents[0].count = sectorCount;
+        if (extents[0].start == -1) {
+            // no single run is big enough, so fall back to as few pieces as possible
+            extentCount = findFragmentedExtents(vol, sectorCount, extents, HINT_MAX_EXTENTS);
+            if (extentCount == -1) {
+                printf("ERROR! Not enough free space for %s\n", name);
+                return -1;
+            }
+            logInfo("No contiguous run of %d sectors, using %d extents\n", sectorCount, extentCount);
+        }
+    } while (!reserveExtents(vol, extents, extentCount));
+    return extentCount;
+}
+
+// The s-record, hint sector and catalog entry. Returns the file's s-file index, or -1 (with the extents released).
+static int catalogFile(lisafsVolume *vol, const extent *extents, const int extentCount, const int sectorCount, const uint32_t fileSize, const char *name) {
+    const int nameLength = (int) strlen(name);
+    const uint16_t sfileid = claimNextFreeSFileIndex(vol, extents, extentCount, sectorCount, nameLength, name);
+    if (sfileid == (uint16_t) -1) {
+        releaseExtents(vol, extents, extentCount);
+        return -1;
+    }
+    lockCatalog(vol);
+    claimNewCatalogEntry(vol, sfileid, fileSize, sectorCount, nameLength, name);
+    unlockCatalog(vol);
+    return sfileid;
+}
+
+// A name that fits the catalog record (and so the hint sector, which has room for more). Prints why if it doesn't.
+static bool checkFileName(const char *name) {
+    const size_t nameLength = strlen(name);
+    if (nameLength == 0 || nameLength > (size_t) CATALOG_MAX_NAME_LENGTH) {
+        printf("ERROR! Not writing %s: names have to be 1 to %d characters\n", name, CATALOG_MAX_NAME_LENGTH);
+        return false;
+    }
+    return true;
+}
+
+// Needs no lock: once the extents are reserved, their sectors and tag rows belong to this file alone
+static void copyFileData(lisafsVolume *vol, const uint8_t *dataBuf, const extent *extents, const int extentCount, const uint16_t sfileid) {
+    size_t copied = 0;
+    for (int e = 0; e < extentCount; e++) {
+        const size_t length = (size_t) extents[e].count * SECTOR_SIZE;
+        countStat(vol, sectorWrites, extents[e].count); // whole sectors filled, like fillSectors
+        memcpy(vol->image + DATA_OFFSET + ((size_t) extents[e].start * SECTOR_SIZE), dataBuf + copied, length);
+        copied += length;
+    }
+    writeFileTagBytes(vol, extents, extentCount, sfileid);
+}
+
+int lisafsWriteFile(lisafsVolume *vol, const uint8_t *filedata, const size_t rawFileSize, const char *name, enum filetype fileType) {
+    if (!checkFileName(name)) {
+        return -1;
+    }
+    loadWriteLayout(vol);
+    logInfo("_________________ Writing file: %s ________________\n", name);
+    startPhase(encodeStart);
+    size_t bytesWritten;
+    uint32_t fileSize;
+    bytes dataBuf = encodeFileData(filedata, rawFileSize, fileType, &bytesWritten, &fileSize);
+    if (dataBuf == NULL) {
+        return -1;
+    }
+    endPhase(vol, encodeMicros, encodeStart);
+
+    // do the work
+    startPhase(allocationStart);
+    const int sectorCount = getSectorCount(bytesWritten);
+    if (sectorCount > MAX_FILE_SECTORS) {
+        printf("ERROR! %s needs %d sectors, more than a file can have\n", name, sectorCount);
+        free(dataBuf);
+        return -1;
+    }
+    extent extents[HINT_MAX_EXTENTS];
+    const int extentCount = allocateExtents(vol, sectorCount, extents, name);
+    if (extentCount == -1) {
+        free(dataBuf);
+        return -1;
+    }
+    endPhase(vol, allocationMicros, allocationStart);
+
+    startPhase(catalogStart);
+    const int sfileid = catalogFile(vol, extents, extentCount, sectorCount, fileSize, name);
+    if (sfileid == -1) {
+        free(dataBuf);
+        return -1;
+    }
+    endPhase(vol, catalogMicros, catalogStart);
+
+    // write the data from buffer
+    startPhase(dataStart);
+    copyFileData(vol, dataBuf, extents, extentCount, (uint16_t) sfileid);
+    endPhase(vol, encodeMicros, dataStart);
+    free(dataBuf);
+    logInfo("\n");
+    return sfileid;
+}
+
+typedef struct {
+    lisafsVolume *vol;
+    lisafsNewFile *files;
+    int fileCount;
+    int next;
+    int written;
+    pthread_mutex_t queueLock;
+} writeQueue;
+
+static void *writeWorker(void *arg) {
+    writeQueue *queue = arg;
+    lisafsVolume *vol = queue->vol;
+    while (true) {
+        pthread_mutex_lock(&queue->queueLock);
+        const int f = queue->next++;
+        pthread_mutex_unlock(&queue->queueLock);
+        if (f >= queue->fileCount) {
+            return NULL;
+        }
+        lisafsNewFile *file = &queue->files[f];
+        file->sfileid = -1;
+        if (!checkFileName(file->name)) {
+            continue;
+        }
+        size_t bytesWritten;
+        uint32_t fileSize;
+        bytes dataBuf = encodeFileData(file->data, file->length, file->type, &bytesWritten, &fileSize);
+        const int sectorCount = dataBuf != NULL ? getSectorCount(bytesWritten) : 0;
+        extent extents[HINT_MAX_EXTENTS];
+        int extentCount = -1;
+        if (dataBuf != NULL && sectorCount > MAX_FILE_SECTORS) {
+            printf("ERROR! %s needs %d sectors, more than a file can have\n", file->name, sectorCount);
+        } else if (dataBuf != NULL) {
+            extentCount = allocateExtents(vol, sectorCount, extents, file->name);
+        }
+        if (extentCount != -1) {
+            file->sfileid = catalogFile(vol, extents, extentCount, sectorCount, fileSize, file->name);
+        }
+        if (file->sfileid != -1) {
+            copyFileData(vol, dataBuf, extents, extentCount, (uint16_t) file->sfileid);
+            pthread_mutex_lock(&queue->queueLock);
+            queue->written++;
+            pthread_mutex_unlock(&queue->queueLock);
+        }
+        free(dataBuf);
+    }
+}
+
+int lisafsWriteFiles(lisafsVolume *vol, lisafsNewFile *files, const int fileCount, int threads) {
+    static const int MAX_WRITE_THREADS = 64;
+    loadWriteLayout(vol); // before any threads, since it sets up what they share
+    threads = threads < 1 ? 1 : (threads > MAX_WRITE_THREADS ? MAX_WRITE_THREADS : threads);
+    threads = threads > fileCount ? fileCount : threads;
+    writeQueue queue = {vol, files, fileCount, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    if (threads <= 1 || (uintptr_t) bitmapBytes(vol) % 4 != 0) {
+        writeWorker(&queue); // no point paying for atomics, and they need the bitmap 4-byte aligned
+        return queue.written;
+    }
+    lisafsWriteLocks locks = {.freeDelta = 0, .nextSFile = readMDDFInt(vol, MDDF_EMPTY_FILE)};
+    pthread_mutex_init(&locks.catalog, NULL);
+    vol->locks = &locks;
+    pthread_t workers[MAX_WRITE_THREADS];
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, writeWorker, &queue);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    vol->locks = NULL;
+    pthread_mutex_destroy(&locks.catalog);
+    // what the threads kept to themselves goes back into the MDDF
+    adjustMDDFFreeCount(vol, locks.freeDelta);
+    writeSectorInt(vol, vol->MDDFSec, MDDF_EMPTY_FILE, findNextFreeSFileIndex(vol));
+    return queue.written;
+}
+
+// ---------- Defragmenter ----------
+
+typedef struct {
+    uint16_t sfileid;
+    int sfileSec; // s-file sector and offset holding this file's s-record
+    int sfileOffset;
+    int hintSec;
+    int sectorCount;
+    int *sectors; // physical sectors in relpage order, as found by walking the fwdlink chain
+    int rank; // position in the requested layout order
+} fileLayout;
+
+// follow a file's fwdlink chain from its first sector. Returns the number of sectors found.
+static int readSectorChain(lisafsVolume *vol, const int firstSector, int **sectors) {
+    int count = 0;
+    int capacity = 16;
+    *sectors = malloc(capacity * sizeof(int));
+    int sec = firstSector;
+    while (sec >= 0 && sec < vol->geo.sectors && count < vol->geo.sectors) { // guard against broken or looping chains
+        if (count == capacity) {
+            capacity *= 2;
+            *sectors = realloc(*sectors, capacity * sizeof(int));
+        }
+        (*sectors)[count++] = sec;
+        bytes tag = readTag(vol, sec);
+        const uint32_t next = (tag[14] << 16) | (tag[15] << 8) | tag[16];
+        free(tag);
+        if (next == 0xFFFFFF) {
+            break;
+        }
+        sec = (int) next + vol->MDDFSec;
+    }
+    return count;
+}
+
+// an extent is a run of sectors that follow each other on disk; a contiguous file has exactly 1
+static int countExtents(const int *sectors, const int sectorCount) {
+    int extents = sectorCount > 0 ? 1 : 0;
+    for (int i = 1; i < sectorCount; i++) {
+        if (sectors[i] != sectors[i - 1] + 1) {
+            extents++;
+        }
+    }
+    return extents;
+}
+
+static fileLayout *collectFileLayouts(lisafsVolume *vol, int *fileCount) {
+    const uint16_t slist_packing = readMDDFInt(vol, MDDF_SLIST_PACKING); //number of s_entries per block in slist
+    fileLayout *files = malloc(slist_packing * vol->sfileBlockCount * sizeof(fileLayout));
+    *fileCount = 0;
+    uint16_t idx = 0;
+    for (int i = vol->sFileSec; i < (vol->sFileSec + vol->sfileBlockCount); i++) {
+        bytes data = readSector(vol, i);
+        for (int sfileIdx = 0; sfileIdx < slist_packing; sfileIdx++) {
+            const int srec = sfileIdx * SFILE_RECORD_LENGTH;
+            const uint32_t hintAddr = readLong(data, srec);
+            const uint32_t fileAddr = readLong(data, srec + 4);
+            if (idx >= SFILE_RESERVED_ENTRIES && hintAddr != 0x00000000 && fileAddr != 0x00000000) {
+                fileLayout *f = &files[(*fileCount)++];
+                f->sfileid = idx;
+                f->sfileSec = i;
+                f->sfileOffset = srec;
+                f->hintSec = (int) hintAddr + vol->MDDFSec;
+                f->sectorCount = readSectorChain(vol, (int) fileAddr + vol->MDDFSec, &f->sectors);
+                f->rank = vol->geo.sectors + idx; // anything not explicitly ordered keeps s-file order, after the rest
+            }
+            idx++;
+        }
+        free(data);
+    }
+    return files;
+}
+
+static void printFragmentation(const char *label, const fileLayout *files, const int fileCount) {
+    int sectors = 0;
+    int extents = 0;
+    int fragmentedFiles = 0;
+    for (int f = 0; f < fileCount; f++) {
+        const int e = countExtents(files[f].sectors, files[f].sectorCount);
+        sectors += files[f].sectorCount;
+        extents += e;
+        if (e > 1) {
+            fragmentedFiles++;
+        }
+    }
+    // every extent past the first in a file is a seek (and a chain hop to a non-adjacent sector)
+    logInfo("Fragmentation %s: %d files, %d sectors, %d extents, %d fragmented files, %d extra seeks\n", label, fileCount, sectors, extents, fragmentedFiles, extents - fileCount);
+}
+
+static void rankByCatalog(lisafsVolume *vol, fileLayout *files, const int fileCount) {
+    int rank = 0;
+    const int first = (int) readMDDFLong(vol, MDDF_ROOT_PAGE);
+    int dirSec = first;
+    while (dirSec != -1) {
+        bytes dirBlock = read4Sectors(vol, dirSec);
+        int offsetToFirstEntry = 0;
+        int entryCount = getCatalogEntryCountForBlock(vol, dirSec);
+        if (dirSec == first) {
+            offsetToFirstEntry = CATALOG_FIRST_BLOCK_OFFSET; // skip the directory entry at the start of the first block
+            entryCount--;
+        }
+        for (int e = 0; e < entryCount; e++) {
+            const uint16_t sfileid = readInt(dirBlock, offsetToFirstEntry + (e * CATALOG_RECORD_LENGTH) + 38);
+            for (int f = 0; f < fileCount; f++) {
+                if (files[f].sfileid == sfileid) {
+                    files[f].rank = rank++;
+                }
+            }
+        }
+        const uint32_t next = readLong(dirBlock, (4 * SECTOR_SIZE) - 6);
+        free(dirBlock);
+        dirSec = (next == 0xFFFFFFFF) ? -1 : (int) next + vol->MDDFSec;
+    }
+}
+
+// hotNames are Lisa file names, hottest first. Those files are laid out first, in that order.
+static void rankByHotness(lisafsVolume *vol, fileLayout *files, const int fileCount, const char **hotNames, const int hotCount) {
+    int rank = -vol->geo.sectors; // ahead of every catalog rank
+    for (int h = 0; h < hotCount; h++) {
+        const int nameLength = (int) strlen(hotNames[h]);
+        for (int f = 0; f < fileCount; f++) {
+            bytes hSec = readSector(vol, files[f].hintSec);
+            const bool match = hSec[0] == nameLength && strncasecmp((const char *) hSec + 1, hotNames[h], nameLength) == 0; // like the catalog
+            free(hSec);
+            if (match) {
+                files[f].rank = rank++;
+            }
+        }
+    }
+}
+
+static int compareRank(const void *a, const void *b) {
+    return ((const fileLayout *) a)->rank - ((const fileLayout *) b)->rank;
+}
+
+// first sector at or after 'from', and before allocationEnd, that starts a run of 'count' available sectors, or -1
+static int findFreeRunFrom(lisafsVolume *vol, const bool *available, const int from, const int count) {
+    int runStart = from;
+    for (int i = from; i < allocationEnd(vol); i++) {
+        if (!available[i]) {
+            runStart = i + 1;
+        } else if (i - runStart + 1 == count) {
+            return runStart;
+        }
+    }
+    return -1;
+}
+
+// rewrites the chain fields of a tag we're keeping, leaving version/volid/fileid/dataused alone
+static void relinkTag(lisafsVolume *vol, const int sec, const int relpage, const int prevSec, const int nextSec) {
+    writeTag3Byte(vol, sec, 8, sec - vol->MDDFSec); //abspage
+    writeTagInt(vol, sec, 12, relpage);
+    writeTag3Byte(vol, sec, 14, nextSec == -1 ? 0xFFFFFF : nextSec - vol->MDDFSec); //fwdlink
+    writeTag3Byte(vol, sec, 17, prevSec == -1 ? 0xFFFFFF : prevSec - vol->MDDFSec); //bkwdlink
+}
+
+// Lays the files out in rank order. The whole layout is planned before anything moves, and if any file would end
+// up in more pieces than its hint sector can list, nothing is moved and it returns false.
+static bool relayoutFiles(lisafsVolume *vol, fileLayout *files, const int fileCount) {
+    qsort(files, fileCount, sizeof(fileLayout), compareRank);
+
+    // anything the bitmap calls free is fair game, as is every sector a file is in now, but only inside the
+    // allocation window: files outside it still give their sectors back, they just don't get put back there
+    const int from = allocationStart(vol);
+    const int to = allocationEnd(vol);
+    int cursor = to;
+    bool *available = malloc(vol->geo.sectors * sizeof(bool));
+    for (int sec = 0; sec < vol->geo.sectors; sec++) {
+        available[sec] = sec >= from && sec < to && isFreeSector(vol, sec);
+    }
+    for (int f = 0; f < fileCount; f++) {
+        for (int i = 0; i < files[f].sectorCount; i++) {
+            const int sec = files[f].sectors[i];
+            if (sec >= from && sec < to) {
+                available[sec] = true;
+                cursor = sec < cursor ? sec : cursor;
+            }
+        }
+    }
+
+    // plan where they go, one after another
+    int **planned = calloc(fileCount, sizeof(int *));
+    bool ok = true;
+    for (int f = 0; f < fileCount && ok; f++) {
+        const int count = files[f].sectorCount;
+        planned[f] = malloc((count > 0 ? count : 1) * sizeof(int));
+        int start = findFreeRunFrom(vol, available, cursor, count);
+        if (start == -1) {
+            start = findFreeRunFrom(vol, available, from, count);
+        }
+        int found = 0;
+        if (start != -1) {
+            for (found = 0; found < count; found++) {
+                planned[f][found] = start + found;
+            }
+            cursor = start + count;
+        } else {
+            // no run is long enough any more, so take whatever is left
+            for (int sec = from; sec < to && found < count; sec++) {
+                if (available[sec]) {
+                    planned[f][found++] = sec;
+                }
+            }
+        }
+        for (int i = 0; i < found; i++) {
+            available[planned[f][i]] = false;
+        }
+        extent extents[HINT_MAX_EXTENTS];
+        if (found < count) {
+            // files that were outside the window can need more room inside it than is left
+            printf("ERROR! Not moving anything: no room for s-file 0x%04X between 0x%X and 0x%X\n", files[f].sfileid, from, to);
+            ok = false;
+        } else if (count > 0 && sectorsToExtents(planned[f], count, extents, HINT_MAX_EXTENTS) == -1) {
+            printf("ERROR! Not moving anything: s-file 0x%04X would end up in more than %d pieces\n", files[f].sfileid, HINT_MAX_EXTENTS);
+            ok = false;
+        }
+    }
+    free(available);
+    if (!ok) {
+        for (int f = 0; f < fileCount; f++) {
+            free(planned[f]);
+        }
+        free(planned);
+        return false;
+    }
+
+    // lift every file out of the image, then hand its sectors back to the bitmap
+    bytes *saved = malloc(fileCount * sizeof(bytes));
+    for (int f = 0; f < fileCount; f++) {
+        saved[f] = malloc(files[f].sectorCount * (SECTOR_SIZE + vol->geo.tagSize));
+        for (int i = 0; i < files[f].sectorCount; i++) {
+            const int sec = files[f].sectors[i];
+            memcpy(saved[f] + (i * SECTOR_SIZE), vol->image + DATA_OFFSET + (sec * SECTOR_SIZE), SECTOR_SIZE);
+            memcpy(saved[f] + (files[f].sectorCount * SECTOR_SIZE) + (i * vol->geo.tagSize), vol->image + vol->geo.tagOffset + (sec * vol->geo.tagSize), vol->geo.tagSize);
+        }
+    }
+    for (int f = 0; f < fileCount; f++) {
+        for (int i = 0; i < files[f].sectorCount; i++) {
+            const int sec = files[f].sectors[i];
+            zeroSectors(vol, sec, 1);
+            zeroTags(vol, sec, 1);
+            markSectorRun(vol, sec, 1, false);
+        }
+        adjustMDDFFreeCount(vol, files[f].sectorCount);
+    }
+
+    // and put them back where the plan says
+    for (int f = 0; f < fileCount; f++) {
+        const int count = files[f].sectorCount;
+        free(files[f].sectors);
+        files[f].sectors = planned[f];
+        for (int i = 0; i < count; i++) {
+            const int sec = files[f].sectors[i];
+            memcpy(vol->image + DATA_OFFSET + (sec * SECTOR_SIZE), saved[f] + (i * SECTOR_SIZE), SECTOR_SIZE);
+            memcpy(vol->image + vol->geo.tagOffset + (sec * vol->geo.tagSize), saved[f] + (count * SECTOR_SIZE) + (i * vol->geo.tagSize), vol->geo.tagSize);
+            relinkTag(vol, sec, i, i == 0 ? -1 : files[f].sectors[i - 1], i == count - 1 ? -1 : files[f].sectors[i + 1]);
+            markSectorRun(vol, sec, 1, true);
+        }
+        adjustMDDFFreeCount(vol, -count);
+
+        if (count > 0) {
+            writeSectorLong(vol, files[f].sfileSec, files[f].sfileOffset + 4, files[f].sectors[0] - vol->MDDFSec); // fileAddr
+            extent extents[HINT_MAX_EXTENTS];
+            writeHintExtents(vol, files[f].hintSec, extents, sectorsToExtents(files[f].sectors, count, extents, HINT_MAX_EXTENTS));
+        }
+        free(saved[f]);
+    }
+    free(saved);
+    free(planned);
+
+    fixAllTagChecksums(vol);
+    return true;
+}
+
+static void freeFileLayouts(fileLayout *files, const int fileCount) {
+    for (int f = 0; f < fileCount; f++) {
+        free(files[f].sectors);
+    }
+    free(files);
+}
+
+bool lisafsDefragment(lisafsVolume *vol, const char **hotNames, const int hotCount) {
+    int fileCount;
+    fileLayout *files = collectFileLayouts(vol, &fileCount);
+    printFragmentation("before", files, fileCount);
+    bool ok = true;
+    if (fileCount > 0) {
+        rankByCatalog(vol, files, fileCount);
+        rankByHotness(vol, files, fileCount, hotNames, hotCount);
+        ok = relayoutFiles(vol, files, fileCount);
+        if (ok) {
+            printFragmentation("after", files, fileCount);
+        }
+    }
+    freeFileLayouts(files, fileCount);
+    return ok;
+}
+
+// ---------- Boot layout ----------
+
+uint16_t lisafsSectorOwner(lisafsVolume *vol, const int sector) {
+    if (sector < 0 || sector >= vol->geo.sectors) {
+        return FREE_FILE_ID;
+    }
+    bytes tag = readTag(vol, sector);
+    const uint16_t fileId = readInt(tag, 4);
+    free(tag);
+    return fileId;
+}
+
+// seeks (accesses that aren't to the sector right after the last one) and the distance travelled, replaying
+// the trace with every sector looked up through 'location'
+static void replayTrace(const int *trace, const int traceLength, const int *location, const int sectors, int *seeks, long long *distance) {
+    *seeks = 0;
+    *distance = 0;
+    int prev = -1;
+    for (int t = 0; t < traceLength; t++) {
+        if (trace[t] < 0 || trace[t] >= sectors) {
+            continue;
+        }
+        const int sec = location[trace[t]];
+        if (prev != -1 && sec != prev + 1) {
+            (*seeks)++;
+            *distance += sec > prev ? sec - prev : prev - sec;
+        }
+        prev = sec;
+    }
+}
+
+lisafsTraceReport lisafsOptimizeForTrace(lisafsVolume *vol, const int *trace, const int traceLength) {
+    lisafsTraceReport report = {0};
+    report.accesses = traceLength;
+    const int sectors = vol->geo.sectors;
+
+    int fileCount;
+    fileLayout *files = collectFileLayouts(vol, &fileCount);
+    rankByCatalog(vol, files, fileCount);
+
+    // which file, and which page of it, every sector is, by the chains (which is what the tags say)
+    int *ownerFile = malloc(sectors * sizeof(int));
+    int *ownerPage = malloc(sectors * sizeof(int));
+    int *location = malloc(sectors * sizeof(int));
+    for (int sec = 0; sec < sectors; sec++) {
+        ownerFile[sec] = -1;
+        location[sec] = sec;
+    }
+    for (int f = 0; f < fileCount; f++) {
+        for (int i = 0; i < files[f].sectorCount; i++) {
+            ownerFile[files[f].sectors[i]] = files[f].sfileid;
+            ownerPage[files[f].sectors[i]] = i;
+        }
+    }
+    replayTrace(trace, traceLength, location, sectors, &report.seeksBefore, &report.distanceBefore);
+
+    // hot files go first, in the order the boot first touched them
+    int rank = -sectors;
+    for (int t = 0; t < traceLength; t++) {
+        if (trace[t] < 0 || trace[t] >= sectors || ownerFile[trace[t]] == -1) {
+            continue;
+        }
+        report.fileAccesses++;
+        for (int f = 0; f < fileCount; f++) {
+            if (files[f].sfileid == ownerFile[trace[t]] && files[f].rank >= 0) {
+                files[f].rank = rank++;
+                report.hotFiles++;
+            }
+        }
+    }
+    if (fileCount > 0) {
+        printFragmentation("before", files, fileCount);
+        if (relayoutFiles(vol, files, fileCount)) { // if not, nothing moved and the files still say where they are
+            printFragmentation("after", files, fileCount);
+        }
+    }
+
+    // where each traced sector ended up
+    for (int sec = 0; sec < sectors; sec++) {
+        if (ownerFile[sec] == -1) {
+            continue;
+        }
+        for (int f = 0; f < fileCount; f++) {
+            if (files[f].sfileid == ownerFile[sec]) {
+                location[sec] = files[f].sectors[ownerPage[sec]];
+                break;
+            }
+        }
+    }
+    replayTrace(trace, traceLength, location, sectors, &report.seeksAfter, &report.distanceAfter);
+
+    free(ownerFile);
+    free(ownerPage);
+    free(location);
+    freeFileLayouts(files, fileCount);
+    return report;
+}
+
+// ---------- Volumes ----------
+
+// 'known' is a validated sidecar index whose layout we can take instead of scanning for it, or NULL
+static lisafsVolume *openBuffer(bytes buffer, const size_t length, const lisafsIndexHeader *known) {
+    startPhase(loadStart);
+    if (buffer == NULL || length < (size_t) DATA_OFFSET || readInt(buffer, 0x52) != 0x0100) { // DC42 magic bytes
+        printf("ERROR! Not a DC42 image\n");
+        return NULL;
+    }
+    lisafsVolume *vol = calloc(1, sizeof(lisafsVolume));
+    vol->image = buffer;
+    vol->lastUsedHintIndex = INITIAL_HINT_FILE_ID;
+    if (!initGeometry(vol, readLong(buffer, 0x40), readLong(buffer, 0x44))) {
+        free(vol);
+        return NULL;
+    }
+    if (length != (size_t) vol->geo.fileLength) {
+        printf("ERROR! Image is 0x%zX bytes but its header says 0x%X\n", length, vol->geo.fileLength);
+        free(vol);
+        return NULL;
+    }
+    logDebug("Sectors: 0x%X, tag bytes per sector: 0x%X\n", vol->geo.sectors, vol->geo.tagSize);
+
+    if (known != NULL && known->sectors == vol->geo.sectors && known->tagSize == vol->geo.tagSize) {
+        vol->MDDFSec = known->MDDFSec;
+        vol->bitmapSec = known->bitmapSec;
+        vol->sFileSec = known->sFileSec;
+        vol->sfileBlockCount = known->sfileBlockCount;
+        vol->nonLeafCatalogSec = known->nonLeafCatalogSec;
+        vol->lastUsedHintIndex = (uint16_t) known->lastUsedHintIndex;
+        vol->writeLayoutKnown = true;
+        endPhase(vol, loadMicros, loadStart);
+        return vol;
+    }
+
+    findMDDFSec(vol);
+    if (vol->MDDFSec == -1) {
+        printf("ERROR! No MDDF found\n");
+        free(vol);
+        return NULL;
+    }
+    findBitmapSec(vol);
+    findSFileSec(vol);
+    // the non-leaf catalog block and the hint IDs in use are only needed for writing, and finding them means
+    // going through every tag and s-file record, so that waits for loadWriteLayout
+    endPhase(vol, loadMicros, loadStart);
+    return vol;
+}
+
+lisafsVolume *lisafsOpenBuffer(bytes buffer, const size_t length) {
+    return openBuffer(buffer, length, NULL);
+}
+
+lisafsVolume *lisafsOpenFile(const char *path) {
+    startPhase(loadStart);
+    FILE *fileptr = fopen(path, "rb");
+    if (fileptr == NULL) {
+        printf("ERROR! Could not open %s\n", path);
+        return NULL;
+    }
+    fseek(fileptr, 0, SEEK_END);
+    size_t length = (size_t) ftell(fileptr);
+    fseek(fileptr, 0, SEEK_SET);
+    bytes buffer = malloc(length);
+    bool readOk = fread(buffer, length, 1, fileptr) == 1;
+    fclose(fileptr);
+    if (readOk && lisafsIsPackedRLE(buffer, length)) {
+        size_t unpackedLength;
+        bytes unpacked = lisafsUnpackRLE(buffer, length, &unpackedLength);
+        free(buffer);
+        buffer = unpacked;
+        length = unpackedLength;
+        readOk = buffer != NULL;
+    }
+    lisafsIndex *index = readOk ? lisafsIndexOpen(path) : NULL; // skips the scans if there's an up to date one
+    lisafsVolume *vol = readOk ? openBuffer(buffer, length, index != NULL ? index->header : NULL) : NULL;
+    lisafsIndexClose(index);
+    if (vol == NULL) {
+        printf("ERROR! Could not read %s\n", path);
+        free(buffer);
+        return NULL;
+    }
+    vol->ownsImage = true;
+    vol->stats.loadMicros = 0; // the whole load, reading the file included, rather than just the part in lisafsOpenBuffer
+    endPhase(vol, loadMicros, loadStart);
+    return vol;
+}
+
+lisafsVolume *lisafsOpenMapped(const char *path) {
+    startPhase(loadStart);
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("ERROR! Could not open %s\n", path);
+        return NULL;
+    }
+    // check the header against the file before mapping anything
+    uint8_t header[0x54];
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && pread(fd, header, DATA_OFFSET, 0) == DATA_OFFSET;
+    if (!ok) {
+        printf("ERROR! Could not read the header of %s\n", path);
+    } else if (readInt(header, 0x52) != 0x0100) {
+        printf("ERROR! %s is not a DC42 image\n", path);
+        ok = false;
+    } else {
+        const uint64_t expected = (uint64_t) DATA_OFFSET + readLong(header, 0x40) + readLong(header, 0x44);
+        if ((uint64_t) st.st_size != expected) {
+            printf("ERROR! %s is 0x%llX bytes but its header says 0x%llX\n", path, (unsigned long long) st.st_size, (unsigned long long) expected);
+            ok = false;
+        }
+    }
+    if (!ok) {
+        close(fd);
+        return NULL;
+    }
+    const size_t length = (size_t) st.st_size;
+    // private and writable, so a writer's changes land in copies of just the pages it touches, never in the file
+    bytes image = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        printf("ERROR! Could not map %s\n", path);
+        close(fd);
+        return NULL;
+    }
+    lisafsIndex *index = lisafsIndexOpen(path);
+    lisafsVolume *vol = openBuffer(image, length, index != NULL ? index->header : NULL);
+    lisafsIndexClose(index);
+    if (vol == NULL) {
+        munmap(image, length);
+        close(fd);
+        return NULL;
+    }
+    vol->mapLength = length;
+    vol->mapFd = fd;
+    vol->stats.loadMicros = 0;
+    endPhase(vol, loadMicros, loadStart);
+    return vol;
+}
+
+lisafsVolume *lisafsOpenOverlay(lisafsVolume *base) {
+    if (base->mapLength == 0) {
+        printf("ERROR! Overlays need a volume opened with lisafsOpenMapped\n");
+        return NULL;
+    }
+    loadWriteLayout(base); // once here, rather than once per overlay
+    bytes image = mmap(NULL, base->mapLength, PROT_READ | PROT_WRITE, MAP_PRIVATE, base->mapFd, 0);
+    const int fd = image != MAP_FAILED ? dup(base->mapFd) : -1;
+    if (fd == -1) {
+        printf("ERROR! Could not map an overlay\n");
+        if (image != MAP_FAILED) {
+            munmap(image, base->mapLength);
+        }
+        return NULL;
+    }
+    lisafsVolume *vol = malloc(sizeof(lisafsVolume));
+    *vol = *base;
+    vol->image = image;
+    vol->ownsImage = false;
+    vol->mapFd = fd;
+    vol->locks = NULL;
+    memset(&vol->stats, 0, sizeof(vol->stats));
+    return vol;
+}
+
+void lisafsClose(lisafsVolume *vol) {
+    if (vol == NULL) {
+        return;
+    }
+    if (vol->mapLength != 0) {
+        munmap(vol->image, vol->mapLength);
+        close(vol->mapFd);
+    } else if (vol->ownsImage) {
+        free(vol->image);
+    }
+    free(vol);
+}
+
+// Disk Copy's checksum: add each big-endian word, then rotate right 1 bit
+static uint32_t dc42Checksum(const uint8_t *data, const size_t length) {
+    uint32_t val = 0x00000000;
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        val += (data[i] << 8) | data[i + 1];
+        val = (val >> 1) | (val << (32 - 1));
+    }
+    return val;
+}
+
+// the same, when everything past 'used' bytes is known to be zero: a zero word only rotates, so skip to the end
+static uint32_t dc42ChecksumZeroTail(const uint8_t *data, const size_t used, const size_t length) {
+    const uint32_t val = dc42Checksum(data, used);
+    const int rotate = (int) (((length - used) / 2) % 32);
+    return rotate == 0 ? val : (val >> rotate) | (val << (32 - rotate));
+}
+
+void lisafsFixHeaderChecksums(bytes image, const geometry *geo) {
+    const uint32_t dataChecksum = dc42Checksum(image + DATA_OFFSET, geo->tagOffset - DATA_OFFSET);
+    // Disk Copy leaves the first 12 tag bytes out of the tag checksum
+    const uint32_t tagChecksum = dc42Checksum(image + geo->tagOffset + 12, geo->fileLength - geo->tagOffset - 12);
+    for (int i = 0; i < 4; i++) {
+        image[0x48 + i] = (dataChecksum >> (24 - (i * 8))) & 0xFF;
+        image[0x4C + i] = (tagChecksum >> (24 - (i * 8))) & 0xFF;
+    }
+}
+
+bytes lisafsSerialize(lisafsVolume *vol, size_t *length) {
+    startPhase(checksumStart);
+    fixAllTagChecksums(vol);
+    lisafsFixHeaderChecksums(vol->image, &vol->geo);
+    endPhase(vol, checksumMicros, checksumStart);
+    bytes out = malloc(vol->geo.fileLength);
+    memcpy(out, vol->image, vol->geo.fileLength);
+    *length = (size_t) vol->geo.fileLength;
+    return out;
+}
+
+static bool isZero(const uint8_t *data, const size_t length) {
+    // the first byte is zero, and the rest is the same as everything but the last byte, so it's all zero
+    return length == 0 || (data[0] == 0x00 && memcmp(data, data + 1, length - 1) == 0);
+}
+
+// Write an image via a temporary file, leaving out runs of all-zero sectors so the file system can keep them as
+// holes. Only the sectors candidates says are worth a look get checked, or all of them if it's NULL.
+// The file reads back exactly the same either way; where holes aren't supported, the gaps are just zeros.
+static bool writeImageSparse(const uint8_t *image, const geometry *geo, const bool *candidates, const char *path) {
+    char tmpPath[256];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    const int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("ERROR! Could not create %s\n", tmpPath);
+        return false;
+    }
+    bool ok = ftruncate(fd, geo->fileLength) == 0 && pwrite(fd, image, DATA_OFFSET, 0) == DATA_OFFSET;
+    int runStart = -1;
+    for (int sec = 0; sec <= geo->sectors && ok; sec++) {
+        const bool skip = sec == geo->sectors
+                          || ((candidates == NULL || candidates[sec]) && isZero(image + DATA_OFFSET + (sec * SECTOR_SIZE), SECTOR_SIZE));
+        if (skip && runStart != -1) {
+            const size_t runLength = (size_t) (sec - runStart) * SECTOR_SIZE;
+            ok = pwrite(fd, image + DATA_OFFSET + (runStart * SECTOR_SIZE), runLength, DATA_OFFSET + (runStart * SECTOR_SIZE)) == (ssize_t) runLength;
+            runStart = -1;
+        } else if (!skip && runStart == -1) {
+            runStart = sec;
+        }
+    }
+    // the tags are too small to be worth it a sector at a time, so go by file system block
+    const int block = 0x1000;
+    for (int offset = geo->tagOffset; offset < geo->fileLength && ok; offset += block) {
+        const int length = (geo->fileLength - offset) < block ? (geo->fileLength - offset) : block;
+        if (!isZero(image + offset, length)) {
+            ok = pwrite(fd, image + offset, length, offset) == length;
+        }
+    }
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(tmpPath, path) != 0) {
+        printf("ERROR! Could not write %s\n", path);
+        remove(tmpPath);
+        return false;
+    }
+    return true;
+}
+
+bool lisafsSaveFile(lisafsVolume *vol, const char *path) {
+    size_t length;
+    bytes out = lisafsSerialize(vol, &length);
+    startPhase(writeOutStart);
+    // only free sectors are worth checking for zeros; boot blocks and anything below the MDDF never are
+    bool *candidates = calloc(vol->geo.sectors, sizeof(bool));
+    const uint8_t *bitmap = out + DATA_OFFSET + (vol->bitmapSec * SECTOR_SIZE);
+    for (int sec = vol->MDDFSec; sec < vol->geo.sectors; sec++) {
+        const int bit = sec - vol->MDDFSec;
+        candidates[sec] = (bitmap[bit / 8] & (1 << (bit % 8))) == 0;
+    }
+    const bool ok = writeImageSparse(out, &vol->geo, candidates, path);
+    free(candidates);
+    free(out);
+    if (!ok) {
+        return false;
+    }
+    endPhase(vol, writeOutMicros, writeOutStart);
+    return true;
+}
+
+// copy_file_range shares the blocks where the file system can (btrfs, XFS) and copies in the kernel where it can't
+static bool copyWholeFile(const int in, const int out, const uint8_t *mapped, const size_t length) {
+    off_t inOffset = 0;
+    off_t outOffset = 0;
+    while ((size_t) inOffset < length) {
+        const ssize_t copied = copy_file_range(in, &inOffset, out, &outOffset, length - (size_t) inOffset, 0);
+        if (copied <= 0) {
+            break;
+        }
+    }
+    // anything it couldn't do (an old kernel, or across file systems) goes the slow way
+    return (size_t) inOffset == length
+           || pwrite(out, mapped + inOffset, length - (size_t) inOffset, inOffset) == (ssize_t) (length - (size_t) inOffset);
+}
+
+bool lisafsSaveOverlay(lisafsVolume *vol, const char *path, int *changedBlocks) {
+    if (vol->mapLength == 0) {
+        printf("ERROR! %s: only mapped volumes can be saved as an overlay\n", path);
+        return false;
+    }
+    startPhase(checksumStart);
+    fixAllTagChecksums(vol);
+    lisafsFixHeaderChecksums(vol->image, &vol->geo);
+    endPhase(vol, checksumMicros, checksumStart);
+    startPhase(writeOutStart);
+    const uint8_t *base = mmap(NULL, vol->mapLength, PROT_READ, MAP_SHARED, vol->mapFd, 0);
+    char tmpPath[256];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    const int fd = base != MAP_FAILED ? open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd == -1) {
+        printf("ERROR! Could not create %s\n", tmpPath);
+        if (base != MAP_FAILED) {
+            munmap((void *) base, vol->mapLength);
+        }
+        return false;
+    }
+    bool ok = copyWholeFile(vol->mapFd, fd, base, vol->mapLength);
+    // untouched pages are the base's own, so comparing them costs no memory
+    const size_t block = 0x1000;
+    int changed = 0;
+    for (size_t offset = 0; offset < vol->mapLength && ok; offset += block) {
+        const size_t length = (vol->mapLength - offset) < block ? (vol->mapLength - offset) : block;
+        if (memcmp(vol->image + offset, base + offset, length) != 0) {
+            ok = pwrite(fd, vol->image + offset, length, (off_t) offset) == (ssize_t) length;
+            changed++;
+        }
+    }
+    munmap((void *) base, vol->mapLength);
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(tmpPath, path) != 0) {
+        printf("ERROR! Could not write %s\n", path);
+        remove(tmpPath);
+        return false;
+    }
+    if (changedBlocks != NULL) {
+        *changedBlocks = changed;
+    }
+    endPhase(vol, writeOutMicros, writeOutStart);
+    return true;
+}
+
+bool lisafsSaveImageFile(const uint8_t *image, const size_t length, const char *path) {
+    geometry geo = {0};
+    if (length < (size_t) DATA_OFFSET || readInt((bytes) image, 0x52) != 0x0100) {
+        printf("ERROR! Not a DC42 image\n");
+        return false;
+    }
+    geo.sectors = (int) (readLong((bytes) image, 0x40) / SECTOR_SIZE);
+    geo.tagOffset = DATA_OFFSET + (int) readLong((bytes) image, 0x40);
+    geo.fileLength = geo.tagOffset + (int) readLong((bytes) image, 0x44);
+    if ((size_t) geo.fileLength != length) {
+        printf("ERROR! DC42 header doesn't match the image length\n");
+        return false;
+    }
+    return writeImageSparse(image, &geo, NULL, path);
+}
+
+long lisafsPunchHoles(const char *path) {
+    const int fd = open(path, O_RDWR);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        printf("ERROR! Could not open %s\n", path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    const size_t length = (size_t) st.st_size;
+    bytes image = malloc(length > 0 ? length : 1);
+    if (pread(fd, image, length, 0) != (ssize_t) length) {
+        printf("ERROR! Could not read %s\n", path);
+        free(image);
+        close(fd);
+        return -1;
+    }
+    long punched = 0;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // only whole file system blocks can be holes
+    const size_t block = st.st_blksize > 0 ? (size_t) st.st_blksize : 0x1000;
+    size_t runStart = 0;
+    size_t runLength = 0;
+    for (size_t offset = 0; offset + block <= length; offset += block) {
+        const bool zero = isZero(image + offset, block);
+        if (zero) {
+            runStart = runLength == 0 ? offset : runStart;
+            runLength += block;
+        }
+        if (runLength > 0 && (!zero || offset + (2 * block) > length)) {
+            if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) runStart, (off_t) runLength) != 0) {
+                printf("ERROR! %s's file system can't punch holes\n", path);
+                punched = -1;
+                break;
+            }
+            punched += (long) runLength;
+            runLength = 0;
+        }
+    }
+#else
+    printf("ERROR! Can't punch holes on this platform\n");
+    punched = -1;
+#endif
+    free(image);
+    close(fd);
+    return punched;
+}
+
+// ---------- Run-length packing ----------
+
+static const char RLE_MAGIC[8] = {'L', 'I', 'S', 'A', 'R', 'L', 'E', 1};
+static const int RLE_HEADER_LENGTH = 12; // the magic, then the unpacked length, big-endian
+
+bool lisafsIsPackedRLE(const uint8_t *data, const size_t length) {
+    return length >= (size_t) RLE_HEADER_LENGTH && memcmp(data, RLE_MAGIC, sizeof(RLE_MAGIC)) == 0;
+}
+
+// PackBits, like the Mac: a count byte n, then n + 1 literal bytes for 0 to 127, or one byte repeated 1 - n
+// times for -1 to -127. Worst case it's 1 byte bigger per 128.
+bytes lisafsPackRLE(const uint8_t *image, const size_t length, size_t *packedLength) {
+    bytes packed = malloc(RLE_HEADER_LENGTH + length + (length / 128) + 1);
+    memcpy(packed, RLE_MAGIC, sizeof(RLE_MAGIC));
+    for (int i = 0; i < 4; i++) {
+        packed[8 + i] = ((uint32_t) length >> (24 - (i * 8))) & 0xFF;
+    }
+    size_t out = RLE_HEADER_LENGTH;
+    size_t i = 0;
+    while (i < length) {
+        size_t run = 1;
+        while (i + run < length && run < 128 && image[i + run] == image[i]) {
+            run++;
+        }
+        if (run >= 3 || (run == 2 && i + run == length)) {
+            packed[out++] = (uint8_t) (1 - (int) run);
+            packed[out++] = image[i];
+            i += run;
+            continue;
+        }
+        // literals, until the next run of 3 or more
+        size_t literals = 0;
+        while (i + literals < length && literals < 128) {
+            if (i + literals + 2 < length && image[i + literals] == image[i + literals + 1] && image[i + literals] == image[i + literals + 2]) {
+                break;
+            }
+            literals++;
+        }
+        packed[out++] = (uint8_t) (literals - 1);
+        memcpy(packed + out, image + i, literals);
+        out += literals;
+        i += literals;
+    }
+    *packedLength = out;
+    return realloc(packed, out);
+}
+
+bytes lisafsUnpackRLE(const uint8_t *packed, const size_t packedLength, size_t *length) {
+    if (!lisafsIsPackedRLE(packed, packedLength)) {
+        printf("ERROR! Not a packed image\n");
+        return NULL;
+    }
+    *length = readLong((bytes) packed, 8);
+    bytes image = malloc(*length > 0 ? *length : 1);
+    size_t out = 0;
+    size_t i = RLE_HEADER_LENGTH;
+    while (i < packedLength && out < *length) {
+        const int8_t n = (int8_t) packed[i++];
+        if (n >= 0) {
+            const size_t literals = (size_t) n + 1;
+            if (i + literals > packedLength || out + literals > *length) {
+                break;
+            }
+            memcpy(image + out, packed + i, literals);
+            i += literals;
+            out += literals;
+        } else if (n != -128 && i < packedLength) {
+            const size_t run = (size_t) (1 - n);
+            if (out + run > *length) {
+                break;
+            }
+            memset(image + out, packed[i++], run);
+            out += run;
+        }
+    }
+    if (out != *length) {
+        printf("ERROR! Packed image is damaged\n");
+        free(image);
+        return NULL;
+    }
+    return image;
+}
+
+// ---------- Index ----------
+
+static const char INDEX_MAGIC[8] = {'L', 'I', 'S', 'A', 'I', 'D', 'X', 1}; // the last byte is the layout version
+static const uint32_t INDEX_BYTE_ORDER = 0x01020304;
+
+static void indexPath(const char *imagePath, char *path, const size_t pathSize) {
+    snprintf(path, pathSize, "%s.idx", imagePath);
+}
+
+static int compareIndexFileName(const void *a, const void *b) {
+    return strcasecmp(((const lisafsIndexFile *) a)->name, ((const lisafsIndexFile *) b)->name);
+}
+
+bool lisafsIndexWrite(lisafsVolume *vol, const char *imagePath) {
+    loadWriteLayout(vol); // the index carries the write layout too, so opening through it skips the scans
+    lisafsEntry *entries;
+    const int fileCount = lisafsList(vol, &entries);
+    lisafsIndexFile *files = calloc(fileCount > 0 ? fileCount : 1, sizeof(lisafsIndexFile));
+    int extentCapacity = fileCount + 16;
+    extent *extents = malloc(extentCapacity * sizeof(extent));
+    int extentCount = 0;
+    const uint16_t slist_packing = readMDDFInt(vol, MDDF_SLIST_PACKING);
+    for (int f = 0; f < fileCount; f++) {
+        memcpy(files[f].name, entries[f].name, sizeof(files[f].name));
+        files[f].sfileid = entries[f].sfileid;
+        files[f].size = entries[f].size;
+        files[f].hintSec = entries[f].hintSec;
+        files[f].firstSector = entries[f].firstSector;
+        bytes sfileSec = readSector(vol, vol->sFileSec + (entries[f].sfileid / slist_packing));
+        files[f].version = readInt(sfileSec, ((entries[f].sfileid % slist_packing) * SFILE_RECORD_LENGTH) + 12);
+        free(sfileSec);
+
+        // the extent map, from the chain
+        int *sectors;
+        const int sectorCount = readSectorChain(vol, entries[f].firstSector, &sectors);
+        files[f].firstExtent = extentCount;
+        for (int i = 0; i < sectorCount; i++) {
+            if (i > 0 && sectors[i] == sectors[i - 1] + 1) {
+                extents[extentCount - 1].count++;
+                continue;
+            }
+            if (extentCount == extentCapacity) {
+                extentCapacity *= 2;
+                extents = realloc(extents, extentCapacity * sizeof(extent));
+            }
+            extents[extentCount].start = sectors[i];
+            extents[extentCount].count = 1;
+            extentCount++;
+        }
+        files[f].extentCount = extentCount - files[f].firstExtent;
+        free(sectors);
+    }
+    free(entries);
+    qsort(files, fileCount, sizeof(lisafsIndexFile), compareIndexFileName); // catalog order, for lookups
+
+    lisafsIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.byteOrder = INDEX_BYTE_ORDER;
+    header.imageSize = (uint64_t) vol->geo.fileLength;
+    memcpy(header.checksums, vol->image + 0x48, sizeof(header.checksums));
+    header.sectors = vol->geo.sectors;
+    header.tagSize = vol->geo.tagSize;
+    header.MDDFSec = vol->MDDFSec;
+    header.bitmapSec = vol->bitmapSec;
+    header.sFileSec = vol->sFileSec;
+    header.nonLeafCatalogSec = vol->nonLeafCatalogSec;
+    header.sfileBlockCount = vol->sfileBlockCount;
+    header.lastUsedHintIndex = vol->lastUsedHintIndex;
+    header.fileCount = (uint32_t) fileCount;
+    header.extentCount = (uint32_t) extentCount;
+    header.filesOffset = sizeof(lisafsIndexHeader);
+    header.extentsOffset = header.filesOffset + (fileCount * sizeof(lisafsIndexFile));
+    memcpy(header.mddf, vol->image + DATA_OFFSET + (vol->MDDFSec * SECTOR_SIZE), SECTOR_SIZE);
+
+    char path[256];
+    indexPath(imagePath, path, sizeof(path));
+    char tmpPath[260];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *output = fopen(tmpPath, "wb");
+    bool ok = output != NULL;
+    if (ok) {
+        ok = fwrite(&header, sizeof(header), 1, output) == 1;
+        ok = ok && (fileCount == 0 || fwrite(files, sizeof(lisafsIndexFile), fileCount, output) == (size_t) fileCount);
+        ok = ok && (extentCount == 0 || fwrite(extents, sizeof(extent), extentCount, output) == (size_t) extentCount);
+        ok = (fclose(output) == 0) && ok;
+        ok = ok && rename(tmpPath, path) == 0;
+    }
+    if (!ok) {
+        printf("ERROR! Could not write %s\n", path);
+        remove(tmpPath);
+    }
+    free(files);
+    free(extents);
+    return ok;
+}
+
+lisafsIndex *lisafsIndexOpen(const char *imagePath) {
+    char path[256];
+    indexPath(imagePath, path, sizeof(path));
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL; // no index is fine, it's optional
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(lisafsIndexHeader)) {
+        map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    const size_t mapLength = (size_t) st.st_size;
+    const lisafsIndexHeader *header = map;
+    bool valid = memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0 && header->byteOrder == INDEX_BYTE_ORDER
+                 && header->filesOffset == sizeof(lisafsIndexHeader)
+                 && header->extentsOffset == header->filesOffset + (header->fileCount * sizeof(lisafsIndexFile))
+                 && mapLength == header->extentsOffset + (header->extentCount * sizeof(extent));
+
+    // and it has to be for the image as it is now: same size, same checksums in the DC42 header
+    const int imageFd = valid ? open(imagePath, O_RDONLY) : -1;
+    if (imageFd != -1) {
+        uint8_t checksums[8];
+        valid = fstat(imageFd, &st) == 0 && (uint64_t) st.st_size == header->imageSize
+                && pread(imageFd, checksums, sizeof(checksums), 0x48) == (ssize_t) sizeof(checksums)
+                && memcmp(checksums, header->checksums, sizeof(checksums)) == 0;
+        close(imageFd);
+    } else {
+        valid = false;
+    }
+    if (!valid) {
+        logDebug("Ignoring out of date index %s\n", path);
+        munmap(map, mapLength);
+        return NULL;
+    }
+
+    lisafsIndex *index = malloc(sizeof(lisafsIndex));
+    index->map = map;
+    index->mapLength = mapLength;
+    index->header = header;
+    index->files = (const lisafsIndexFile *) ((const uint8_t *) map + header->filesOffset);
+    index->extents = (const extent *) ((const uint8_t *) map + header->extentsOffset);
+    return index;
+}
+
+void lisafsIndexClose(lisafsIndex *index) {
+    if (index == NULL) {
+        return;
+    }
+    munmap(index->map, index->mapLength);
+    free(index);
+}
+
+const lisafsIndexFile *lisafsIndexLookup(const lisafsIndex *index, const char *name) {
+    int lo = 0;
+    int hi = (int) index->header->fileCount - 1;
+    while (lo <= hi) {
+        const int mid = (lo + hi) / 2;
+        const int c = strcasecmp(name, index->files[mid].name);
+        if (c == 0) {
+            return &index->files[mid];
+        }
+        if (c < 0) {
+            hi = mid - 1;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+// ---------- Catalog scan ----------
+
+static bool preadAll(const int fd, void *buffer, const size_t length, const off_t offset) {
+    return pread(fd, buffer, length, offset) == (ssize_t) length;
+}
+
+// The tags are a small part of the file, so read them a chunk at a time until fileid 1 turns up
+static int scanForMDDFSec(const int fd, const int sectors, const int tagSize) {
+    const int chunkSectors = 0x100;
+    bytes tags = malloc(chunkSectors * tagSize);
+    const off_t tagOffset = DATA_OFFSET + ((off_t) sectors * SECTOR_SIZE);
+    int found = -1;
+    for (int from = 0; from < sectors && found == -1; from += chunkSectors) {
+        const int count = (sectors - from) < chunkSectors ? (sectors - from) : chunkSectors;
+        if (!preadAll(fd, tags, (size_t) count * tagSize, tagOffset + ((off_t) from * tagSize))) {
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (readInt(tags, (i * tagSize) + 4) == MDDF_FILE_ID) {
+                found = from + i;
+                break;
+            }
+        }
+    }
+    free(tags);
+    return found;
+}
+
+// Appends the entries of one 4 sector catalog leaf block to *entries, growing it as needed
+static void addCatalogEntries(const uint8_t *block, const bool firstBlock, lisafsCatalogEntry **entries, int *count,
+                              int *capacity) {
+    int offsetToFirstEntry = 0;
+    int entryCount = block[(3 * SECTOR_SIZE) + SECTOR_SIZE - 11];
+    if (firstBlock) {
+        offsetToFirstEntry = CATALOG_FIRST_BLOCK_OFFSET; // the directory entry comes first, and is counted
+        entryCount--;
+    }
+    for (int e = 0; e < entryCount; e++) {
+        const int entryOffset = offsetToFirstEntry + (e * CATALOG_RECORD_LENGTH);
+        if (entryOffset + CATALOG_RECORD_LENGTH > (3 * SECTOR_SIZE) + SECTOR_SIZE - 11) {
+            break;
+        }
+        if (*count == *capacity) {
+            *capacity *= 2;
+            *entries = realloc(*entries, *capacity * sizeof(lisafsCatalogEntry));
+        }
+        lisafsCatalogEntry *entry = &(*entries)[(*count)++];
+        memcpy(entry->name, block + entryOffset + 3, sizeof(entry->name) - 1);
+        entry->name[sizeof(entry->name) - 1] = '\0';
+        entry->sfileid = readInt(block, entryOffset + 38);
+        entry->created = readLong(block, entryOffset + 40);
+        entry->modified = readLong(block, entryOffset + 44);
+        entry->size = readLong(block, entryOffset + 48);
+    }
+}
+
+int lisafsScanCatalog(const char *path, lisafsCatalogEntry **entries) {
+    *entries = NULL;
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("ERROR! Could not open %s\n", path);
+        return -1;
+    }
+    uint8_t header[0x54];
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !preadAll(fd, header, sizeof(header), 0)) {
+        printf("ERROR! Could not read %s\n", path);
+        close(fd);
+        return -1;
+    }
+    const uint32_t dataSize = readLong(header, 0x40);
+    const uint32_t tagBytes = readLong(header, 0x44);
+    const int sectors = (int) (dataSize / SECTOR_SIZE);
+    const int tagSize = sectors > 0 ? (int) (tagBytes / sectors) : 0;
+    if (sectors == 0 || (tagSize != PROFILE_TAG_SIZE && tagSize != PRIAM_TAG_SIZE)
+        || (uint64_t) st.st_size != (uint64_t) DATA_OFFSET + dataSize + tagBytes) {
+        printf("ERROR! %s is not a DC42 image we understand\n", path);
+        close(fd);
+        return -1;
+    }
+
+    lisafsIndex *index = lisafsIndexOpen(path);
+    const int MDDFSec = index != NULL ? index->header->MDDFSec : scanForMDDFSec(fd, sectors, tagSize);
+    lisafsIndexClose(index);
+    bytes block = malloc(SECTOR_SIZE * 4);
+    if (MDDFSec == -1 || !preadAll(fd, block, SECTOR_SIZE, DATA_OFFSET + ((off_t) MDDFSec * SECTOR_SIZE))) {
+        printf("ERROR! No MDDF found in %s\n", path);
+        free(block);
+        close(fd);
+        return -1;
+    }
+
+    int capacity = 64;
+    int count = 0;
+    *entries = malloc(capacity * sizeof(lisafsCatalogEntry));
+    const int first = (int) readLong(block, MDDF_ROOT_PAGE);
+    int dirSec = first;
+    int visited = 0;
+    while (dirSec != -1 && visited++ < sectors / 4) { // guard against a looping chain
+        if (dirSec < 0 || dirSec + 4 > sectors
+            || !preadAll(fd, block, SECTOR_SIZE * 4, DATA_OFFSET + ((off_t) dirSec * SECTOR_SIZE))) {
+            printf("ERROR! Bad catalog block 0x%X in %s\n", dirSec, path);
+            break;
+        }
+        addCatalogEntries(block, dirSec == first, entries, &count, &capacity);
+        const uint32_t next = readLong(block, (3 * SECTOR_SIZE) + SECTOR_SIZE - 6);
+        dirSec = next == 0xFFFFFFFF ? -1 : (int) next + MDDFSec;
+    }
+    free(block);
+    close(fd);
+    return count;
+}
+
+int lisafsListCatalog(lisafsVolume *vol, lisafsCatalogEntry **entries) {
+    int capacity = 64;
+    int count = 0;
+    *entries = malloc(capacity * sizeof(lisafsCatalogEntry));
+    const int first = (int) readMDDFLong(vol, MDDF_ROOT_PAGE);
+    int dirSec = first;
+    int visited = 0;
+    while (dirSec != -1 && visited++ < vol->geo.sectors / 4) { // guard against a looping chain
+        if (dirSec < 0 || dirSec + 4 > vol->geo.sectors) {
+            printf("ERROR! Bad catalog block 0x%X\n", dirSec);
+            break;
+        }
+        bytes block = read4Sectors(vol, dirSec);
+        addCatalogEntries(block, dirSec == first, entries, &count, &capacity);
+        const uint32_t next = readLong(block, (3 * SECTOR_SIZE) + SECTOR_SIZE - 6);
+        free(block);
+        dirSec = next == 0xFFFFFFFF ? -1 : (int) next + vol->MDDFSec;
+    }
+    return count;
+}
+
+// ---------- Formatting ----------
+
+static const int FORMAT_MDDF_SEC = 0x1C; // boot sector, then the OS loader, then the MDDF, like the real images
+static const int FORMAT_SFILE_BLOCKS = 8;
+static const uint16_t FORMAT_FS_VERSION = 0x0011; // the B-tree (hierarchical) catalog
+
+static void formatTag(lisafsVolume *vol, const int sector, const uint16_t fileId, const uint16_t relpage, const uint32_t fwdlink, const uint32_t bkwdlink) {
+    writeTagInt(vol, sector, 4, fileId);
+    writeTagInt(vol, sector, 6, 0x8200); //dataused (0x8200 seems standard)
+    writeTag3Byte(vol, sector, 8, sector - vol->MDDFSec); //abspage
+    writeTagInt(vol, sector, 12, relpage);
+    writeTag3Byte(vol, sector, 14, fwdlink);
+    writeTag3Byte(vol, sector, 17, bkwdlink);
+}
+
+bytes lisafsFormat(const int sectors, const int tagSize, const char *volumeName, size_t *length) {
+    const int bitmapSectors = ((sectors - FORMAT_MDDF_SEC) + (8 * SECTOR_SIZE) - 1) / (8 * SECTOR_SIZE); //8 sectors per byte
+    const int bitmapSec = FORMAT_MDDF_SEC + 1;
+    const int sFileSec = bitmapSec + bitmapSectors;
+    if (sFileSec + FORMAT_SFILE_BLOCKS > CATALOG_SEC_OFFSET || sectors < CATALOG_SEC_OFFSET + (2 * 0x400)) {
+        printf("ERROR! Can't format a volume of 0x%X sectors\n", sectors);
+        return NULL;
+    }
+
+    // calloc, so the free space (nearly all of it) never gets touched here
+    lisafsVolume formatting = {0};
+    lisafsVolume *vol = &formatting;
+    if (!initGeometry(vol, (uint32_t) sectors * SECTOR_SIZE, (uint32_t) (sectors * tagSize))) {
+        return NULL;
+    }
+    *length = (size_t) vol->geo.fileLength;
+    vol->image = calloc(1, *length);
+    vol->MDDFSec = FORMAT_MDDF_SEC;
+    vol->bitmapSec = bitmapSec;
+    vol->sFileSec = sFileSec;
+    vol->sfileBlockCount = FORMAT_SFILE_BLOCKS;
+
+    // DC42 header: disk name as a Pascal string, sizes, magic
+    const int nameLength = (int) strnlen(volumeName, 32);
+    vol->image[0] = nameLength;
+    memcpy(vol->image + 1, volumeName, nameLength);
+    for (int i = 0; i < 4; i++) {
+        vol->image[0x40 + i] = ((sectors * SECTOR_SIZE) >> (24 - (i * 8))) & 0xFF;
+        vol->image[0x44 + i] = ((sectors * tagSize) >> (24 - (i * 8))) & 0xFF;
+    }
+    vol->image[0x52] = 0x01; // DC42 magic bytes
+    vol->image[0x53] = 0x00;
+
+    // boot sector and OS loader placeholders, for installing a loader later
+    formatTag(vol, 0, BOOT_SEC_FILE_ID, 0, 0xFFFFFF, 0xFFFFFF);
+    for (int s = 1; s < FORMAT_MDDF_SEC; s++) {
+        formatTag(vol, s, OS_LOADER_FILE_ID, s - 1, 0xFFFFFF, 0xFFFFFF);
+    }
+
+    // MDDF; addresses are relative to it, except the root page
+    formatTag(vol, FORMAT_MDDF_SEC, MDDF_FILE_ID, 0, 0xFFFFFF, 0xFFFFFF);
+    writeSectorInt(vol, FORMAT_MDDF_SEC, MDDF_FSVERSION, FORMAT_FS_VERSION);
+    writeSector(vol, FORMAT_MDDF_SEC, MDDF_VOLNAME, nameLength);
+    memcpy(vol->image + DATA_OFFSET + (FORMAT_MDDF_SEC * SECTOR_SIZE) + MDDF_VOLNAME + 1, volumeName, nameLength);
+    writeSectorLong(vol, FORMAT_MDDF_SEC, MDDF_BITMAP_ADDR, bitmapSec - FORMAT_MDDF_SEC);
+    writeSectorLong(vol, FORMAT_MDDF_SEC, MDDF_SLIST_ADDR, sFileSec - FORMAT_MDDF_SEC);
+    writeSectorInt(vol, FORMAT_MDDF_SEC, MDDF_SLIST_PACKING, SECTOR_SIZE / SFILE_RECORD_LENGTH);
+    writeSectorInt(vol, FORMAT_MDDF_SEC, MDDF_SLIST_BLOCK_COUNT, FORMAT_SFILE_BLOCKS);
+    writeSectorInt(vol, FORMAT_MDDF_SEC, MDDF_FIRST_FILE, SFILE_RESERVED_ENTRIES);
+    writeSectorInt(vol, FORMAT_MDDF_SEC, MDDF_EMPTY_FILE, SFILE_RESERVED_ENTRIES);
+    writeSectorLong(vol, FORMAT_MDDF_SEC, MDDF_ROOT_PAGE, CATALOG_SEC_OFFSET);
+
+    // free bitmap and s-file, marked in use along with the MDDF
+    for (int i = 0; i < bitmapSectors; i++) {
+        formatTag(vol, bitmapSec + i, BITMAP_FILE_ID, i, 0xFFFFFF, 0xFFFFFF);
+    }
+    for (int i = 0; i < FORMAT_SFILE_BLOCKS; i++) {
+        formatTag(vol, sFileSec + i, SFILE_FILE_ID, i, 0xFFFFFF, 0xFFFFFF);
+    }
+    writeSectorLong(vol, FORMAT_MDDF_SEC, MDDF_FREECOUNT, sectors - FORMAT_MDDF_SEC);
+    claimSectorRun(vol, FORMAT_MDDF_SEC, sFileSec + FORMAT_SFILE_BLOCKS - FORMAT_MDDF_SEC);
+
+    // the catalog: a leaf with just the directory entry, then the non-leaf above it, both made the way
+    // wswrite makes them when it splits
+    const int leaf = claimNextFreeCatalogBlock(vol);
+    writeSector(vol, leaf + 3, SECTOR_SIZE - 11, 1);
+    vol->nonLeafCatalogSec = claimNextFreeCatalogBlock(vol);
+    writeSectorLong(vol, vol->nonLeafCatalogSec, 0, leaf - vol->MDDFSec);
+    writeSector(vol, vol->nonLeafCatalogSec, 4, 0x24);
+    writeSector(vol, vol->nonLeafCatalogSec + 3, SECTOR_SIZE - 11, 1);
+    const int lastUsed = vol->nonLeafCatalogSec + 3;
+
+    // only the sectors up to the catalog hold anything, so only they need checksums
+    for (int s = 0; s <= lastUsed; s++) {
+        bytes tag = vol->image + vol->geo.tagOffset + (s * tagSize);
+        tag[11] = checksumKernel(vol->image + DATA_OFFSET + (s * SECTOR_SIZE), tag, tagSize);
+    }
+    const uint32_t dataChecksum = dc42ChecksumZeroTail(vol->image + DATA_OFFSET, (size_t) (lastUsed + 1) * SECTOR_SIZE, (size_t) sectors * SECTOR_SIZE);
+    const uint32_t tagChecksum = dc42ChecksumZeroTail(vol->image + vol->geo.tagOffset + 12, (size_t) ((lastUsed + 1) * tagSize) - 12, (size_t) (sectors * tagSize) - 12);
+    for (int i = 0; i < 4; i++) {
+        vol->image[0x48 + i] = (dataChecksum >> (24 - (i * 8))) & 0xFF;
+        vol->image[0x4C + i] = (tagChecksum >> (24 - (i * 8))) & 0xFF;
+    }
+    return vol->image;
+}
+
+// ---------- Files ----------
+
+int lisafsList(lisafsVolume *vol, lisafsEntry **entries) {
+    const uint16_t slist_packing = readMDDFInt(vol, MDDF_SLIST_PACKING); //number of s_entries per block in slist
+    *entries = malloc(slist_packing * vol->sfileBlockCount * sizeof(lisafsEntry));
+    int count = 0;
+    uint16_t idx = 0;
+    for (int i = vol->sFileSec; i < (vol->sFileSec + vol->sfileBlockCount); i++) {
+        bytes data = readSector(vol, i);
+        for (int sfileIdx = 0; sfileIdx < slist_packing; sfileIdx++) {
+            const int srec = sfileIdx * SFILE_RECORD_LENGTH;
+            const uint32_t hintAddr = readLong(data, srec);
+            const uint32_t fileAddr = readLong(data, srec + 4);
+            if (idx >= SFILE_RESERVED_ENTRIES && fileAddr != 0x00000000) { //real file
+                lisafsEntry *entry = &(*entries)[count++];
+                entry->sfileid = idx;
+                entry->size = readLong(data, srec + 8);
+                entry->firstSector = (int) fileAddr + vol->MDDFSec;
+                entry->hintSec = (int) hintAddr + vol->MDDFSec;
+                bytes hSec = readSector(vol, entry->hintSec);
+                int nameLength = hSec[0];
+                if (nameLength > (int) sizeof(entry->name) - 1) {
+                    nameLength = (int) sizeof(entry->name) - 1;
+                }
+                memcpy(entry->name, hSec + 1, nameLength);
+                entry->name[nameLength] = '\0';
+                free(hSec);
+            }
+            idx++;
+        }
+        free(data);
+    }
+    return count;
+}
+
+// a sector address from the file's s-record: the hint sector at 0, the first data sector at 4.
+// Returns -1 if sfileid isn't a file.
+static int sfileRecordSector(lisafsVolume *vol, const uint16_t sfileid, const int field) {
+    const uint16_t slist_packing = readMDDFInt(vol, MDDF_SLIST_PACKING); //number of s_entries per block in slist
+    const int sFileSectorToRead = (sfileid / slist_packing) + vol->sFileSec;
+    if (sfileid < SFILE_RESERVED_ENTRIES || sFileSectorToRead >= vol->sFileSec + vol->sfileBlockCount) {
+        return -1;
+    }
+    bytes data = readSector(vol, sFileSectorToRead);
+    const uint32_t fileAddr = readLong(data, (sfileid % slist_packing) * SFILE_RECORD_LENGTH + 4);
+    const uint32_t addr = readLong(data, (sfileid % slist_packing) * SFILE_RECORD_LENGTH + field);
+    free(data);
+    if (fileAddr == 0x00000000) {
+        return -1;
+    }
+    return (int) addr + vol->MDDFSec;
+}
+
+static int fileFirstSector(lisafsVolume *vol, const uint16_t sfileid) {
+    return sfileRecordSector(vol, sfileid, 4);
+}
+
+int lisafsFileExtents(lisafsVolume *vol, const uint16_t sfileid, extent **extents) {
+    const int firstSector = fileFirstSector(vol, sfileid);
+    if (firstSector == -1) {
+        *extents = NULL;
+        return -1;
+    }
+    int *sectors;
+    const int sectorCount = readSectorChain(vol, firstSector, &sectors);
+    *extents = malloc((countExtents(sectors, sectorCount) + 1) * sizeof(extent));
+    const int extentCount = sectorsToExtents(sectors, sectorCount, *extents, sectorCount);
+    free(sectors);
+    return extentCount;
+}
+
+bytes lisafsReadFile(lisafsVolume *vol, const uint16_t sfileid, size_t *length) {
+    const int firstSector = fileFirstSector(vol, sfileid);
+    if (firstSector == -1) {
+        return NULL;
+    }
+
+    int *sectors;
+    const int sectorCount = readSectorChain(vol, firstSector, &sectors);
+    bytes contents = malloc((size_t) sectorCount * SECTOR_SIZE);
+    for (int i = 0; i < sectorCount; i++) {
+        memcpy(contents + ((size_t) i * SECTOR_SIZE), vol->image + DATA_OFFSET + (sectors[i] * SECTOR_SIZE), SECTOR_SIZE);
+    }
+    free(sectors);
+    *length = (size_t) sectorCount * SECTOR_SIZE;
+    return contents;
+}
+
+// case-insensitive match of a name against a catalog entry's zero-padded name field
+static bool catalogNameMatches(const bytes entryName, const char *name, const int nameLength) {
+    const int fieldLength = 36 - 3; // the name runs from 3 up to the type at 36
+    if (nameLength > fieldLength) {
+        return false;
+    }
+    for (int i = 0; i < nameLength; i++) {
+        if (toupper((unsigned char) entryName[i]) != toupper((unsigned char) name[i])) {
+            return false;
+        }
+    }
+    return nameLength == fieldLength || entryName[nameLength] == 0x00;
+}
+
+// Where name's catalog leaf entry is in the image, or -1
+static int findCatalogEntry(lisafsVolume *vol, const char *name) {
+    const int nameLength = (int) strlen(name);
+    const int first = (int) readMDDFLong(vol, MDDF_ROOT_PAGE);
+    int dirSec = first;
+    int visited = 0;
+    while (dirSec != -1 && visited++ < vol->geo.sectors / 4) { // guard against a looping chain
+        bytes dirBlock = read4Sectors(vol, dirSec);
+        int offsetToFirstEntry = 0;
+        int entryCount = dirBlock[(3 * SECTOR_SIZE) + SECTOR_SIZE - 11];
+        if (dirSec == first) {
+            offsetToFirstEntry = CATALOG_FIRST_BLOCK_OFFSET; // the directory entry comes first, and is counted
+            entryCount--;
+        }
+        for (int e = 0; e < entryCount; e++) {
+            const int entryOffset = offsetToFirstEntry + (e * CATALOG_RECORD_LENGTH);
+            if (catalogNameMatches(dirBlock + entryOffset + 3, name, nameLength)) {
+                free(dirBlock);
+                return DATA_OFFSET + (dirSec * SECTOR_SIZE) + entryOffset;
+            }
+        }
+        const uint32_t next = readLong(dirBlock, (3 * SECTOR_SIZE) + SECTOR_SIZE - 6);
+        free(dirBlock);
+        dirSec = next == 0xFFFFFFFF ? -1 : (int) next + vol->MDDFSec;
+    }
+    return -1;
+}
+
+int lisafsLookup(lisafsVolume *vol, const char *name) {
+    const int entry = findCatalogEntry(vol, name);
+    return entry != -1 ? readInt(vol->image, entry + 38) : -1;
+}
+
+int lisafsCopyFile(lisafsVolume *dst, lisafsVolume *src, const char *name) {
+    const int srcEntry = findCatalogEntry(src, name);
+    const int srcId = srcEntry != -1 ? readInt(src->image, srcEntry + 38) : -1;
+    extent *srcExtents = NULL;
+    const int srcExtentCount = srcId != -1 ? lisafsFileExtents(src, (uint16_t) srcId, &srcExtents) : -1;
+    const int srcHint = srcId != -1 ? sfileRecordSector(src, (uint16_t) srcId, 0) : -1;
+    if (srcExtentCount <= 0 || srcHint == -1) {
+        printf("ERROR! %s isn't on the source volume\n", name);
+        free(srcExtents);
+        return -1;
+    }
+    // the name exactly as the source has it, case and all
+    const uint8_t *srcHintData = src->image + DATA_OFFSET + (srcHint * SECTOR_SIZE);
+    char exactName[64];
+    snprintf(exactName, sizeof(exactName), "%.*s", srcHintData[0], (const char *) srcHintData + 1);
+    if (findCatalogEntry(dst, exactName) != -1) {
+        printf("ERROR! The destination already has %s\n", exactName);
+        free(srcExtents);
+        return -1;
+    }
+    logInfo("_________________ Copying file: %s ________________\n", exactName);
+    loadWriteLayout(dst);
+    int sectorCount = 0;
+    for (int e = 0; e < srcExtentCount; e++) {
+        sectorCount += srcExtents[e].count;
+    }
+    extent extents[HINT_MAX_EXTENTS];
+    const int extentCount = allocateExtents(dst, sectorCount, extents, exactName);
+    const int sfileid = extentCount != -1 ? catalogFile(dst, extents, extentCount, sectorCount, readLong(src->image, srcEntry + 48), exactName) : -1;
+    if (sfileid == -1) {
+        free(srcExtents);
+        return -1;
+    }
+
+    // the dates, which writing a new file makes up
+    const int dstEntry = findCatalogEntry(dst, exactName);
+    memcpy(dst->image + dstEntry + 40, src->image + srcEntry + 40, 8);
+    const int dstHint = sfileRecordSector(dst, (uint16_t) sfileid, 0);
+    uint8_t *dstHintData = dst->image + DATA_OFFSET + (dstHint * SECTOR_SIZE);
+    memcpy(dstHintData + 46, srcHintData + 46, 4);
+    memcpy(dstHintData + 54, srcHintData + 54, 4);
+
+    // then the sectors as they are, run by run, wherever the source and destination runs break
+    int s = 0;
+    int sOffset = 0;
+    for (int d = 0; d < extentCount; d++) {
+        int dOffset = 0;
+        while (dOffset < extents[d].count) {
+            const int run = (extents[d].count - dOffset) < (srcExtents[s].count - sOffset) ? (extents[d].count - dOffset) : (srcExtents[s].count - sOffset);
+            countStat(dst, sectorWrites, run);
+            memcpy(dst->image + DATA_OFFSET + ((size_t) (extents[d].start + dOffset) * SECTOR_SIZE),
+                   src->image + DATA_OFFSET + ((size_t) (srcExtents[s].start + sOffset) * SECTOR_SIZE), (size_t) run * SECTOR_SIZE);
+            dOffset += run;
+            sOffset += run;
+            if (sOffset == srcExtents[s].count) {
+                s++;
+                sOffset = 0;
+            }
+        }
+    }
+    writeFileTagBytes(dst, extents, extentCount, (uint16_t) sfileid);
+    free(srcExtents);
+    logInfo("\n");
+    return sfileid;
+}
+
+// ---------- Maintenance ----------
+
+lisafsFragmentation lisafsMeasureFragmentation(lisafsVolume *vol) {
+    lisafsFragmentation frag = {0};
+    int fileCount;
+    fileLayout *files = collectFileLayouts(vol, &fileCount);
+    frag.files = fileCount;
+    for (int f = 0; f < fileCount; f++) {
+        const int e = countExtents(files[f].sectors, files[f].sectorCount);
+        frag.sectors += files[f].sectorCount;
+        frag.extents += e;
+        if (e > 1) {
+            frag.fragmentedFiles++;
+        }
+        free(files[f].sectors);
+    }
+    free(files);
+
+    extent *runs;
+    frag.freeRuns = findFreeRuns(vol, &runs);
+    for (int r = 0; r < frag.freeRuns; r++) {
+        frag.freeSectors += runs[r].count;
+        if (runs[r].count > frag.largestFreeRun) {
+            frag.largestFreeRun = runs[r].count;
+        }
+    }
+    free(runs);
+    return frag;
+}
+
+lisafsBitmapCheck lisafsCheckBitmap(lisafsVolume *vol) {
+    lisafsBitmapCheck check = {0};
+    check.freeSectors = countFreeSectors(vol);
+    check.mddfFreeCount = readMDDFLong(vol, MDDF_FREECOUNT);
+    const uint8_t *bitmap = bitmapBytes(vol);
+    const uint8_t *tags = vol->image + vol->geo.tagOffset;
+    for (int sec = vol->MDDFSec; sec < vol->geo.sectors; sec++) {
+        const uint8_t *tag = tags + ((size_t) sec * vol->geo.tagSize);
+        if (tag[4] == 0 && tag[5] == 0) {
+            continue;
+        }
+        const int bit = sec - vol->MDDFSec;
+        check.taggedButFree += (bitmap[bit / 8] & (1 << (bit % 8))) == 0 ? 1 : 0;
+        check.taggedButFreeMSBFirst += (bitmap[bit / 8] & (0x80 >> (bit % 8))) == 0 ? 1 : 0;
+    }
+    return check;
+}
+
+// ---------- Conversion ----------
+
+bytes lisafsConvertBLU(const uint8_t *blu, const size_t bluLength, size_t *dc42Length) {
+    logInfo("Disk length: 0x%zX\n", bluLength);
+    if (bluLength < (size_t) DATA_OFFSET) {
+        printf("ERROR! Too short to be a BLU image\n");
+        return NULL;
+    }
+
+    // read device type
+    const int32_t deviceType = (blu[0xD] << 16) | (blu[0xE] << 8) | blu[0xF];
+    int tagPerBlock; //tag bytes per block
+    logInfo("Device type: 0x%06X", deviceType);
+    if (deviceType == BLU_PROFILE_TYPE) {
+        logInfo(" (ProFile)\n");
+        tagPerBlock = PROFILE_TAG_SIZE;
+    } else if (deviceType == BLU_WIDGET_TYPE) {
+        logInfo(" (Widget)\n");
+        tagPerBlock = PROFILE_TAG_SIZE;
+    } else if (deviceType == BLU_PRIAM_TYPE) {
+        logInfo(" (Priam)\n");
+        tagPerBlock = PRIAM_TAG_SIZE;
+    } else {
+        logInfo("\n");
+        printf("ERROR! Unsupported disk type 0x%06X\n", deviceType);
+        return NULL;
+    }
+
+    const int blocksInDevice = (blu[0x12] << 16) | (blu[0x13] << 8) | blu[0x14];
+    logInfo("Blocks in device: 0x%06X\n", blocksInDevice);
+    logInfo("Bytes per block: 0x%04X\n", readInt((bytes) blu, 0x15));
+    const size_t bluBlock = SECTOR_SIZE + tagPerBlock;
+    if (bluLength < (blocksInDevice + 1) * bluBlock) { // block 0 is the BLU header
+        printf("ERROR! BLU image is shorter than its header says\n");
+        return NULL;
+    }
+
+    const int dataSize = blocksInDevice * SECTOR_SIZE;
+    const int tagSize = blocksInDevice * tagPerBlock;
+    *dc42Length = DATA_OFFSET + dataSize + tagSize;
+    bytes dc42 = calloc(1, *dc42Length);
+
+    // disk name, as a Pascal string
+    dc42[0] = 0xD;
+    memcpy(dc42 + 1, blu, 0xD);
+    logInfo("Disk name: %.13s\n", (const char *) blu);
+
+    for (int i = 0; i < 4; i++) {
+        dc42[0x40 + i] = (dataSize >> (24 - (i * 8))) & 0xFF; // data block size in bytes
+        dc42[0x44 + i] = (tagSize >> (24 - (i * 8))) & 0xFF; // tag size in bytes
+    }
+    dc42[0x50] = 0x00; // disk encoding byte (doesn't matter for this non-standard case)
+    dc42[0x51] = 0x00; // format byte (doesn't matter for this non-standard case)
+    dc42[0x52] = 0x01; // DC42 magic bytes
+    dc42[0x53] = 0x00;
+
+    // split each block into the data and tag areas
+    for (int i = 0; i < blocksInDevice; i++) {
+        const uint8_t *block = blu + ((i + 1) * bluBlock); // skip the header block
+        memcpy(dc42 + DATA_OFFSET + (i * SECTOR_SIZE), block, SECTOR_SIZE);
+        memcpy(dc42 + DATA_OFFSET + dataSize + (i * tagPerBlock), block + SECTOR_SIZE, tagPerBlock);
+    }
+
+    geometry geo = {0};
+    geo.sectors = blocksInDevice;
+    geo.tagSize = tagPerBlock;
+    geo.tagOffset = DATA_OFFSET + dataSize;
+    geo.fileLength = (int) *dc42Length;
+    lisafsFixHeaderChecksums(dc42, &geo);
+    return dc42;
+}
+
+// Block 0 of a BLU image: name (13 bytes, space padded), device type (3), blocks in device (3), bytes per block (2)
+static bool makeBLUHeader(const uint8_t *dc42, const size_t dc42Length, int32_t deviceType, uint8_t *block, geometry *geo) {
+    if (dc42Length < (size_t) DATA_OFFSET || readInt((bytes) dc42, 0x52) != 0x0100) {
+        printf("ERROR! Not a DC42 image\n");
+        return false;
+    }
+    const uint32_t dataSize = readLong((bytes) dc42, 0x40);
+    const uint32_t tagBytes = readLong((bytes) dc42, 0x44);
+    geo->sectors = (int) (dataSize / SECTOR_SIZE);
+    geo->tagSize = geo->sectors > 0 ? (int) (tagBytes / geo->sectors) : 0;
+    geo->tagOffset = DATA_OFFSET + (int) dataSize;
+    geo->fileLength = geo->tagOffset + (int) tagBytes;
+    if ((geo->tagSize != PROFILE_TAG_SIZE && geo->tagSize != PRIAM_TAG_SIZE) || dc42Length != (size_t) geo->fileLength) {
+        printf("ERROR! Not a DC42 image we can convert\n");
+        return false;
+    }
+    if (deviceType == BLU_GUESS_TYPE) {
+        // Widgets and 10MB ProFiles look the same from here, so this is only a guess
+        deviceType = geo->tagSize == PRIAM_TAG_SIZE ? BLU_PRIAM_TYPE : geo->sectors > 0x2600 ? BLU_WIDGET_TYPE : BLU_PROFILE_TYPE;
+    }
+    if ((deviceType == BLU_PRIAM_TYPE) != (geo->tagSize == PRIAM_TAG_SIZE)
+        || (deviceType != BLU_PROFILE_TYPE && deviceType != BLU_WIDGET_TYPE && deviceType != BLU_PRIAM_TYPE)) {
+        printf("ERROR! Device type 0x%06X doesn't go with 0x%X-byte tags\n", deviceType, geo->tagSize);
+        return false;
+    }
+    const int bluBlock = SECTOR_SIZE + geo->tagSize;
+    memset(block, 0, bluBlock);
+    memset(block, ' ', 0xD);
+    const int nameLength = dc42[0] < 0xD ? dc42[0] : 0xD;
+    memcpy(block, dc42 + 1, nameLength);
+    for (int i = 0; i < 3; i++) {
+        block[0xD + i] = (deviceType >> (16 - (i * 8))) & 0xFF;
+        block[0x12 + i] = (geo->sectors >> (16 - (i * 8))) & 0xFF;
+    }
+    block[0x15] = (bluBlock >> 8) & 0xFF;
+    block[0x16] = bluBlock & 0xFF;
+    return true;
+}
+
+bytes lisafsConvertToBLU(const uint8_t *dc42, const size_t dc42Length, const int32_t deviceType, size_t *bluLength) {
+    geometry geo = {0};
+    uint8_t header[SECTOR_SIZE + 0x18];
+    if (!makeBLUHeader(dc42, dc42Length, deviceType, header, &geo)) {
+        return NULL;
+    }
+    const size_t bluBlock = SECTOR_SIZE + geo.tagSize;
+    *bluLength = (geo.sectors + 1) * bluBlock;
+    bytes blu = malloc(*bluLength);
+    memcpy(blu, header, bluBlock);
+    for (int i = 0; i < geo.sectors; i++) {
+        bytes block = blu + ((i + 1) * bluBlock);
+        memcpy(block, dc42 + DATA_OFFSET + (i * SECTOR_SIZE), SECTOR_SIZE);
+        memcpy(block + SECTOR_SIZE, dc42 + geo.tagOffset + (i * geo.tagSize), geo.tagSize);
+    }
+    return blu;
+}
+
+bool lisafsSaveBLUFile(const char *dc42Path, const char *bluPath, const int32_t deviceType) {
+    const int fd = open(dc42Path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        printf("ERROR! Could not open %s\n", dc42Path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    const size_t dc42Length = (size_t) st.st_size;
+    uint8_t *dc42 = dc42Length > 0 ? mmap(NULL, dc42Length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (dc42 == MAP_FAILED) {
+        printf("ERROR! Could not read %s\n", dc42Path);
+        return false;
+    }
+    madvise(dc42, dc42Length, MADV_SEQUENTIAL);
+    geometry geo = {0};
+    uint8_t header[SECTOR_SIZE + 0x18];
+    if (!makeBLUHeader(dc42, dc42Length, deviceType, header, &geo)) {
+        munmap(dc42, dc42Length);
+        return false;
+    }
+
+    char tmpPath[256];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", bluPath);
+    const int out = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        printf("ERROR! Could not create %s\n", tmpPath);
+        munmap(dc42, dc42Length);
+        return false;
+    }
+    // the interleaving is done by writev, straight out of the mapped image: a data and a tag iovec per sector
+    const int sectorsPerWrite = 512; // 1024 iovecs, the usual IOV_MAX
+    struct iovec iov[1024];
+    const size_t bluBlock = SECTOR_SIZE + geo.tagSize;
+    bool ok = write(out, header, bluBlock) == (ssize_t) bluBlock;
+    for (int first = 0; first < geo.sectors && ok; first += sectorsPerWrite) {
+        const int count = (geo.sectors - first) < sectorsPerWrite ? (geo.sectors - first) : sectorsPerWrite;
+        for (int i = 0; i < count; i++) {
+            iov[2 * i].iov_base = dc42 + DATA_OFFSET + ((size_t) (first + i) * SECTOR_SIZE);
+            iov[2 * i].iov_len = SECTOR_SIZE;
+            iov[(2 * i) + 1].iov_base = dc42 + geo.tagOffset + ((size_t) (first + i) * geo.tagSize);
+            iov[(2 * i) + 1].iov_len = geo.tagSize;
+        }
+        ok = writev(out, iov, 2 * count) == (ssize_t) (count * bluBlock);
+    }
+    ok = (close(out) == 0) && ok;
+    munmap(dc42, dc42Length);
+    if (!ok || rename(tmpPath, bluPath) != 0) {
+        printf("ERROR! Could not write %s\n", bluPath);
+        remove(tmpPath);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,377 @@
+#ifndef LISAFS_H
+#define LISAFS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// liblisafs: the core of wsread, wswrite and fixer as a library.
+// Every operation works on a volume handle that wraps an in-memory DC42 image, so tools can build and inspect
+// images without temp files, and any number of volumes can be open at once (one thread per volume).
+
+#define bytes uint8_t*
+
+enum filetype {
+    PASCAL, NONPASCAL, DATA
+};
+
+enum loglevel {
+    LOG_QUIET, LOG_INFO, LOG_DEBUG // errors always print
+};
+
+// ---------- Constants ----------
+// bytes
+static const int SECTOR_SIZE = 0x200; // bytes per sector
+static const int DATA_OFFSET = 0x54; // length of DC42 file header
+static const int PROFILE_TAG_SIZE = 0x14; // ProFile and Widget
+static const int PRIAM_TAG_SIZE = 0x18; // Priam has 4 more tag bytes, after the ones we use
+// sectors
+static const int CATALOG_SEC_OFFSET = 61; // Which sector the catalog listing starts on
+// MDDF offsets
+static const uint8_t MDDF_FSVERSION = 0x00;
+static const uint8_t MDDF_VOLNAME = 0x0C; // Pascal string, up to 32 characters
+static const uint8_t MDDF_BITMAP_ADDR = 0x88;
+static const uint8_t MDDF_SLIST_ADDR = 0x94;
+static const uint8_t MDDF_SLIST_PACKING = 0x98;
+static const uint8_t MDDF_SLIST_BLOCK_COUNT = 0x9A;
+static const uint8_t MDDF_FIRST_FILE = 0x9C;
+static const uint8_t MDDF_EMPTY_FILE = 0x9E;
+static const uint8_t MDDF_FILECOUNT = 0xB0;
+static const uint8_t MDDF_FREECOUNT = 0xBA;
+static const uint16_t MDDF_ROOT_PAGE = 0x12E;
+// s-file
+static const int SFILE_RECORD_LENGTH = 14;
+static const int SFILE_RESERVED_ENTRIES = 5; // wsread has always skipped these
+// catalog
+static const int CATALOG_RECORD_LENGTH = 64;
+static const int CATALOG_NONLEAF_RECORD_LENGTH = 0x28;
+static const int CATALOG_FIRST_BLOCK_OFFSET = 0x4E; // the directory entry at the start of the first catalog block
+static const int CATALOG_MAX_NAME_LENGTH = 33; // all a catalog record has room for; longer names would overrun it
+// file IDs
+static const uint16_t FREE_FILE_ID = 0x0000;
+static const uint16_t MDDF_FILE_ID = 0x0001;
+static const uint16_t BITMAP_FILE_ID = 0x0002;
+static const uint16_t SFILE_FILE_ID = 0x0003;
+static const uint16_t CATALOG_FILE_ID = 0x0004;
+static const uint16_t DELETED_FILE_ID = 0x7FFF;
+static const uint16_t BOOT_SEC_FILE_ID = 0xAAAA;
+static const uint16_t OS_LOADER_FILE_ID = 0xBBBB;
+static const uint16_t INITIAL_HINT_FILE_ID = 0xFFFB; //the file ID for a hint; seems to be where these start
+// hint sector
+static const int HINT_EXTENT_COUNT = 134; // the 0x0001 after 0x0009 in every single-run hint we've seen
+static const int HINT_FIRST_EXTENT = 136; // then (4-byte offset - MDDFSec, 2-byte sector count) per extent
+static const int HINT_EXTENT_LENGTH = 6;
+static const int HINT_MAX_EXTENTS = 60; // what fits before the end of the sector, with some room to spare
+static const int MAX_FILE_SECTORS = 0xFFFF; // relpage and the hint sector counts are 2 bytes
+
+// ---------- Types ----------
+
+typedef struct lisafsVolume lisafsVolume;
+typedef struct lisafsWriteLocks lisafsWriteLocks;
+
+typedef struct {
+    int start; // first physical sector
+    int count; // sectors in the run
+} extent;
+
+// Everything that depends on the size of the device comes from the DC42 header, so 5MB and 10MB ProFiles,
+// Widgets and Priams all go through the same accessors.
+typedef struct {
+    int sectors; // sectors in the disk (0x2600 for a 5MB ProFile)
+    int tagSize; // tag bytes per sector
+    int tagOffset; // where the tag area starts in the image
+    int fileLength; // header + data + tags
+    // the hot loops, specialized for the tag size
+    int (*findFileId)(lisafsVolume *vol, int from, uint16_t fileId);
+    void (*fixChecksums)(lisafsVolume *vol);
+} geometry;
+
+// What the hot paths did to one volume. Only counted when lisafs.c is built with -DLISAFS_STATS; otherwise it
+// all stays 0.
+typedef struct {
+    uint64_t sectorReads; // sectors copied out of the image
+    uint64_t sectorWrites; // calls to the sector write helpers (1 to 4 bytes each), plus whole sectors filled
+    uint64_t tagReads;
+    uint64_t tagWrites; // calls to the tag write helpers, plus tag rows written a run at a time
+    uint64_t allocations; // extents handed out for file data
+    uint64_t sectorsAllocated;
+    uint64_t bitmapProbes; // isFreeSector calls
+    uint64_t catalogBlocksVisited; // while looking for where a new entry goes
+    uint64_t catalogSplits;
+    // wall time per phase
+    double loadMicros;
+    double allocationMicros;
+    double catalogMicros; // s-file, hint sector and catalog entry
+    double encodeMicros; // text encoding, then copying data and tags into the image
+    double checksumMicros;
+    double writeOutMicros;
+} lisafsStats;
+
+struct lisafsVolume {
+    bytes image; // the whole DC42 image, header included
+    bool ownsImage; // freed by lisafsClose
+    size_t mapLength; // non-zero if the image is mmap'd by lisafsOpenMapped, and unmapped by lisafsClose
+    int mapFd; // the mapped file, kept open for overlays. Only meaningful if mapLength is set
+    geometry geo;
+    int MDDFSec;
+    int bitmapSec;
+    int sFileSec;
+    int nonLeafCatalogSec;
+    int sfileBlockCount;
+    uint16_t lastUsedHintIndex;
+    bool writeLayoutKnown; // nonLeafCatalogSec and lastUsedHintIndex are found on the first write
+    lisafsWriteLocks *locks; // only set while lisafsWriteFiles has threads writing
+    lisafsStats stats;
+};
+
+typedef struct {
+    uint16_t sfileid;
+    char name[64]; // as stored in the hint sector, NUL terminated
+    uint32_t size; // from the s-file
+    int firstSector;
+    int hintSec;
+} lisafsEntry;
+
+typedef struct {
+    int files;
+    int sectors; // in files
+    int extents; // a contiguous file has 1
+    int fragmentedFiles;
+    int freeSectors;
+    int freeRuns;
+    int largestFreeRun;
+} lisafsFragmentation;
+
+// The free bitmap against the tags. On a sound volume nothing a file's tag claims is free. If the bit order
+// (least significant bit first) were wrong for an image, taggedButFree would be large and taggedButFreeMSBFirst small.
+typedef struct {
+    uint32_t freeSectors; // by the bitmap
+    uint32_t mddfFreeCount;
+    int taggedButFree;
+    int taggedButFreeMSBFirst; // the same, reading each byte most significant bit first
+} lisafsBitmapCheck;
+
+// ---------- Index ----------
+
+// A sidecar index (<image>.idx) holds everything opening and listing an image would otherwise work out by
+// scanning, laid out to be used straight from mmap: this header, then the files sorted by name, then their
+// extents. It's only trusted while the image has the same size and DC42 header checksums it was built from.
+// Native byte order; an index from a machine of the other endianness is ignored.
+typedef struct {
+    char magic[8]; // "LISAIDX" and the layout version
+    uint32_t byteOrder; // 0x01020304 as written
+    uint32_t fileCount;
+    uint64_t imageSize;
+    uint8_t checksums[8]; // the image's DC42 data and tag checksums
+    int32_t sectors;
+    int32_t tagSize;
+    int32_t MDDFSec;
+    int32_t bitmapSec;
+    int32_t sFileSec;
+    int32_t nonLeafCatalogSec;
+    int32_t sfileBlockCount;
+    uint32_t lastUsedHintIndex;
+    uint32_t extentCount;
+    uint32_t filesOffset; // from the start of the index
+    uint32_t extentsOffset;
+    uint32_t reserved;
+    uint8_t mddf[0x200]; // the whole MDDF sector
+} lisafsIndexHeader;
+
+typedef struct {
+    char name[64];
+    uint16_t sfileid;
+    uint16_t version; // from the s-file
+    uint32_t size;
+    int32_t hintSec;
+    int32_t firstSector;
+    uint32_t firstExtent; // into the extent table
+    uint32_t extentCount;
+} lisafsIndexFile;
+
+typedef struct {
+    void *map;
+    size_t mapLength;
+    const lisafsIndexHeader *header;
+    const lisafsIndexFile *files; // header->fileCount of them
+    const extent *extents; // header->extentCount of them
+} lisafsIndex;
+
+// Build <imagePath>.idx for vol, which should be the image as it is saved at imagePath.
+bool lisafsIndexWrite(lisafsVolume *vol, const char *imagePath);
+// Map <imagePath>.idx. Returns NULL if there isn't one, or it's out of date.
+lisafsIndex *lisafsIndexOpen(const char *imagePath);
+void lisafsIndexClose(lisafsIndex *index);
+// Case insensitive, like the catalog. NULL if there's no such file.
+const lisafsIndexFile *lisafsIndexLookup(const lisafsIndex *index, const char *name);
+
+// ---------- Catalog scan ----------
+
+// A catalog leaf entry, as it is on disk. Dates are Lisa seconds since 1 January 1901.
+typedef struct {
+    char name[34]; // up to 33 characters, NUL terminated
+    uint16_t sfileid;
+    uint32_t size;
+    uint32_t created;
+    uint32_t modified;
+} lisafsCatalogEntry;
+
+static const uint32_t LISA_EPOCH_OFFSET = 2177452800u; // seconds from 1901 to 1970
+
+// Read just the catalog of the image at path, with a handful of preads: the DC42 header, the tags up to the
+// MDDF (or the MDDF location from an up to date <path>.idx), the MDDF and the leaf blocks from MDDF_ROOT_PAGE on.
+// Nothing is shared between calls, so any number can run at once. Returns the count, or -1; *entries is malloc'd.
+int lisafsScanCatalog(const char *path, lisafsCatalogEntry **entries);
+
+// The same listing, read from a volume that's already open, so packed images work too.
+// Returns the count; *entries is malloc'd.
+int lisafsListCatalog(lisafsVolume *vol, lisafsCatalogEntry **entries);
+
+// ---------- Volumes ----------
+
+// Use a DC42 image that's already in memory. The buffer stays the caller's and is modified in place by writes.
+// Returns NULL if it isn't a DC42 image we understand.
+lisafsVolume *lisafsOpenBuffer(bytes buffer, size_t length);
+// Uses <path>.idx, if there's an up to date one, instead of scanning for the MDDF, bitmap, s-file and catalog.
+// Also takes images packed with lisafsPackRLE.
+lisafsVolume *lisafsOpenFile(const char *path);
+// For tools that mostly read: checks the DC42 header against the file size, then maps the file instead of reading it,
+// so only the sectors actually touched are ever paged in. The mapping is private: writes go to copy-on-write pages
+// and never reach the file, so save with lisafsSaveFile as usual. Doesn't take packed images.
+lisafsVolume *lisafsOpenMapped(const char *path);
+// Another private mapping of a mapped volume's file, with the layout already worked out: a copy-on-write overlay
+// that shares every sector it doesn't write with the base and any other overlays. It sees the file, not changes
+// made to base. Open overlays from one thread (or after the first), then use each from its own. Close each one.
+lisafsVolume *lisafsOpenOverlay(lisafsVolume *base);
+void lisafsClose(lisafsVolume *vol);
+
+// Fix up the tag checksums and the DC42 header checksums, then return a copy of the image.
+bytes lisafsSerialize(lisafsVolume *vol, size_t *length);
+// Serialize to a temporary file and rename it into place, so an interrupted run never leaves a half-written image.
+// Free sectors that are all zeros are left as holes, so they take no disk space or write time.
+bool lisafsSaveFile(lisafsVolume *vol, const char *path);
+// For overlays (and anything opened with lisafsOpenMapped): copy the file it was mapped from, then write just the
+// blocks that differ from it, with no copy of the image in memory. changedBlocks (if not NULL) gets how many 4KB
+// blocks that was.
+bool lisafsSaveOverlay(lisafsVolume *vol, const char *path, int *changedBlocks);
+
+// Like lisafsSaveFile, for an image that isn't open as a volume (fixer's output, say). Both leave all-zero
+// sectors out of the file, as holes, rather than writing them.
+bool lisafsSaveImageFile(const uint8_t *image, size_t length, const char *path);
+// Turn the file system blocks of an existing image that are all zeros into holes, in place.
+// Returns the bytes punched out, or -1 if it can't (the image is still fine).
+long lisafsPunchHoles(const char *path);
+
+// ---------- Run-length packing ----------
+
+// A compact container for storing and moving images: PackBits after a 12-byte header. lisafsOpenFile unpacks
+// these by itself, so a packed image can be used anywhere a DC42 can.
+bool lisafsIsPackedRLE(const uint8_t *data, size_t length);
+bytes lisafsPackRLE(const uint8_t *image, size_t length, size_t *packedLength);
+// Returns NULL if it's not a packed image, or it's damaged
+bytes lisafsUnpackRLE(const uint8_t *packed, size_t packedLength, size_t *length);
+
+// ---------- Formatting ----------
+
+// A fresh, empty volume: boot and OS loader placeholders, MDDF, free bitmap, s-file and an empty catalog,
+// with every checksum already fixed. 0x2600 sectors for a 5MB ProFile, 0x4C00 for a 10MB Widget or Priam.
+// Returns NULL for a size or tag size we can't lay out.
+bytes lisafsFormat(int sectors, int tagSize, const char *volumeName, size_t *length);
+
+// ---------- Files ----------
+
+// Every file in the s-file. Returns the count; *entries is malloc'd.
+int lisafsList(lisafsVolume *vol, lisafsEntry **entries);
+// The whole sectors of a file, following its fwdlink chain. Returns NULL if sfileid isn't a file.
+bytes lisafsReadFile(lisafsVolume *vol, uint16_t sfileid, size_t *length);
+// Where a file's sectors are, as runs along its fwdlink chain, so callers can use them straight from vol->image
+// without copying. Returns the count, or -1 if sfileid isn't a file; *extents is malloc'd.
+int lisafsFileExtents(lisafsVolume *vol, uint16_t sfileid, extent **extents);
+// Find a file by name (case insensitive, like the Lisa) by walking the catalog leaves. Returns its s-file index, or -1.
+int lisafsLookup(lisafsVolume *vol, const char *name);
+// Encode (for text types), allocate and catalog a new file. Returns its s-file index, or -1. Names longer than
+// CATALOG_MAX_NAME_LENGTH are refused, here and in lisafsWriteFiles, before anything is written.
+int lisafsWriteFile(lisafsVolume *vol, const uint8_t *data, size_t length, const char *name, enum filetype fileType);
+
+// Copy a file from one open volume to another without decoding it: its sectors are copied as they are, contiguously
+// if there's room, and only the tags, hint sector, s-record and catalog entry are new. The name, size and dates are
+// the source's. Returns the new s-file index, or -1.
+int lisafsCopyFile(lisafsVolume *dst, lisafsVolume *src, const char *name);
+
+// One file for lisafsWriteFiles
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+    const char *name;
+    enum filetype type;
+    int sfileid; // filled in: the new file's s-file index, or -1 if it couldn't be written
+} lisafsNewFile;
+
+// lisafsWriteFile for a batch, on up to `threads` threads. Only the catalog insert takes a lock: sectors are claimed
+// in the free bitmap with compare-and-swap, and s-file slots and hint file IDs come off atomic counters, so encoding,
+// allocation, the s-file and hint writes and the data and tag copies all run in parallel. Files are placed in
+// whatever order the threads get to them, so use lisafsWriteFile in a loop where the layout has to be reproducible.
+// Returns how many were written.
+int lisafsWriteFiles(lisafsVolume *vol, lisafsNewFile *files, int fileCount, int threads);
+
+// ---------- Maintenance ----------
+
+lisafsFragmentation lisafsMeasureFragmentation(lisafsVolume *vol);
+lisafsBitmapCheck lisafsCheckBitmap(lisafsVolume *vol);
+// Lay every file out contiguously: the named files first, hottest first, then the rest in catalog order.
+// If any file would end up in more pieces than its hint sector can list, nothing moves and it returns false.
+bool lisafsDefragment(lisafsVolume *vol, const char **hotNames, int hotCount);
+
+// ---------- Boot layout ----------
+
+typedef struct {
+    int accesses; // sectors in the trace
+    int fileAccesses; // of those, ones that belong to a file
+    int hotFiles; // files the trace touched, now laid out first in the order it first touched them
+    int seeksBefore; // accesses that weren't to the sector right after the previous one
+    int seeksAfter;
+    long long distanceBefore; // sectors travelled between accesses, in total
+    long long distanceAfter;
+} lisafsTraceReport;
+
+// The file ID in a sector's tag: an s-file index for file data, or one of the *_FILE_ID values.
+uint16_t lisafsSectorOwner(lisafsVolume *vol, int sector);
+// Given the sectors a boot read, in order, lay out the files it touched contiguously and in the order it first
+// touched them, ahead of everything else (like lisafsDefragment), and replay the trace against the new layout.
+lisafsTraceReport lisafsOptimizeForTrace(lisafsVolume *vol, const int *trace, int traceLength);
+
+// ---------- Conversion ----------
+
+// BLU device types, from bytes 0xD-0xF of block 0
+static const int32_t BLU_PROFILE_TYPE = 0x000000;
+static const int32_t BLU_WIDGET_TYPE = 0x000100;
+static const int32_t BLU_PRIAM_TYPE = 0x00FF00;
+static const int32_t BLU_GUESS_TYPE = -1; // Priam for 0x18-byte tags, Widget over 0x2600 sectors, ProFile otherwise
+
+// BLU (interleaved data and tags, 0x54-byte header in block 0) to a new DC42 image. Returns NULL on failure.
+bytes lisafsConvertBLU(const uint8_t *blu, size_t bluLength, size_t *dc42Length);
+// And back: DC42 to BLU, for writing an image to a real drive. DC42 has nowhere to keep BLU's block 0, so it's
+// rebuilt: the name is the DC42 name, space padded to 13 characters, the device type is deviceType (or a guess from
+// the geometry, for BLU_GUESS_TYPE), then the block count and size, and the rest of the block is zeros. The sectors
+// come back exactly, but block 0 only does if the original had nothing past those fields and the type is right.
+// Returns NULL on failure.
+bytes lisafsConvertToBLU(const uint8_t *dc42, size_t dc42Length, int32_t deviceType, size_t *bluLength);
+// The same from file to file, interleaving straight from the mapped image with writev
+bool lisafsSaveBLUFile(const char *dc42Path, const char *bluPath, int32_t deviceType);
+// Recompute the data and tag checksums in the DC42 header
+void lisafsFixHeaderChecksums(bytes image, const geometry *geo);
+
+// ---------- Debugging ----------
+
+// LOG_INFO by default. Shared by every volume, so set it once up front.
+void lisafsSetLogLevel(enum loglevel level);
+// vol->stats as a JSON object
+void lisafsWriteStats(lisafsVolume *vol, FILE *out);
+
+// What a sector belongs to, from its tag: "(MDDF)", "(catalog)", "file 0x2A" and so on, or "" if it's free
+void lisafsDescribeSectorType(lisafsVolume *vol, int sector, char *description, size_t size);
+void lisafsPrintSectorType(lisafsVolume *vol, int sector);
+void lisafsPrintSFile(lisafsVolume *vol);
+
+#endif
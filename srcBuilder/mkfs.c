@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lisafs.h"
+
+// ./mkfs <out.dc42> [sectors] [tagsize] [volume name]
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <out.dc42> [sectors] [tagsize] [volume name]\n", argv[0]);
+        printf("  sectors  0x2600 (5MB ProFile, the default), 0x4C00 (10MB Widget or Priam)\n");
+        printf("  tagsize  0x14 (ProFile, Widget; the default) or 0x18 (Priam)\n");
+        return 1;
+    }
+    const int sectors = argc > 2 ? (int) strtol(argv[2], NULL, 0) : 0x2600;
+    const int tagSize = argc > 3 ? (int) strtol(argv[3], NULL, 0) : PROFILE_TAG_SIZE;
+    const char *volumeName = argc > 4 ? argv[4] : "Untitled";
+
+    size_t length;
+    bytes image = lisafsFormat(sectors, tagSize, volumeName, &length);
+    if (image == NULL) {
+        return 1;
+    }
+    const bool ok = lisafsSaveImageFile(image, length, argv[1]); // nearly all holes
+    free(image);
+    return ok ? 0 : 1;
+}
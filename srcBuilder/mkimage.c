@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lisafs.h"
+#include "synth.h"
+
+// ./mkimage <out.dc42> [sectors] [tagsize] [files] [minsize] [maxsize] [maxrun] [seed]
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <out.dc42> [sectors] [tagsize] [files] [minsize] [maxsize] [maxrun] [seed]\n", argv[0]);
+        printf("  sectors  0x2600 (5MB ProFile), 0x4C00 (10MB Widget or Priam)\n");
+        printf("  tagsize  0x14 (ProFile, Widget) or 0x18 (Priam)\n");
+        printf("  files    how many files to populate it with (0 for an empty volume)\n");
+        printf("  minsize, maxsize  file sizes in bytes\n");
+        printf("  maxrun   0 for contiguous files, otherwise the free run length files get split into\n");
+        printf("  seed     anything but 0; the same seed gives the same image\n");
+        return 1;
+    }
+    synthOptions opts;
+    opts.sectors = argc > 2 ? (int) strtol(argv[2], NULL, 0) : 0x2600;
+    opts.tagSize = argc > 3 ? (int) strtol(argv[3], NULL, 0) : PROFILE_TAG_SIZE;
+    opts.fileCount = argc > 4 ? (int) strtol(argv[4], NULL, 0) : 0;
+    opts.minSize = argc > 5 ? (uint32_t) strtoul(argv[5], NULL, 0) : 512;
+    opts.maxSize = argc > 6 ? (uint32_t) strtoul(argv[6], NULL, 0) : 64 * 1024;
+    opts.maxRun = argc > 7 ? (int) strtol(argv[7], NULL, 0) : 0;
+    opts.seed = argc > 8 ? (uint32_t) strtoul(argv[8], NULL, 0) : 1;
+
+    size_t length;
+    bytes image = synthImage(&opts, &length);
+    if (image == NULL) {
+        return 1;
+    }
+    const bool ok = lisafsSaveImageFile(image, length, argv[1]);
+    free(image);
+    if (!ok) {
+        return 1;
+    }
+    printf("Wrote %s: 0x%X sectors, tag size 0x%X, %d files\n", argv[1], opts.sectors, opts.tagSize, opts.fileCount);
+    return 0;
+}
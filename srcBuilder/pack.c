@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "lisafs.h"
+
+// Smaller images on disk and on the wire: sparse copies, holes punched in place, and the run-length container.
+
+// ---------- Functions ----------
+
+static bytes readWholeFile(const char *path, size_t *length) {
+    FILE *input = fopen(path, "rb");
+    if (input == NULL) {
+        printf("ERROR! Could not open %s\n", path);
+        return NULL;
+    }
+    fseek(input, 0, SEEK_END);
+    *length = (size_t) ftell(input);
+    fseek(input, 0, SEEK_SET);
+    bytes data = malloc(*length > 0 ? *length : 1);
+    if (*length > 0 && fread(data, *length, 1, input) != 1) {
+        printf("ERROR! Could not read %s\n", path);
+        free(data);
+        data = NULL;
+    }
+    fclose(input);
+    return data;
+}
+
+// Packed or not, as a plain DC42 in memory
+static bytes readImage(const char *path, size_t *length) {
+    size_t fileLength;
+    bytes data = readWholeFile(path, &fileLength);
+    if (data == NULL || !lisafsIsPackedRLE(data, fileLength)) {
+        *length = fileLength;
+        return data;
+    }
+    bytes image = lisafsUnpackRLE(data, fileLength, length);
+    free(data);
+    return image;
+}
+
+static double nowMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e3) + (ts.tv_nsec / 1e6);
+}
+
+static void printUsage(const char *path, const double millis) {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        printf("%s: %lld bytes, %lld on disk (%.1f ms)\n", path, (long long) st.st_size, (long long) st.st_blocks * 512, millis);
+    }
+}
+
+// ./pack sparse <in> <out.dc42>    a plain DC42 with its zero sectors left as holes (in may be packed)
+// ./pack punch <image.dc42>        punch holes in an existing image, in place
+// ./pack rle <in.dc42> <out.rle>   the run-length container
+// ./pack unrle <in.rle> <out.dc42> back to a plain DC42, sparse
+int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "punch") == 0) {
+        const double start = nowMillis();
+        const long punched = lisafsPunchHoles(argv[2]);
+        if (punched < 0) {
+            return 1;
+        }
+        printf("Punched out %ld bytes\n", punched);
+        printUsage(argv[2], nowMillis() - start);
+        return 0;
+    }
+    if (argc != 4 || (strcmp(argv[1], "sparse") != 0 && strcmp(argv[1], "rle") != 0 && strcmp(argv[1], "unrle") != 0)) {
+        printf("Usage: %s sparse <in> <out.dc42>\n", argv[0]);
+        printf("       %s punch <image.dc42>\n", argv[0]);
+        printf("       %s rle <in.dc42> <out.rle>\n", argv[0]);
+        printf("       %s unrle <in.rle> <out.dc42>\n", argv[0]);
+        return 1;
+    }
+
+    size_t length;
+    bytes image = readImage(argv[2], &length);
+    if (image == NULL) {
+        return 1;
+    }
+    const double start = nowMillis();
+    bool ok;
+    if (strcmp(argv[1], "rle") == 0) {
+        size_t packedLength;
+        bytes packed = lisafsPackRLE(image, length, &packedLength);
+        FILE *output = fopen(argv[3], "wb");
+        ok = output != NULL && fwrite(packed, 1, packedLength, output) == packedLength;
+        ok = (output != NULL && fclose(output) == 0) && ok;
+        if (!ok) {
+            printf("ERROR! Could not write %s\n", argv[3]);
+        }
+        free(packed);
+    } else {
+        ok = lisafsSaveImageFile(image, length, argv[3]);
+    }
+    free(image);
+    if (ok) {
+        printUsage(argv[3], nowMillis() - start);
+    }
+    return ok ? 0 : 1;
+}
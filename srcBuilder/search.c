@@ -0,0 +1,397 @@
+#define _GNU_SOURCE // for FNM_CASEFOLD
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lisafs.h"
+
+// Finds files by name across a whole collection of images, without dumping any of them.
+// `build` reads just the catalog of every image (lisafsScanCatalog), several images at once, and merges the
+// results into one name-sorted archive index; `find` maps the index and answers from it.
+// Rebuilding only rescans the images whose size or modification time changed since the last build.
+
+// ---------- Constants ----------
+
+static const char ARCHIVE_MAGIC[8] = {'L', 'I', 'S', 'A', 'S', 'R', 'C', 1}; // the last byte is the layout version
+static const uint32_t ARCHIVE_BYTE_ORDER = 0x01020304;
+static const int MAX_THREADS = 16;
+
+// ---------- Types ----------
+
+// The archive index is these three structs in a row, then the image paths, NUL terminated. Native byte order.
+typedef struct {
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t imageCount;
+    uint32_t entryCount;
+    uint32_t imagesOffset;
+    uint32_t entriesOffset;
+    uint32_t pathsOffset;
+} archiveHeader;
+
+typedef struct {
+    uint64_t size; // of the image when it was scanned
+    int64_t mtime;
+    uint32_t pathOffset; // from pathsOffset
+    uint32_t fileCount;
+} archiveImage;
+
+typedef struct {
+    char name[34];
+    uint16_t sfileid;
+    uint32_t image;
+    uint32_t size;
+    uint32_t created; // Lisa seconds
+    uint32_t modified;
+} archiveEntry;
+
+typedef struct {
+    void *map;
+    size_t mapLength;
+    const archiveHeader *header;
+    const archiveImage *images;
+    const archiveEntry *entries;
+    const char *paths;
+} archive;
+
+typedef struct {
+    const char *path;
+    struct stat st;
+    lisafsCatalogEntry *entries; // scanned, or copied out of the old index
+    int count; // -1 if it couldn't be read
+} imageJob;
+
+typedef struct {
+    imageJob *jobs;
+    int jobCount;
+    int next;
+    pthread_mutex_t lock;
+} jobQueue;
+
+// ---------- Archive ----------
+
+static bool openArchive(const char *path, archive *a) {
+    memset(a, 0, sizeof(*a));
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(archiveHeader)) {
+        map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    const archiveHeader *header = map;
+    const size_t length = (size_t) st.st_size;
+    if (memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) != 0 || header->byteOrder != ARCHIVE_BYTE_ORDER
+        || header->imagesOffset != sizeof(archiveHeader)
+        || header->entriesOffset != header->imagesOffset + (header->imageCount * sizeof(archiveImage))
+        || header->pathsOffset != header->entriesOffset + (header->entryCount * sizeof(archiveEntry))
+        || header->pathsOffset > length || ((const char *) map)[length - 1] != '\0') {
+        printf("ERROR! %s is not an archive index\n", path);
+        munmap(map, length);
+        return false;
+    }
+    a->map = map;
+    a->mapLength = length;
+    a->header = header;
+    a->images = (const archiveImage *) ((const uint8_t *) map + header->imagesOffset);
+    a->entries = (const archiveEntry *) ((const uint8_t *) map + header->entriesOffset);
+    a->paths = (const char *) map + header->pathsOffset;
+    return true;
+}
+
+static void closeArchive(archive *a) {
+    if (a->map != NULL) {
+        munmap(a->map, a->mapLength);
+    }
+}
+
+static int compareEntry(const void *a, const void *b) {
+    const archiveEntry *x = a;
+    const archiveEntry *y = b;
+    const int c = strcasecmp(x->name, y->name);
+    if (c != 0) {
+        return c;
+    }
+    return (x->image > y->image) - (x->image < y->image);
+}
+
+static bool writeArchive(const char *path, const imageJob *jobs, const int jobCount) {
+    archiveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+    header.byteOrder = ARCHIVE_BYTE_ORDER;
+
+    archiveImage *images = calloc(jobCount > 0 ? jobCount : 1, sizeof(archiveImage));
+    int entryCount = 0;
+    uint32_t pathsLength = 0;
+    for (int j = 0; j < jobCount; j++) {
+        if (jobs[j].count < 0) {
+            continue; // unreadable, so it's left out until it can be read
+        }
+        archiveImage *image = &images[header.imageCount++];
+        image->size = (uint64_t) jobs[j].st.st_size;
+        image->mtime = (int64_t) jobs[j].st.st_mtime;
+        image->pathOffset = pathsLength;
+        image->fileCount = (uint32_t) jobs[j].count;
+        pathsLength += (uint32_t) strlen(jobs[j].path) + 1;
+        entryCount += jobs[j].count;
+    }
+
+    archiveEntry *entries = calloc(entryCount > 0 ? entryCount : 1, sizeof(archiveEntry));
+    char *paths = malloc(pathsLength > 0 ? pathsLength : 1);
+    int e = 0;
+    uint32_t imageIndex = 0;
+    for (int j = 0; j < jobCount; j++) {
+        if (jobs[j].count < 0) {
+            continue;
+        }
+        memcpy(paths + images[imageIndex].pathOffset, jobs[j].path, strlen(jobs[j].path) + 1);
+        for (int i = 0; i < jobs[j].count; i++) {
+            const lisafsCatalogEntry *from = &jobs[j].entries[i];
+            memcpy(entries[e].name, from->name, sizeof(entries[e].name));
+            entries[e].sfileid = from->sfileid;
+            entries[e].image = imageIndex;
+            entries[e].size = from->size;
+            entries[e].created = from->created;
+            entries[e].modified = from->modified;
+            e++;
+        }
+        imageIndex++;
+    }
+    qsort(entries, entryCount, sizeof(archiveEntry), compareEntry);
+    header.entryCount = (uint32_t) entryCount;
+    header.imagesOffset = sizeof(archiveHeader);
+    header.entriesOffset = header.imagesOffset + (header.imageCount * sizeof(archiveImage));
+    header.pathsOffset = header.entriesOffset + (header.entryCount * sizeof(archiveEntry));
+
+    char tmpPath[512];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *output = fopen(tmpPath, "wb");
+    bool ok = output != NULL;
+    if (ok) {
+        ok = fwrite(&header, sizeof(header), 1, output) == 1;
+        ok = ok && (header.imageCount == 0 || fwrite(images, sizeof(archiveImage), header.imageCount, output) == header.imageCount);
+        ok = ok && (entryCount == 0 || fwrite(entries, sizeof(archiveEntry), entryCount, output) == (size_t) entryCount);
+        ok = ok && fwrite(paths, 1, pathsLength, output) == pathsLength;
+        ok = ok && fputc('\0', output) != EOF; // so an index with no images still ends in a NUL
+        ok = (fclose(output) == 0) && ok;
+        ok = ok && rename(tmpPath, path) == 0;
+    }
+    if (!ok) {
+        printf("ERROR! Could not write %s\n", path);
+        remove(tmpPath);
+    }
+    free(images);
+    free(entries);
+    free(paths);
+    return ok;
+}
+
+// ---------- Build ----------
+
+static void *scanWorker(void *arg) {
+    jobQueue *queue = arg;
+    while (true) {
+        pthread_mutex_lock(&queue->lock);
+        const int j = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (j >= queue->jobCount) {
+            return NULL;
+        }
+        queue->jobs[j].count = lisafsScanCatalog(queue->jobs[j].path, &queue->jobs[j].entries);
+    }
+}
+
+// The old index's entries sorted by name, regrouped by image: image i's are byImage[first[i]] to byImage[first[i + 1]]
+static void groupByImage(const archive *old, int **first, int **byImage) {
+    const uint32_t imageCount = old->header->imageCount;
+    *first = calloc(imageCount + 1, sizeof(int));
+    *byImage = malloc((old->header->entryCount + 1) * sizeof(int));
+    for (uint32_t e = 0; e < old->header->entryCount; e++) {
+        (*first)[old->entries[e].image + 1]++;
+    }
+    for (uint32_t i = 0; i < imageCount; i++) {
+        (*first)[i + 1] += (*first)[i];
+    }
+    int *fill = malloc((imageCount + 1) * sizeof(int));
+    memcpy(fill, *first, (imageCount + 1) * sizeof(int));
+    for (uint32_t e = 0; e < old->header->entryCount; e++) {
+        (*byImage)[fill[old->entries[e].image]++] = (int) e;
+    }
+    free(fill);
+}
+
+// Take an image's entries from the old index if it hasn't changed since, so only new and changed images get scanned
+static bool reuseEntries(const archive *old, const int *first, const int *byImage, imageJob *job) {
+    for (uint32_t i = 0; old->map != NULL && i < old->header->imageCount; i++) {
+        const archiveImage *image = &old->images[i];
+        if (strcmp(old->paths + image->pathOffset, job->path) != 0) {
+            continue;
+        }
+        if (image->size != (uint64_t) job->st.st_size || image->mtime != (int64_t) job->st.st_mtime) {
+            return false;
+        }
+        const int count = first[i + 1] - first[i];
+        job->entries = malloc((count > 0 ? count : 1) * sizeof(lisafsCatalogEntry));
+        job->count = count;
+        for (int k = 0; k < count; k++) {
+            const archiveEntry *from = &old->entries[byImage[first[i] + k]];
+            lisafsCatalogEntry *entry = &job->entries[k];
+            memcpy(entry->name, from->name, sizeof(entry->name));
+            entry->sfileid = from->sfileid;
+            entry->size = from->size;
+            entry->created = from->created;
+            entry->modified = from->modified;
+        }
+        return true;
+    }
+    return false;
+}
+
+static int build(const char *archivePath, char **imagePaths, const int imageCount) {
+    archive old;
+    openArchive(archivePath, &old); // fine if there isn't one yet
+
+    imageJob *jobs = calloc(imageCount > 0 ? imageCount : 1, sizeof(imageJob));
+    jobQueue queue = {calloc(imageCount > 0 ? imageCount : 1, sizeof(imageJob)), 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    int *first = NULL;
+    int *byImage = NULL;
+    if (old.map != NULL) {
+        groupByImage(&old, &first, &byImage);
+    }
+    int reused = 0;
+    for (int i = 0; i < imageCount; i++) {
+        jobs[i].path = imagePaths[i];
+        jobs[i].count = -1;
+        if (stat(imagePaths[i], &jobs[i].st) != 0) {
+            printf("ERROR! Could not open %s\n", imagePaths[i]);
+            continue;
+        }
+        if (reuseEntries(&old, first, byImage, &jobs[i])) {
+            reused++;
+        } else {
+            queue.jobs[queue.jobCount++] = jobs[i];
+        }
+    }
+    free(first);
+    free(byImage);
+    closeArchive(&old);
+
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = threadCount < 1 ? 1 : (threadCount > MAX_THREADS ? MAX_THREADS : threadCount);
+    threadCount = threadCount > queue.jobCount ? queue.jobCount : threadCount;
+    pthread_t threads[MAX_THREADS];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long t = 0; t < threadCount; t++) {
+        pthread_create(&threads[t], NULL, scanWorker, &queue);
+    }
+    for (long t = 0; t < threadCount; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // put the scanned ones back in command line order
+    for (int q = 0, i = 0; q < queue.jobCount; q++) {
+        while (jobs[i].path != queue.jobs[q].path) {
+            i++;
+        }
+        jobs[i] = queue.jobs[q];
+    }
+    const bool ok = writeArchive(archivePath, jobs, imageCount);
+    int fileCount = 0;
+    for (int i = 0; i < imageCount; i++) {
+        fileCount += jobs[i].count > 0 ? jobs[i].count : 0;
+        free(jobs[i].entries);
+    }
+    printf("%d images (%d scanned on %ld threads in %.1f ms, %d unchanged), %d files\n", imageCount, queue.jobCount,
+           threadCount, ((end.tv_sec - start.tv_sec) * 1e3) + ((end.tv_nsec - start.tv_nsec) / 1e6), reused, fileCount);
+    free(queue.jobs);
+    free(jobs);
+    return ok ? 0 : 1;
+}
+
+// ---------- Find ----------
+
+static void printEntry(const archive *a, const archiveEntry *entry) {
+    char created[32];
+    char modified[32];
+    const time_t createdTime = (time_t) entry->created - LISA_EPOCH_OFFSET;
+    const time_t modifiedTime = (time_t) entry->modified - LISA_EPOCH_OFFSET;
+    strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", gmtime(&createdTime));
+    strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M:%S", gmtime(&modifiedTime));
+    printf("%s: %s, %u bytes, created %s, modified %s\n", a->paths + a->images[entry->image].pathOffset,
+           entry->name, entry->size, created, modified);
+}
+
+static int find(const char *archivePath, const char *pattern) {
+    archive a;
+    if (!openArchive(archivePath, &a)) {
+        printf("ERROR! Could not open %s\n", archivePath);
+        return 1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int matches = 0;
+    if (strpbrk(pattern, "*?[") == NULL) {
+        // a plain name: binary search to the first one, they're all together
+        int lo = 0;
+        int hi = (int) a.header->entryCount;
+        while (lo < hi) {
+            const int mid = (lo + hi) / 2;
+            if (strcasecmp(a.entries[mid].name, pattern) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (uint32_t e = (uint32_t) lo; e < a.header->entryCount && strcasecmp(a.entries[e].name, pattern) == 0; e++) {
+            printEntry(&a, &a.entries[e]);
+            matches++;
+        }
+    } else {
+        for (uint32_t e = 0; e < a.header->entryCount; e++) {
+            if (fnmatch(pattern, a.entries[e].name, FNM_CASEFOLD) == 0) {
+                printEntry(&a, &a.entries[e]);
+                matches++;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%d matches in %u files on %u images (%.3f ms)\n", matches, a.header->entryCount, a.header->imageCount,
+           ((end.tv_sec - start.tv_sec) * 1e3) + ((end.tv_nsec - start.tv_nsec) / 1e6));
+    closeArchive(&a);
+    return 0;
+}
+
+// ./search build <archive.idx> <image.dc42>...
+// ./search find <archive.idx> <name or pattern>
+int main(int argc, char *argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "build") == 0) {
+        return build(argv[2], argv + 3, argc - 3);
+    }
+    if (argc == 4 && strcmp(argv[1], "find") == 0) {
+        return find(argv[2], argv[3]);
+    }
+    printf("Usage: %s build <archive.idx> <image.dc42>...\n", argv[0]);
+    printf("       %s find <archive.idx> <name or pattern>\n", argv[0]);
+    printf("  patterns are case insensitive shell wildcards, like '*.obj' or 'libqd/*'\n");
+    return 1;
+}
@@ -0,0 +1,537 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lisafs.h"
+
+// Keeps volumes open and answers list, stat, read and write requests over a Unix domain socket, so a harness making
+// thousands of small queries pays for opening an image once instead of once per query.
+// Readers work on a snapshot: a write goes into a copy of the image, is saved, and only then replaces the snapshot
+// new requests see. Requests already running finish on the snapshot they started with.
+
+// ---------- Constants ----------
+
+static const int MAX_VOLUMES = 64;
+static const int MAX_NAME_LENGTH = CATALOG_MAX_NAME_LENGTH; // the catalog record, not the hint sector, is the limit
+static const uint32_t MAX_WRITE_LENGTH = 16 * 1024 * 1024;
+
+enum serveOp {
+    OP_VOLUMES, OP_LIST, OP_STAT, OP_READ, OP_WRITE
+};
+
+enum serveStatus {
+    STATUS_OK = 0,
+    STATUS_BAD_REQUEST = -1,
+    STATUS_NO_VOLUME = -2,
+    STATUS_NOT_FOUND = -3,
+    STATUS_WRITE_FAILED = -4
+};
+
+// ---------- Protocol ----------
+
+// Native byte order: both ends are on the same machine.
+// A request is this header, then nameLength bytes of file name, then dataLength bytes of file contents (writes only).
+typedef struct {
+    uint8_t op;
+    uint8_t volume;
+    uint8_t fileType; // enum filetype, for writes
+    uint8_t nameLength;
+    uint32_t dataLength;
+} serveRequest;
+
+// A response is this header, then length bytes: serveVolumeInfo records, serveFileInfo records or file contents
+typedef struct {
+    int32_t status;
+    uint32_t length;
+} serveResponse;
+
+typedef struct {
+    uint32_t sectors;
+    uint32_t fileCount;
+    char path[256];
+} serveVolumeInfo;
+
+typedef struct {
+    uint16_t sfileid;
+    uint16_t reserved;
+    uint32_t size;
+    uint32_t created; // Lisa seconds, 0 if the catalog doesn't have the file
+    uint32_t modified;
+    char name[64];
+} serveFileInfo;
+
+// ---------- Types ----------
+
+typedef struct {
+    lisafsVolume *vol;
+    serveFileInfo *files; // sorted by name, case insensitive
+    int fileCount;
+    int refs; // the volume's current pointer counts as one
+} snapshot;
+
+typedef struct {
+    const char *path;
+    snapshot *current;
+    pthread_mutex_t lock; // current and every snapshot's refs
+    pthread_mutex_t writeLock; // one writer at a time
+} residentVolume;
+
+static residentVolume *volumes = NULL;
+static int volumeCount = 0;
+
+// ---------- Snapshots ----------
+
+static int compareFileInfoName(const void *a, const void *b) {
+    return strcasecmp(((const serveFileInfo *) a)->name, ((const serveFileInfo *) b)->name);
+}
+
+// The s-file has the names and sizes, the catalog the dates
+static snapshot *makeSnapshot(lisafsVolume *vol) {
+    lisafsEntry *entries;
+    const int count = lisafsList(vol, &entries);
+    lisafsCatalogEntry *catalog = NULL;
+    const int catalogCount = lisafsListCatalog(vol, &catalog);
+    snapshot *snap = calloc(1, sizeof(snapshot));
+    snap->vol = vol;
+    snap->files = calloc(count > 0 ? count : 1, sizeof(serveFileInfo));
+    snap->fileCount = count;
+    snap->refs = 1;
+    for (int e = 0; e < count; e++) {
+        serveFileInfo *file = &snap->files[e];
+        file->sfileid = entries[e].sfileid;
+        file->size = entries[e].size;
+        strcpy(file->name, entries[e].name);
+        for (int c = 0; c < catalogCount; c++) {
+            if (catalog[c].sfileid == entries[e].sfileid) {
+                file->created = catalog[c].created;
+                file->modified = catalog[c].modified;
+                break;
+            }
+        }
+    }
+    free(catalog);
+    free(entries);
+    qsort(snap->files, count, sizeof(serveFileInfo), compareFileInfoName);
+    return snap;
+}
+
+static snapshot *acquireSnapshot(residentVolume *rv) {
+    pthread_mutex_lock(&rv->lock);
+    snapshot *snap = rv->current;
+    snap->refs++;
+    pthread_mutex_unlock(&rv->lock);
+    return snap;
+}
+
+static void releaseSnapshot(residentVolume *rv, snapshot *snap) {
+    pthread_mutex_lock(&rv->lock);
+    const bool last = --snap->refs == 0;
+    pthread_mutex_unlock(&rv->lock);
+    if (last) {
+        lisafsClose(snap->vol);
+        free(snap->files);
+        free(snap);
+    }
+}
+
+static const serveFileInfo *findFile(const snapshot *snap, const char *name) {
+    serveFileInfo key;
+    snprintf(key.name, sizeof(key.name), "%s", name);
+    return bsearch(&key, snap->files, snap->fileCount, sizeof(serveFileInfo), compareFileInfoName);
+}
+
+// Into a copy of the current image, saved over the image file, then published. Returns false if it couldn't be.
+static bool writeToVolume(residentVolume *rv, const uint8_t *data, const size_t length, const char *name, const enum filetype type, serveFileInfo *written) {
+    pthread_mutex_lock(&rv->writeLock);
+    snapshot *base = acquireSnapshot(rv);
+    const size_t imageLength = (size_t) base->vol->geo.fileLength;
+    bytes image = malloc(imageLength);
+    memcpy(image, base->vol->image, imageLength);
+    releaseSnapshot(rv, base);
+    lisafsVolume *vol = lisafsOpenBuffer(image, imageLength);
+    if (vol == NULL) {
+        free(image);
+        pthread_mutex_unlock(&rv->writeLock);
+        return false;
+    }
+    vol->ownsImage = true;
+    const bool ok = lisafsLookup(vol, name) == -1 && lisafsWriteFile(vol, data, length, name, type) != -1 && lisafsSaveFile(vol, rv->path);
+    if (!ok) {
+        lisafsClose(vol);
+        pthread_mutex_unlock(&rv->writeLock);
+        return false;
+    }
+    snapshot *snap = makeSnapshot(vol);
+    *written = *findFile(snap, name);
+    pthread_mutex_lock(&rv->lock);
+    snapshot *old = rv->current;
+    rv->current = snap;
+    pthread_mutex_unlock(&rv->lock);
+    releaseSnapshot(rv, old);
+    pthread_mutex_unlock(&rv->writeLock);
+    return true;
+}
+
+// ---------- Connections ----------
+
+static bool readFully(const int fd, void *buffer, const size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        const ssize_t n = read(fd, (uint8_t *) buffer + done, length - done);
+        if (n <= 0) {
+            return false;
+        }
+        done += (size_t) n;
+    }
+    return true;
+}
+
+static bool writeFully(const int fd, const void *buffer, const size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        const ssize_t n = send(fd, (const uint8_t *) buffer + done, length - done, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        done += (size_t) n;
+    }
+    return true;
+}
+
+static bool respond(const int fd, const int32_t status, const void *payload, const uint32_t length) {
+    const serveResponse response = {status, length};
+    return writeFully(fd, &response, sizeof(response)) && (length == 0 || writeFully(fd, payload, length));
+}
+
+// Answers one request. Returns false once the connection is done with.
+static bool handleRequest(const int fd) {
+    serveRequest request;
+    char name[256];
+    if (!readFully(fd, &request, sizeof(request)) || !readFully(fd, name, request.nameLength)) {
+        return false;
+    }
+    name[request.nameLength] = '\0';
+    bytes data = NULL;
+    if (request.dataLength > 0) {
+        if (request.op != OP_WRITE || request.dataLength > MAX_WRITE_LENGTH) {
+            respond(fd, STATUS_BAD_REQUEST, NULL, 0);
+            return false; // can't trust the rest of the stream
+        }
+        data = malloc(request.dataLength);
+        if (!readFully(fd, data, request.dataLength)) {
+            free(data);
+            return false;
+        }
+    }
+
+    bool ok;
+    if (request.op == OP_VOLUMES) {
+        serveVolumeInfo *infos = calloc(volumeCount, sizeof(serveVolumeInfo));
+        for (int v = 0; v < volumeCount; v++) {
+            snapshot *snap = acquireSnapshot(&volumes[v]);
+            infos[v].sectors = (uint32_t) snap->vol->geo.sectors;
+            infos[v].fileCount = (uint32_t) snap->fileCount;
+            snprintf(infos[v].path, sizeof(infos[v].path), "%s", volumes[v].path);
+            releaseSnapshot(&volumes[v], snap);
+        }
+        ok = respond(fd, STATUS_OK, infos, volumeCount * sizeof(serveVolumeInfo));
+        free(infos);
+    } else if (request.volume >= volumeCount) {
+        ok = respond(fd, STATUS_NO_VOLUME, NULL, 0);
+    } else if (request.op == OP_WRITE) {
+        residentVolume *rv = &volumes[request.volume];
+        serveFileInfo written;
+        const bool valid = request.nameLength > 0 && request.nameLength <= MAX_NAME_LENGTH && request.fileType <= DATA;
+        if (valid && writeToVolume(rv, data != NULL ? data : (const uint8_t *) "", request.dataLength, name, (enum filetype) request.fileType, &written)) {
+            ok = respond(fd, STATUS_OK, &written, sizeof(written));
+        } else {
+            ok = respond(fd, valid ? STATUS_WRITE_FAILED : STATUS_BAD_REQUEST, NULL, 0);
+        }
+    } else {
+        residentVolume *rv = &volumes[request.volume];
+        snapshot *snap = acquireSnapshot(rv);
+        const serveFileInfo *file = request.op == OP_LIST ? NULL : findFile(snap, name);
+        if (request.op == OP_LIST) {
+            ok = respond(fd, STATUS_OK, snap->files, snap->fileCount * sizeof(serveFileInfo));
+        } else if (request.op != OP_STAT && request.op != OP_READ) {
+            ok = respond(fd, STATUS_BAD_REQUEST, NULL, 0);
+        } else if (file == NULL) {
+            ok = respond(fd, STATUS_NOT_FOUND, NULL, 0);
+        } else if (request.op == OP_STAT) {
+            ok = respond(fd, STATUS_OK, file, sizeof(serveFileInfo));
+        } else {
+            size_t length;
+            bytes contents = lisafsReadFile(snap->vol, file->sfileid, &length);
+            ok = contents != NULL ? respond(fd, STATUS_OK, contents, (uint32_t) length) : respond(fd, STATUS_NOT_FOUND, NULL, 0);
+            free(contents);
+        }
+        releaseSnapshot(rv, snap);
+    }
+    free(data);
+    return ok;
+}
+
+static void *connectionThread(void *arg) {
+    const int fd = (int) (intptr_t) arg;
+    while (handleRequest(fd)) {
+    }
+    close(fd);
+    return NULL;
+}
+
+static int serve(const char *socketPath, char **imagePaths, const int imageCount) {
+    if (imageCount > MAX_VOLUMES) {
+        printf("ERROR! At most %d volumes\n", MAX_VOLUMES);
+        return 1;
+    }
+    lisafsSetLogLevel(LOG_QUIET); // writes would print their catalog chatter for every request
+    volumes = calloc(imageCount, sizeof(residentVolume));
+    for (int i = 0; i < imageCount; i++) {
+        lisafsVolume *vol = lisafsOpenFile(imagePaths[i]);
+        if (vol == NULL) {
+            return 1;
+        }
+        residentVolume *rv = &volumes[volumeCount++];
+        rv->path = imagePaths[i];
+        pthread_mutex_init(&rv->lock, NULL);
+        pthread_mutex_init(&rv->writeLock, NULL);
+        rv->current = makeSnapshot(vol);
+        printf("%d: %s, %d files\n", i, imagePaths[i], rv->current->fileCount);
+    }
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        printf("ERROR! Socket path %s is too long\n", socketPath);
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath);
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath); // left over from a previous run
+    if (listener == -1 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+        printf("ERROR! Could not listen on %s\n", socketPath);
+        return 1;
+    }
+    printf("Serving %d volumes on %s\n", volumeCount, socketPath);
+    fflush(stdout);
+    while (true) {
+        const int fd = accept(listener, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connectionThread, (void *) (intptr_t) fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+// ---------- Client ----------
+
+static int connectTo(const char *socketPath) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socketPath);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        printf("ERROR! Could not connect to %s\n", socketPath);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Sends a request and waits for the answer. Returns the status; *payload is malloc'd.
+static int32_t call(const int fd, const enum serveOp op, const int volume, const char *name, const uint8_t *data, const uint32_t dataLength,
+                    const enum filetype type, bytes *payload, uint32_t *length) {
+    const size_t nameLength = name != NULL ? strlen(name) : 0;
+    const serveRequest request = {(uint8_t) op, (uint8_t) volume, (uint8_t) type, (uint8_t) nameLength, dataLength};
+    serveResponse response;
+    *payload = NULL;
+    *length = 0;
+    if (nameLength > (size_t) MAX_NAME_LENGTH || !writeFully(fd, &request, sizeof(request)) || !writeFully(fd, name, nameLength)
+        || (dataLength > 0 && !writeFully(fd, data, dataLength)) || !readFully(fd, &response, sizeof(response))) {
+        return STATUS_BAD_REQUEST;
+    }
+    *payload = malloc(response.length > 0 ? response.length : 1);
+    if (!readFully(fd, *payload, response.length)) {
+        free(*payload);
+        *payload = NULL;
+        return STATUS_BAD_REQUEST;
+    }
+    *length = response.length;
+    return response.status;
+}
+
+static const char *statusText(const int32_t status) {
+    if (status == STATUS_NO_VOLUME) {
+        return "no such volume";
+    } else if (status == STATUS_NOT_FOUND) {
+        return "no such file";
+    } else if (status == STATUS_WRITE_FAILED) {
+        return "the write failed";
+    }
+    return "bad request";
+}
+
+static void printFileInfo(const serveFileInfo *file) {
+    printf("idx = 0x%02X, size = %u, created = %u, modified = %u, Name = %s\n", file->sfileid, file->size, file->created, file->modified, file->name);
+}
+
+static double nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e6) + (ts.tv_nsec / 1e3);
+}
+
+// Stats and reads every file in turn over one connection, `count` requests in all
+static int benchmark(const int fd, const int volume, const int count) {
+    bytes payload;
+    uint32_t length;
+    if (call(fd, OP_LIST, volume, NULL, NULL, 0, DATA, &payload, &length) != STATUS_OK || length == 0) {
+        printf("ERROR! Nothing to benchmark on volume %d\n", volume);
+        free(payload);
+        return 1;
+    }
+    const serveFileInfo *files = (const serveFileInfo *) payload;
+    const int fileCount = (int) (length / sizeof(serveFileInfo));
+    double statMicros = 0;
+    double readMicros = 0;
+    for (int i = 0; i < count; i++) {
+        bytes reply;
+        uint32_t replyLength;
+        const bool reading = (i % 2) == 1;
+        const double start = nowMicros();
+        const int32_t status = call(fd, reading ? OP_READ : OP_STAT, volume, files[(i / 2) % fileCount].name, NULL, 0, DATA, &reply, &replyLength);
+        *(reading ? &readMicros : &statMicros) += nowMicros() - start;
+        free(reply);
+        if (status != STATUS_OK) {
+            printf("ERROR! %s: %s\n", files[(i / 2) % fileCount].name, statusText(status));
+            free(payload);
+            return 1;
+        }
+    }
+    printf("%d requests: stat %.1f us, read %.1f us on average\n", count, statMicros / ((count + 1) / 2), readMicros / (count / 2 > 0 ? count / 2 : 1));
+    free(payload);
+    return 0;
+}
+
+static bytes readWholeFile(const char *path, size_t *length) {
+    FILE *input = fopen(path, "rb");
+    if (input == NULL) {
+        printf("ERROR! Could not open %s\n", path);
+        return NULL;
+    }
+    fseek(input, 0, SEEK_END);
+    *length = (size_t) ftell(input);
+    fseek(input, 0, SEEK_SET);
+    bytes data = malloc(*length > 0 ? *length : 1);
+    if (*length > 0 && fread(data, *length, 1, input) != 1) {
+        printf("ERROR! Could not read %s\n", path);
+        free(data);
+        data = NULL;
+    }
+    fclose(input);
+    return data;
+}
+
+static int client(const char *command, const char *socketPath, const int argc, char **argv) {
+    const int fd = connectTo(socketPath);
+    if (fd == -1) {
+        return 1;
+    }
+    const int volume = argc > 0 ? atoi(argv[0]) : 0;
+    const char *name = argc > 1 ? argv[1] : NULL;
+    bytes payload = NULL;
+    uint32_t length = 0;
+    int32_t status = STATUS_BAD_REQUEST;
+    int result = 0;
+    if (strcmp(command, "volumes") == 0) {
+        status = call(fd, OP_VOLUMES, 0, NULL, NULL, 0, DATA, &payload, &length);
+        for (uint32_t v = 0; status == STATUS_OK && v < length / sizeof(serveVolumeInfo); v++) {
+            const serveVolumeInfo *info = (const serveVolumeInfo *) payload + v;
+            printf("%u: %s, 0x%X sectors, %u files\n", v, info->path, info->sectors, info->fileCount);
+        }
+    } else if (strcmp(command, "list") == 0) {
+        status = call(fd, OP_LIST, volume, NULL, NULL, 0, DATA, &payload, &length);
+        for (uint32_t f = 0; status == STATUS_OK && f < length / sizeof(serveFileInfo); f++) {
+            printFileInfo((const serveFileInfo *) payload + f);
+        }
+    } else if (strcmp(command, "stat") == 0 && name != NULL) {
+        status = call(fd, OP_STAT, volume, name, NULL, 0, DATA, &payload, &length);
+        if (status == STATUS_OK) {
+            printFileInfo((const serveFileInfo *) payload);
+        }
+    } else if (strcmp(command, "read") == 0 && name != NULL) {
+        status = call(fd, OP_READ, volume, name, NULL, 0, DATA, &payload, &length);
+        FILE *output = status != STATUS_OK ? NULL : argc > 2 ? fopen(argv[2], "wb") : stdout;
+        if (status == STATUS_OK && (output == NULL || fwrite(payload, 1, length, output) != length)) {
+            printf("ERROR! Could not write %s\n", argc > 2 ? argv[2] : "the file");
+            result = 1;
+        }
+        if (output != NULL && output != stdout) {
+            fclose(output);
+        }
+    } else if (strcmp(command, "write") == 0 && name != NULL && argc > 2) {
+        const enum filetype type = argc > 3 && strcmp(argv[3], "pascal") == 0 ? PASCAL : argc > 3 && strcmp(argv[3], "text") == 0 ? NONPASCAL : DATA;
+        size_t dataLength;
+        bytes data = readWholeFile(argv[2], &dataLength);
+        if (data == NULL) {
+            close(fd);
+            return 1;
+        }
+        status = call(fd, OP_WRITE, volume, name, data, (uint32_t) dataLength, type, &payload, &length);
+        free(data);
+        if (status == STATUS_OK) {
+            printFileInfo((const serveFileInfo *) payload);
+        }
+    } else if (strcmp(command, "bench") == 0) {
+        result = benchmark(fd, volume, argc > 1 ? atoi(argv[1]) : 10000);
+        status = STATUS_OK;
+    }
+    if (status != STATUS_OK) {
+        printf("ERROR! %s\n", statusText(status));
+        result = 1;
+    }
+    free(payload);
+    close(fd);
+    return result;
+}
+
+// ./serve run <socket> <image.dc42>...
+// ./serve volumes <socket>
+// ./serve list <socket> <volume>
+// ./serve stat <socket> <volume> <name>
+// ./serve read <socket> <volume> <name> [out]
+// ./serve write <socket> <volume> <name> <host file> [pascal|text|data]
+// ./serve bench <socket> <volume> [requests]
+int main(int argc, char *argv[]) {
+    if (argc >= 4 && strcmp(argv[1], "run") == 0) {
+        signal(SIGPIPE, SIG_IGN);
+        return serve(argv[2], argv + 3, argc - 3);
+    }
+    if (argc < 3) {
+        printf("Usage: %s run <socket> <image.dc42>...\n", argv[0]);
+        printf("       %s volumes <socket>\n", argv[0]);
+        printf("       %s list <socket> <volume>\n", argv[0]);
+        printf("       %s stat <socket> <volume> <name>\n", argv[0]);
+        printf("       %s read <socket> <volume> <name> [out]\n", argv[0]);
+        printf("       %s write <socket> <volume> <name> <host file> [pascal|text|data]\n", argv[0]);
+        printf("       %s bench <socket> <volume> [requests]\n", argv[0]);
+        return 1;
+    }
+    return client(argv[1], argv[2], argc - 3, argv + 3);
+}
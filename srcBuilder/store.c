@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "lisafs.h"
+
+// A deduplicating store for a library of images that are mostly the same OS, loader and libraries.
+// Each image is cut into runs of consecutive sectors whose tags have the same file ID, and each run's data and tags
+// are kept once per distinct content, named by hash, under <store>/objects. <store>/images/<name> is the
+// manifest that puts an image back together: its DC42 header and, in order, the objects for each run.
+// Exported images get their DC42 header checksums recomputed, so they come back byte for byte.
+
+// ---------- Constants ----------
+
+static const char *MANIFEST_MAGIC = "lisastore 1";
+static const int MAX_RUN_SECTORS = 64; // runs also break every 64 sectors, so one new file doesn't make the free space around it all new
+static const uint64_t FNV_OFFSET = 0xCBF29CE484222325ULL;
+static const uint64_t FNV_PRIME = 0x100000001B3ULL;
+
+// ---------- Objects ----------
+
+// FNV-1a, 64 bits. Objects are compared byte for byte before being shared, so a collision can't corrupt anything.
+static uint64_t hashBytes(const uint8_t *data, const size_t length) {
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash ^ length;
+}
+
+static void objectPath(const char *store, const uint64_t hash, char *path, const size_t pathSize) {
+    snprintf(path, pathSize, "%s/objects/%02X/%014llX", store, (unsigned) (hash >> 56), (unsigned long long) (hash & 0xFFFFFFFFFFFFFFULL));
+}
+
+static bool makeDir(const char *path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        printf("ERROR! Could not create %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+static bytes readWholeFile(const char *path, size_t *length) {
+    FILE *input = fopen(path, "rb");
+    if (input == NULL) {
+        return NULL;
+    }
+    fseek(input, 0, SEEK_END);
+    *length = (size_t) ftell(input);
+    fseek(input, 0, SEEK_SET);
+    bytes data = malloc(*length > 0 ? *length : 1);
+    if (*length > 0 && fread(data, *length, 1, input) != 1) {
+        free(data);
+        data = NULL;
+    }
+    fclose(input);
+    return data;
+}
+
+// Returns the bytes newly stored: 0 if it was already there, -1 on failure
+static long putObject(const char *store, const uint8_t *data, const size_t length, uint64_t *hash) {
+    *hash = hashBytes(data, length);
+    char path[512];
+    objectPath(store, *hash, path, sizeof(path));
+    size_t existingLength;
+    bytes existing = readWholeFile(path, &existingLength);
+    if (existing != NULL) {
+        const bool same = existingLength == length && memcmp(existing, data, length) == 0;
+        free(existing);
+        if (!same) {
+            printf("ERROR! Hash collision on %s\n", path);
+            return -1;
+        }
+        return 0;
+    }
+
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/objects/%02X", store, (unsigned) (*hash >> 56));
+    if (!makeDir(dir)) {
+        return -1;
+    }
+    char tmpPath[520];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *output = fopen(tmpPath, "wb");
+    bool ok = output != NULL && fwrite(data, 1, length, output) == length;
+    ok = (output != NULL && fclose(output) == 0) && ok;
+    ok = ok && rename(tmpPath, path) == 0;
+    if (!ok) {
+        printf("ERROR! Could not write %s\n", path);
+        remove(tmpPath);
+        return -1;
+    }
+    return (long) length;
+}
+
+// ---------- Import ----------
+
+static int import(const char *store, const char *imagePath, const char *name) {
+    size_t length;
+    bytes image = readWholeFile(imagePath, &length);
+    lisafsVolume *vol = image != NULL ? lisafsOpenBuffer(image, length) : NULL;
+    if (vol == NULL) {
+        printf("ERROR! Could not read %s\n", imagePath);
+        free(image);
+        return 1;
+    }
+    const int sectors = vol->geo.sectors;
+    const int tagSize = vol->geo.tagSize;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/objects", store);
+    const bool dirsOk = makeDir(store) && makeDir(path);
+    snprintf(path, sizeof(path), "%s/images", store);
+    if (!dirsOk || !makeDir(path)) {
+        lisafsClose(vol);
+        free(image);
+        return 1;
+    }
+
+    char manifestPath[512];
+    char tmpPath[520];
+    snprintf(manifestPath, sizeof(manifestPath), "%s/images/%s", store, name);
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", manifestPath);
+    FILE *manifest = fopen(tmpPath, "w");
+    if (manifest == NULL) {
+        printf("ERROR! Could not create %s\n", tmpPath);
+        lisafsClose(vol);
+        free(image);
+        return 1;
+    }
+    fprintf(manifest, "%s\nsectors 0x%X tagsize 0x%X\nheader ", MANIFEST_MAGIC, sectors, tagSize);
+    for (int i = 0; i < DATA_OFFSET; i++) {
+        fprintf(manifest, "%02X", (i >= 0x48 && i < 0x50) ? 0 : image[i]); // the checksums get recomputed
+    }
+    fprintf(manifest, "\n");
+
+    bool ok = true;
+    long stored = 0;
+    int runs = 0;
+    int sec = 0;
+    while (sec < sectors && ok) {
+        const uint16_t fileId = lisafsSectorOwner(vol, sec);
+        int count = 1;
+        while (sec + count < sectors && (sec + count) % MAX_RUN_SECTORS != 0 && lisafsSectorOwner(vol, sec + count) == fileId) {
+            count++;
+        }
+        uint64_t dataHash;
+        uint64_t tagHash;
+        const long dataStored = putObject(store, image + DATA_OFFSET + (sec * SECTOR_SIZE), (size_t) count * SECTOR_SIZE, &dataHash);
+        const long tagStored = putObject(store, image + vol->geo.tagOffset + (sec * tagSize), (size_t) count * tagSize, &tagHash);
+        ok = dataStored >= 0 && tagStored >= 0;
+        stored += dataStored + tagStored;
+        fprintf(manifest, "run 0x%X 0x%X %016llX %016llX\n", sec, count, (unsigned long long) dataHash, (unsigned long long) tagHash);
+        runs++;
+        sec += count;
+    }
+    ok = (fclose(manifest) == 0) && ok;
+    ok = ok && rename(tmpPath, manifestPath) == 0;
+    if (!ok) {
+        printf("ERROR! Could not import %s\n", imagePath);
+        remove(tmpPath);
+    } else {
+        printf("%s: %d runs, %ld of %zu bytes new\n", name, runs, stored, length);
+    }
+    lisafsClose(vol);
+    free(image);
+    return ok ? 0 : 1;
+}
+
+// ---------- Export ----------
+
+static bool parseManifestHeader(FILE *manifest, int *sectors, int *tagSize, uint8_t *header) {
+    char line[256];
+    if (fgets(line, sizeof(line), manifest) == NULL || strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) != 0) {
+        return false;
+    }
+    if (fscanf(manifest, "sectors %i tagsize %i\nheader ", sectors, tagSize) != 2) {
+        return false;
+    }
+    for (int i = 0; i < DATA_OFFSET; i++) {
+        unsigned int b;
+        if (fscanf(manifest, "%2X", &b) != 1) {
+            return false;
+        }
+        header[i] = (uint8_t) b;
+    }
+    return *sectors > 0 && (*tagSize == PROFILE_TAG_SIZE || *tagSize == PRIAM_TAG_SIZE);
+}
+
+static bool getObject(const char *store, const uint64_t hash, bytes destination, const size_t length) {
+    char path[512];
+    objectPath(store, hash, path, sizeof(path));
+    size_t objectLength;
+    bytes object = readWholeFile(path, &objectLength);
+    if (object == NULL || objectLength != length) {
+        printf("ERROR! Object %s is missing or the wrong size\n", path);
+        free(object);
+        return false;
+    }
+    memcpy(destination, object, length);
+    free(object);
+    return true;
+}
+
+static int export(const char *store, const char *name, const char *outPath) {
+    char manifestPath[512];
+    snprintf(manifestPath, sizeof(manifestPath), "%s/images/%s", store, name);
+    FILE *manifest = fopen(manifestPath, "r");
+    if (manifest == NULL) {
+        printf("ERROR! No image %s in %s\n", name, store);
+        return 1;
+    }
+    int sectors;
+    int tagSize;
+    uint8_t header[0x54];
+    if (!parseManifestHeader(manifest, &sectors, &tagSize, header)) {
+        printf("ERROR! %s is not a manifest\n", manifestPath);
+        fclose(manifest);
+        return 1;
+    }
+
+    geometry geo = {0};
+    geo.sectors = sectors;
+    geo.tagSize = tagSize;
+    geo.tagOffset = DATA_OFFSET + (sectors * SECTOR_SIZE);
+    geo.fileLength = geo.tagOffset + (sectors * tagSize);
+    bytes image = calloc(1, geo.fileLength);
+    memcpy(image, header, DATA_OFFSET);
+
+    bool ok = true;
+    int next = 0; // runs have to cover the disk in order
+    int first;
+    int count;
+    unsigned long long dataHash;
+    unsigned long long tagHash;
+    while (ok && fscanf(manifest, " run %i %i %llX %llX", &first, &count, &dataHash, &tagHash) == 4) {
+        if (first != next || count <= 0 || first + count > sectors) {
+            printf("ERROR! Bad run 0x%X+0x%X in %s\n", first, count, manifestPath);
+            ok = false;
+            break;
+        }
+        ok = getObject(store, dataHash, image + DATA_OFFSET + (first * SECTOR_SIZE), (size_t) count * SECTOR_SIZE)
+             && getObject(store, tagHash, image + geo.tagOffset + (first * tagSize), (size_t) count * tagSize);
+        next = first + count;
+    }
+    fclose(manifest);
+    if (ok && next != sectors) {
+        printf("ERROR! %s stops at sector 0x%X of 0x%X\n", manifestPath, next, sectors);
+        ok = false;
+    }
+    if (ok) {
+        lisafsFixHeaderChecksums(image, &geo);
+        FILE *output = fopen(outPath, "wb");
+        ok = output != NULL && fwrite(image, 1, geo.fileLength, output) == (size_t) geo.fileLength;
+        ok = (output != NULL && fclose(output) == 0) && ok;
+        if (!ok) {
+            printf("ERROR! Could not write %s\n", outPath);
+        }
+    }
+    free(image);
+    return ok ? 0 : 1;
+}
+
+// ---------- Garbage collection ----------
+
+static int compareHash(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *) a;
+    const uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Delete every object no manifest refers to any more
+static int collectGarbage(const char *store) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/images", store);
+    DIR *images = opendir(path);
+    if (images == NULL) {
+        printf("ERROR! %s is not a store\n", store);
+        return 1;
+    }
+    int capacity = 1024;
+    int live = 0;
+    uint64_t *liveHashes = malloc(capacity * sizeof(uint64_t));
+    bool ok = true;
+    struct dirent *dirent;
+    while ((dirent = readdir(images)) != NULL && ok) {
+        if (dirent->d_name[0] == '.' || strstr(dirent->d_name, ".tmp") != NULL) {
+            continue;
+        }
+        char manifestPath[768];
+        snprintf(manifestPath, sizeof(manifestPath), "%s/%s", path, dirent->d_name);
+        FILE *manifest = fopen(manifestPath, "r");
+        int sectors;
+        int tagSize;
+        uint8_t header[0x54];
+        if (manifest == NULL || !parseManifestHeader(manifest, &sectors, &tagSize, header)) {
+            // better to keep everything than to delete objects a manifest we can't read might need
+            printf("ERROR! Could not read %s, not collecting anything\n", manifestPath);
+            ok = false;
+        }
+        int first;
+        int count;
+        unsigned long long hashes[2];
+        while (ok && fscanf(manifest, " run %i %i %llX %llX", &first, &count, &hashes[0], &hashes[1]) == 4) {
+            if (live + 2 > capacity) {
+                capacity *= 2;
+                liveHashes = realloc(liveHashes, capacity * sizeof(uint64_t));
+            }
+            liveHashes[live++] = hashes[0];
+            liveHashes[live++] = hashes[1];
+        }
+        if (manifest != NULL) {
+            fclose(manifest);
+        }
+    }
+    closedir(images);
+    qsort(liveHashes, live, sizeof(uint64_t), compareHash);
+
+    int kept = 0;
+    int deleted = 0;
+    long freed = 0;
+    for (int prefix = 0; prefix < 0x100 && ok; prefix++) {
+        char dirPath[512];
+        snprintf(dirPath, sizeof(dirPath), "%s/objects/%02X", store, prefix);
+        DIR *objects = opendir(dirPath);
+        if (objects == NULL) {
+            continue;
+        }
+        while ((dirent = readdir(objects)) != NULL) {
+            char *end;
+            const uint64_t low = strtoull(dirent->d_name, &end, 16);
+            if (dirent->d_name[0] == '.' || *end != '\0' || strlen(dirent->d_name) != 14) {
+                continue;
+            }
+            const uint64_t hash = ((uint64_t) prefix << 56) | low;
+            if (bsearch(&hash, liveHashes, live, sizeof(uint64_t), compareHash) != NULL) {
+                kept++;
+                continue;
+            }
+            char objectFile[768];
+            snprintf(objectFile, sizeof(objectFile), "%s/%s", dirPath, dirent->d_name);
+            struct stat st;
+            if (stat(objectFile, &st) == 0 && remove(objectFile) == 0) {
+                freed += (long) st.st_size;
+                deleted++;
+            }
+        }
+        closedir(objects);
+    }
+    free(liveHashes);
+    if (ok) {
+        printf("Kept %d objects, deleted %d (%ld bytes)\n", kept, deleted, freed);
+    }
+    return ok ? 0 : 1;
+}
+
+// ./store import <store> <image.dc42> [name]
+// ./store export <store> <name> <out.dc42>
+// ./store gc <store>
+int main(int argc, char *argv[]) {
+    lisafsSetLogLevel(LOG_QUIET);
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "import") == 0) {
+        const char *name = argc == 5 ? argv[4] : strrchr(argv[3], '/') != NULL ? strrchr(argv[3], '/') + 1 : argv[3];
+        return import(argv[2], argv[3], name);
+    }
+    if (argc == 5 && strcmp(argv[1], "export") == 0) {
+        return export(argv[2], argv[3], argv[4]);
+    }
+    if (argc == 3 && strcmp(argv[1], "gc") == 0) {
+        return collectGarbage(argv[2]);
+    }
+    printf("Usage: %s import <store> <image.dc42> [name]\n", argv[0]);
+    printf("       %s export <store> <name> <out.dc42>\n", argv[0]);
+    printf("       %s gc <store>\n", argv[0]);
+    printf("  import replaces any image of the same name; gc then frees what only the old one used\n");
+    return 1;
+}
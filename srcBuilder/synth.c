@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "synth.h"
+
+// ---------- Constants ----------
+
+static const int SYNTH_RESERVED_SECTORS = 0x400; // wswrite leaves this much room at both ends of the disk
+
+// ---------- Functions ----------
+
+uint32_t synthRandom(uint32_t *state) {
+    uint32_t x = *state != 0 ? *state : 0x1CEB00DA;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// ---------- Files ----------
+
+void synthFileName(char *name, const size_t nameSize, const int i) {
+    snprintf(name, nameSize, synthFileType(i) == DATA ? "synth/file%04d.data" : "synth/file%04d.text", i);
+}
+
+enum filetype synthFileType(const int i) {
+    return (i % 4 == 3) ? NONPASCAL : DATA;
+}
+
+bytes synthFileData(uint32_t *state, const uint32_t size, const enum filetype fileType) {
+    bytes data = malloc(size > 0 ? size : 1);
+    int column = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        const uint32_t r = synthRandom(state);
+        if (fileType == DATA) {
+            data[i] = r & 0xFF;
+        } else if (column > 60 + (int) (r % 16)) {
+            data[i] = 0x0A; // host line breaks, like the files in toinsert/
+            column = 0;
+        } else {
+            data[i] = (r % 6 == 0) ? ' ' : 'a' + (r >> 8) % 26;
+            column++;
+        }
+    }
+    return data;
+}
+
+static uint32_t synthFileSize(uint32_t *state, const synthOptions *opts) {
+    const uint32_t minSize = opts->minSize > 0 ? opts->minSize : 1;
+    const uint32_t maxSize = opts->maxSize > minSize ? opts->maxSize : minSize;
+    int lo = 0;
+    int hi = 0;
+    while ((minSize >> (lo + 1)) != 0) {
+        lo++;
+    }
+    while ((maxSize >> (hi + 1)) != 0) {
+        hi++;
+    }
+    // pick a power of 2 first, so small files are as common as big ones
+    const int bucket = lo + (int) (synthRandom(state) % (uint32_t) (hi - lo + 1));
+    uint32_t from = (uint32_t) 1 << bucket;
+    uint32_t to = (bucket == 31) ? 0xFFFFFFFF : ((uint32_t) 1 << (bucket + 1)) - 1;
+    from = from < minSize ? minSize : from;
+    to = to > maxSize ? maxSize : to;
+    return from + (synthRandom(state) % (to - from + 1));
+}
+
+// Mark a bitmap byte in use every maxRun sectors or so, so no free run is much longer than that and the allocator
+// has to split files up. Only whole bitmap bytes count as free, so runs come in multiples of 8 sectors.
+static int blockFreeRuns(lisafsVolume *vol, const int maxRun, uint32_t *state, int **blocked) {
+    bytes bitmap = vol->image + DATA_OFFSET + (vol->bitmapSec * SECTOR_SIZE);
+    const int firstByte = SYNTH_RESERVED_SECTORS / 8;
+    const int lastByte = (vol->geo.sectors - SYNTH_RESERVED_SECTORS - vol->MDDFSec) / 8;
+    const int spread = (2 * maxRun) / 8 > 1 ? (2 * maxRun) / 8 : 1;
+    int count = 0;
+    *blocked = malloc(((lastByte - firstByte) + 1) * sizeof(int));
+    for (int b = firstByte; b < lastByte; b += 1 + (int) (synthRandom(state) % (uint32_t) spread)) {
+        if (bitmap[b] == 0x00) {
+            bitmap[b] = 0x80;
+            (*blocked)[count++] = b;
+        }
+    }
+    return count;
+}
+
+static void unblockFreeRuns(lisafsVolume *vol, const int *blocked, const int count) {
+    bytes bitmap = vol->image + DATA_OFFSET + (vol->bitmapSec * SECTOR_SIZE);
+    for (int i = 0; i < count; i++) {
+        bitmap[blocked[i]] &= ~0x80;
+    }
+}
+
+bytes synthImage(const synthOptions *opts, size_t *length) {
+    size_t formattedLength;
+    bytes formatted = lisafsFormat(opts->sectors, opts->tagSize, "Synthetic", &formattedLength);
+    if (formatted == NULL) {
+        return NULL;
+    }
+    lisafsVolume *vol = lisafsOpenBuffer(formatted, formattedLength);
+    if (vol == NULL) {
+        free(formatted);
+        return NULL;
+    }
+
+    uint32_t state = opts->seed;
+    int *blocked = NULL;
+    int blockedCount = 0;
+    if (opts->maxRun > 0) {
+        blockedCount = blockFreeRuns(vol, opts->maxRun, &state, &blocked);
+    }
+
+    bool ok = true;
+    for (int i = 0; i < opts->fileCount && ok; i++) {
+        char name[32];
+        synthFileName(name, sizeof(name), i);
+        const uint32_t size = synthFileSize(&state, opts);
+        bytes data = synthFileData(&state, size, synthFileType(i));
+        if (lisafsWriteFile(vol, data, size, name, synthFileType(i)) == -1) {
+            printf("ERROR! Could not write %s (%u bytes)\n", name, size);
+            ok = false;
+        }
+        free(data);
+    }
+
+    unblockFreeRuns(vol, blocked, blockedCount);
+    free(blocked);
+    bytes image = ok ? lisafsSerialize(vol, length) : NULL;
+    lisafsClose(vol);
+    free(formatted);
+    return image;
+}
@@ -0,0 +1,33 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lisafs.h"
+
+// Deterministic synthetic volumes for benchmarking and trying things out, so nothing depends on having a real
+// WS_MASTER.dc42 or BLU.blu around. The same options and seed always give the same image, byte for byte.
+
+typedef struct {
+    int sectors; // 0x2600 for a 5MB ProFile, 0x4C00 for a 10MB Widget or Priam
+    int tagSize; // PROFILE_TAG_SIZE or PRIAM_TAG_SIZE
+    int fileCount;
+    uint32_t minSize; // file sizes in bytes, spread evenly over the powers of 2 between these
+    uint32_t maxSize;
+    int maxRun; // 0 lays files out contiguously; otherwise files are split into free runs of about this many sectors
+    uint32_t seed;
+} synthOptions;
+
+// xorshift32, so runs are reproducible across machines and libcs
+uint32_t synthRandom(uint32_t *state);
+
+// Contents for file i of a volume: every 4th file is NONPASCAL text, the rest are DATA.
+void synthFileName(char *name, size_t nameSize, int i);
+enum filetype synthFileType(int i);
+bytes synthFileData(uint32_t *state, uint32_t size, enum filetype fileType);
+
+// A formatted volume populated per the options, with all checksums fixed. Returns NULL on failure.
+bytes synthImage(const synthOptions *opts, size_t *length);
+
+#endif
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "lisafs.h"
+
+// Builds many variants of one master image at once: the master is mapped once, and each variant is a copy-on-write
+// overlay of it that only holds the sectors its files change. Each variant's list is imported on a worker thread,
+// and its output is a copy of the master file with just the changed blocks written over it.
+
+// ---------- Constants ----------
+
+static const int MAX_THREADS = 64;
+
+// ---------- Types ----------
+
+typedef struct {
+    const char *list; // its import list
+    char output[512];
+    lisafsVolume *overlay;
+    bool ok;
+    int files;
+    int written;
+    int changedBlocks;
+    double millis;
+} variantJob;
+
+typedef struct {
+    variantJob *jobs;
+    int jobCount;
+    int next;
+    pthread_mutex_t lock;
+} variantQueue;
+
+// ---------- Functions ----------
+
+static double nowMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e3) + (ts.tv_nsec / 1e6);
+}
+
+static bytes readWholeFile(const char *path, size_t *length) {
+    FILE *input = fopen(path, "rb");
+    if (input == NULL) {
+        return NULL;
+    }
+    fseek(input, 0, SEEK_END);
+    *length = (size_t) ftell(input);
+    fseek(input, 0, SEEK_SET);
+    bytes data = malloc(*length > 0 ? *length : 1);
+    if (*length > 0 && fread(data, *length, 1, input) != 1) {
+        free(data);
+        data = NULL;
+    }
+    fclose(input);
+    return data;
+}
+
+// pascal, text or data; without one, .text files are text and everything else is data
+static bool parseType(const char *word, const char *name, enum filetype *type) {
+    const size_t nameLength = strlen(name);
+    if (word == NULL) {
+        *type = nameLength > 5 && strcasecmp(name + nameLength - 5, ".text") == 0 ? NONPASCAL : DATA;
+    } else if (strcmp(word, "pascal") == 0) {
+        *type = PASCAL;
+    } else if (strcmp(word, "text") == 0) {
+        *type = NONPASCAL;
+    } else if (strcmp(word, "data") == 0) {
+        *type = DATA;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Each line of the list is "<host file> <Lisa name> [pascal|text|data]", as in wswrite's writeFile calls.
+// Blank lines and lines starting with # are skipped.
+static void buildVariant(variantJob *job) {
+    const double start = nowMillis();
+    FILE *list = fopen(job->list, "r");
+    if (list == NULL) {
+        printf("ERROR! Could not open %s\n", job->list);
+        return;
+    }
+    lisafsNewFile *files = NULL;
+    char line[1024];
+    bool ok = true;
+    while (fgets(line, sizeof(line), list) != NULL) {
+        char *save;
+        const char *hostPath = strtok_r(line, " \t\r\n", &save);
+        if (hostPath == NULL || hostPath[0] == '#') {
+            continue;
+        }
+        const char *name = strtok_r(NULL, " \t\r\n", &save);
+        const char *word = name != NULL ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+        if (name != NULL && strlen(name) > (size_t) CATALOG_MAX_NAME_LENGTH) {
+            printf("ERROR! %s: skipping %s: the name is longer than %d characters\n", job->list, name, CATALOG_MAX_NAME_LENGTH);
+            ok = false;
+            continue;
+        }
+        enum filetype type;
+        size_t length = 0;
+        bytes data = name != NULL && parseType(word, name, &type) ? readWholeFile(hostPath, &length) : NULL;
+        if (data == NULL) {
+            printf("ERROR! %s: skipping %s\n", job->list, hostPath);
+            ok = false;
+            continue;
+        }
+        files = realloc(files, (job->files + 1) * sizeof(lisafsNewFile));
+        files[job->files++] = (lisafsNewFile) {data, length, strdup(name), type, -1};
+    }
+    fclose(list);
+
+    // one thread per variant keeps each layout in list order, so the same list always makes the same image
+    job->written = lisafsWriteFiles(job->overlay, files, job->files, 1);
+    for (int f = 0; f < job->files; f++) {
+        free((void *) files[f].data);
+        free((void *) files[f].name);
+    }
+    free(files);
+    job->ok = ok && job->written == job->files && lisafsSaveOverlay(job->overlay, job->output, &job->changedBlocks);
+    job->millis = nowMillis() - start;
+}
+
+static void *variantWorker(void *arg) {
+    variantQueue *queue = arg;
+    while (true) {
+        pthread_mutex_lock(&queue->lock);
+        const int j = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (j >= queue->jobCount) {
+            return NULL;
+        }
+        buildVariant(&queue->jobs[j]);
+        lisafsClose(queue->jobs[j].overlay); // its pages go as soon as it's written
+        queue->jobs[j].overlay = NULL;
+    }
+}
+
+// ./variants [-j threads] <master.dc42> <list>...
+int main(int argc, char *argv[]) {
+    int arg = 1;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > arg + 1 && strcmp(argv[arg], "-j") == 0) {
+        threads = strtol(argv[arg + 1], NULL, 0);
+        arg += 2;
+    }
+    if (argc < arg + 2) {
+        printf("Usage: %s [-j threads] <master.dc42> <list>...\n", argv[0]);
+        printf("  each list (lines of \"<host file> <Lisa name> [pascal|text|data]\") becomes <list less its extension>.dc42\n");
+        return 1;
+    }
+    lisafsSetLogLevel(LOG_QUIET); // the threads would interleave everything but the errors
+    lisafsVolume *master = lisafsOpenMapped(argv[arg]);
+    if (master == NULL) {
+        return 1;
+    }
+
+    const int jobCount = argc - arg - 1;
+    variantQueue queue = {calloc(jobCount, sizeof(variantJob)), jobCount, 0, PTHREAD_MUTEX_INITIALIZER};
+    for (int j = 0; j < jobCount; j++) {
+        variantJob *job = &queue.jobs[j];
+        job->list = argv[arg + 1 + j];
+        snprintf(job->output, sizeof(job->output), "%s", job->list);
+        char *dot = strrchr(job->output, '.');
+        if (dot != NULL && strchr(dot, '/') == NULL) {
+            *dot = '\0';
+        }
+        strncat(job->output, ".dc42", sizeof(job->output) - strlen(job->output) - 1);
+        job->overlay = lisafsOpenOverlay(master);
+        if (job->overlay == NULL) {
+            return 1;
+        }
+    }
+
+    threads = threads < 1 ? 1 : (threads > MAX_THREADS ? MAX_THREADS : threads);
+    threads = threads > jobCount ? jobCount : threads;
+    pthread_t workers[MAX_THREADS];
+    const double start = nowMillis();
+    for (long t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, variantWorker, &queue);
+    }
+    for (long t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    int failed = 0;
+    for (int j = 0; j < jobCount; j++) {
+        const variantJob *job = &queue.jobs[j];
+        failed += job->ok ? 0 : 1;
+        printf("%s: %d of %d files, %d changed 4KB blocks, %.1f ms%s\n", job->output, job->written, job->files,
+               job->changedBlocks, job->millis, job->ok ? "" : " (FAILED)");
+    }
+    printf("%d variants, %d failed, on %ld threads in %.1f ms\n", jobCount, failed, threads, nowMillis() - start);
+    free(queue.jobs);
+    lisafsClose(master);
+    return failed == 0 ? 0 : 1;
+}
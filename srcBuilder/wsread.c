@@ -1,201 +1,284 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <stdbool.h>
-#include <assert.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
-#define bytes uint8_t*
+#include "lisafs.h"
 
 // ---------- Constants ----------
-// bytes
-const int FILE_LENGTH = 0x4EF854; // length of a standard 5MB ProFile image
-const int SECTOR_SIZE = 0x200; // bytes per sector
-const int DATA_OFFSET = 0x54; // length of BLU file header
-const int TAG_SIZE = 0x14; // for ProFile disks
-// sectors
-const int SECTORS_IN_DISK = 0x2600; // for 5MB ProFile
+
+static const int TAR_BLOCK = 512;
+static const int TAR_RECORD = 20 * 512; // archives are padded out to a whole record, like tar does
+static const uint8_t TAR_ZEROS[512] = {0};
+static const int TAR_IOVECS = 1024; // IOV_MAX on Linux
 
 // ---------- Variables ----------
 
-bytes image = NULL;
-int MDDFSec;
-int bitmapSec;
-int sFileSec;
-int sfileBlockCount;
-uint16_t lastUsedHintIndex = 0xFFFB; //seems to be where these start
-bool initialized = false;
+lisafsVolume *vol = NULL;
 
 // ---------- Functions ----------
 
-bytes getImage() {
-    assert(image != NULL);
-    assert(initialized);
-    return image;
-}
-
-uint16_t readInt(const bytes data, const int offset) {
-    assert(data != NULL);
-    return ((data[offset] & 0xFF) << 8) | ((data[offset + 1] & 0xFF));
-}
+void dumpFiles() {
+    lisafsEntry *entries;
+    const int count = lisafsList(vol, &entries);
+    for (int e = 0; e < count; e++) {
+        printf("idx = 0x%02X, hintSec = 0x%02X, ", entries[e].sfileid, entries[e].hintSec);
+        char *name = entries[e].name;
+        printf("Name = ");
+        for (int n = 0; name[n] != '\0'; n++) {
+            if (name[n] == '/') {
+                name[n] = '-';
+            }
+            printf("%c", name[n]);
+        }
+        printf(", ");
 
-uint32_t readLong(const bytes data, const int offset) {
-    assert(data != NULL);
-    return ((data[offset] & 0xFF) << 24) | ((data[offset + 1] & 0xFF) << 16) | ((data[offset + 2] & 0xFF) << 8) | ((data[offset + 3] & 0xFF));
-}
+        char fullpath[256];
+        fullpath[0] = '\0';
+        strcat(fullpath, "extracted/");
+        strcat(fullpath, name);
+        printf(" Fullpath = %s\n", fullpath);
 
-void readFile() {
-    FILE *fileptr = fopen("WS_new.dc42", "rb");
-    image = (bytes) malloc(FILE_LENGTH * sizeof(uint8_t));
-    fread(image, FILE_LENGTH, 1, fileptr);
-    fclose(fileptr);
-    initialized = true;
+        size_t length;
+        bytes contents = lisafsReadFile(vol, entries[e].sfileid, &length);
+        FILE *output = fopen(fullpath, "w");
+        if (output == NULL) {
+            printf("ERROR! Could not create %s\n", fullpath);
+        } else {
+            fwrite(contents, 1, length, output);
+            fclose(output);
+        }
+        free(contents);
+    }
+    free(entries);
 }
 
-bytes readSector(const int sector) {
-    bytes sec = malloc(SECTOR_SIZE);
-    for (int i = 0; i < SECTOR_SIZE; i++) {
-        sec[i] = 0x00;
+// Straight from the sidecar index if there's a good one, without loading the image at all
+int listFiles(const char *imagePath) {
+    lisafsIndex *index = lisafsIndexOpen(imagePath);
+    if (index != NULL) {
+        for (uint32_t f = 0; f < index->header->fileCount; f++) {
+            const lisafsIndexFile *file = &index->files[f];
+            printf("idx = 0x%02X, size = %u, extents = %u, Name = %s\n", file->sfileid, file->size, file->extentCount, file->name);
+        }
+        lisafsIndexClose(index);
+        return 0;
     }
-    const int startIdx = DATA_OFFSET + (sector * SECTOR_SIZE);
-    for (int i = 0; i < SECTOR_SIZE; i++) {
-        sec[i] = getImage()[startIdx + i];
+    vol = lisafsOpenMapped(imagePath);
+    if (vol == NULL) {
+        return 1;
     }
-
-    return sec;
-}
-
-bytes readTag(const int sector) {
-    bytes tag = malloc(TAG_SIZE);
-    const int startIdx = DATA_OFFSET + (SECTORS_IN_DISK * SECTOR_SIZE) + (sector * TAG_SIZE);
-    for (int i = 0; i < TAG_SIZE; i++) {
-        tag[i] = getImage()[startIdx + i];
+    lisafsEntry *entries;
+    const int count = lisafsList(vol, &entries);
+    for (int e = 0; e < count; e++) {
+        printf("idx = 0x%02X, size = %u, Name = %s\n", entries[e].sfileid, entries[e].size, entries[e].name);
     }
-
-    return tag;
+    free(entries);
+    lisafsClose(vol);
+    return 0;
 }
 
-uint16_t readMDDFInt(const int offset) {
-    bytes sec = readSector(MDDFSec);
-    const uint16_t i = readInt(sec, offset);
-    free(sec);
-    return i;
+static void putOctal(char *field, const int width, const uint64_t value) {
+    snprintf(field, width, "%0*llo", width - 1, (unsigned long long) value);
 }
 
-uint32_t readMDDFLong(const int offset) {
-    bytes sec = readSector(MDDFSec);
-    const uint32_t i = readLong(sec, offset);
-    free(sec);
-    return i;
+// A ustar header. The name is the Lisa name, slashes and all, so "libqd/arcs.text" comes out in libqd/.
+static void makeTarHeader(uint8_t *header, const char *name, const uint64_t size, const int64_t mtime) {
+    memset(header, 0, TAR_BLOCK);
+    while (*name == '/') {
+        name++;
+    }
+    snprintf((char *) header, 100, "%s", name);
+    putOctal((char *) header + 100, 8, 0644);
+    putOctal((char *) header + 108, 8, 0);
+    putOctal((char *) header + 116, 8, 0);
+    putOctal((char *) header + 124, 12, size);
+    putOctal((char *) header + 136, 12, mtime > 0 ? (uint64_t) mtime : 0);
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    memset(header + 148, ' ', 8); // the checksum counts its own field as spaces
+    unsigned int checksum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        checksum += header[i];
+    }
+    snprintf((char *) header + 148, 8, "%06o", checksum);
+    header[155] = ' ';
 }
 
-void findMDDFSec() {
-    for (int i = 0; i < SECTORS_IN_DISK; i++) {
-        bytes tag = readTag(i);
-        const uint16_t type = readInt(tag, 4);
-        free(tag);
-        if (type == 0x0001) {
-            MDDFSec = i;
-            printf("mddfsec: 0x%02X\n", MDDFSec);
-            return;
+// writev until it's all gone, picking up after short writes
+static bool writeAll(const int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            return false;
+        }
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= (ssize_t) iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + written;
+            iov->iov_len -= (size_t) written;
         }
     }
+    return true;
 }
 
-void findSFileSec() {
-    sFileSec = (int) readMDDFLong(0x94) + MDDFSec;
-    sfileBlockCount = (int) readMDDFInt(0x9A);
-    printf("emptyfile: 0x%02X\n", readMDDFInt(0x9E));
+// Queue one piece for writev, writing out what's queued first if the array is full. Images not written by us
+// can have any number of extents, so this has to be checked per piece, not per file.
+static bool queueIovec(const int fd, struct iovec *iov, int *iovCount, void *base, const size_t length) {
+    bool ok = true;
+    if (*iovCount == TAR_IOVECS) {
+        ok = writeAll(fd, iov, *iovCount);
+        *iovCount = 0;
+    }
+    iov[(*iovCount)++] = (struct iovec) {base, length};
+    return ok;
 }
 
-void dumpFiles() {
-    const uint16_t slist_packing = readMDDFInt(0x98); //number of s_entries per block in slist
-    uint16_t idx = 0;
-    for (int i = sFileSec; i < (sFileSec + sfileBlockCount); i++) {
-        bytes data = readSector(i);
-        for (int sfileIdx = 0; sfileIdx < slist_packing; sfileIdx++) {
-            if (idx < 5) {
-                idx++;
-                continue;
-            }
-            int srec = sfileIdx * 14; //length of srecord
-            uint32_t fileAddr = readLong(data, srec + 4);
-            int hintSec = readLong(data, srec) + MDDFSec;
-            printf("idx = 0x%02X (offset in sec = 0x%02X), hintSec = 0x%02X, ", idx, srec, hintSec);
-            if (fileAddr == 0x00000000) {
-                printf("\n");
-            }
-            if (fileAddr != 0x00000000) { //real file
-                //int hintSec = readLong(data, srec) + MDDFSec;
-                printf("idx = 0x%02X (offset in sec = 0x%02X), hintSec = 0x%02X, ", idx, srec, hintSec);
-                bytes hSec = readSector(hintSec);
-                int nameLength = hSec[0];
-                char *name = (char *) malloc((nameLength * sizeof(char)) + 1);
-                printf("Name = ");
-                for (int n = 0; n < nameLength; n++) { //bytes we have to read
-                    name[n] = hSec[n + 1];
-                    if (name[n] == '/') {
-                        name[n] = '-';
-                    }
-                    printf("%c", name[n]);
-                }
-                printf(", ");
-                name[nameLength] = '\0';
-
-                char fullpath[256];
-                fullpath[0] = '\0';
-                strcat(fullpath, "extracted/");
-                strcat(fullpath, name);
-                printf(" Fullpath = %s\n", fullpath);
-
-                FILE *output = fopen(fullpath, "w");
-
-                int nextSec = readLong(data, srec + 4) + MDDFSec;
-                while (true) {
-                    //printf("- nextSec = 0x%02X\n", nextSec);
-                    bytes dataSec = readSector(nextSec);
-                    int whereZerosBegin = SECTOR_SIZE;
-                    /*
-                    for (int b = SECTOR_SIZE - 1; b > 0; b--) {
-                        if (dataSec[b] != 0x00) {
-                            break;
-                        }
-                        whereZerosBegin--;
-                    }
-                    */
-                    for (int b = 0; b < whereZerosBegin; b++) {
-                        fprintf(output, "%c", dataSec[b]);
-                    }
-                    free(dataSec);
-                    bytes dataTags = readTag(nextSec);
-                    for (int x = 0; x < TAG_SIZE; x++) {
-                        //printf("%02X", dataTags[x]);
-                    }
-                    //printf("\n");
-                    nextSec = (int) ((dataTags[0xE] << 16) | (dataTags[0xF] << 8) | dataTags[0x10]);
-                    if ((nextSec & 0xFFFFFF) == 0xFFFFFF) {
-                        free(dataTags);
-                        break;
-                    }
-                    nextSec += MDDFSec;
-                    free(dataTags);
-                }
-
-                fclose(output);
-                free(hSec);
+// Every file as a ustar archive, straight from the mapped image: each file is its header, then its extents where
+// they sit in the image, written out with as few writev calls as the iovec limit allows. Sizes and modification dates come
+// from the catalog (the s-file only has whole sectors), so data files come out at their original length.
+// With no outPath (or -) the archive goes to stdoutFd, which main keeps apart from the library's printf output.
+int exportTar(const char *outPath, const int stdoutFd) {
+    const bool toStdout = outPath == NULL || strcmp(outPath, "-") == 0;
+    char tempPath[1024];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", toStdout ? "" : outPath);
+    const int fd = toStdout ? stdoutFd : open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("ERROR! Could not create %s\n", tempPath);
+        return 1;
+    }
+    lisafsEntry *entries;
+    const int count = lisafsList(vol, &entries);
+    lisafsCatalogEntry *catalog = NULL;
+    const int catalogCount = lisafsListCatalog(vol, &catalog);
+
+    struct iovec iov[TAR_IOVECS];
+    uint8_t (*headers)[512] = malloc((size_t) (count > 0 ? count : 1) * TAR_BLOCK); // they have to outlive the writev
+    int iovCount = 0;
+    uint64_t archiveLength = 0;
+    bool ok = true;
+    for (int e = 0; e < count && ok; e++) {
+        extent *extents;
+        const int extentCount = lisafsFileExtents(vol, entries[e].sfileid, &extents);
+        uint64_t chainLength = 0;
+        for (int x = 0; x < extentCount; x++) {
+            chainLength += (uint64_t) extents[x].count * SECTOR_SIZE;
+        }
+        uint64_t size = entries[e].size;
+        int64_t mtime = 0;
+        for (int c = 0; c < catalogCount; c++) {
+            if (catalog[c].sfileid == entries[e].sfileid) {
+                size = catalog[c].size;
+                mtime = (int64_t) catalog[c].modified - LISA_EPOCH_OFFSET;
+                break;
             }
-            idx++;
         }
-        free(data);
+        size = size < chainLength ? size : chainLength;
+        makeTarHeader(headers[e], entries[e].name, size, mtime);
+
+        // the header, the data up to size and the padding to the next block
+        ok = queueIovec(fd, iov, &iovCount, headers[e], TAR_BLOCK);
+        uint64_t remaining = size;
+        for (int x = 0; x < extentCount && remaining > 0 && ok; x++) {
+            const uint64_t length = (uint64_t) extents[x].count * SECTOR_SIZE;
+            const uint64_t take = length < remaining ? length : remaining;
+            ok = queueIovec(fd, iov, &iovCount, vol->image + DATA_OFFSET + ((size_t) extents[x].start * SECTOR_SIZE), take);
+            remaining -= take;
+        }
+        if (size % TAR_BLOCK != 0 && ok) {
+            ok = queueIovec(fd, iov, &iovCount, (void *) TAR_ZEROS, TAR_BLOCK - (size % TAR_BLOCK));
+        }
+        archiveLength += TAR_BLOCK + ((size + TAR_BLOCK - 1) / TAR_BLOCK) * TAR_BLOCK;
+        free(extents);
+    }
+    ok = ok && writeAll(fd, iov, iovCount);
+    // two zero blocks end the archive, then zeros out to the end of the record
+    archiveLength += 2 * TAR_BLOCK;
+    uint64_t padding = 2 * TAR_BLOCK + ((TAR_RECORD - (archiveLength % TAR_RECORD)) % TAR_RECORD);
+    while (ok && padding > 0) {
+        const size_t take = padding < (uint64_t) TAR_BLOCK ? (size_t) padding : (size_t) TAR_BLOCK;
+        ok = write(fd, TAR_ZEROS, take) == (ssize_t) take;
+        padding -= take;
+    }
+    free(headers);
+    free(catalog);
+    free(entries);
+    if (!toStdout) {
+        ok = close(fd) == 0 && ok;
+        if (ok && rename(tempPath, outPath) != 0) {
+            ok = false;
+        }
+        if (!ok) {
+            unlink(tempPath);
+        }
     }
+    if (!ok) {
+        fprintf(stderr, "ERROR! Could not write the archive\n");
+        return 1;
+    }
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
-    //initialize all global vars
-    readFile();
-    findMDDFSec();
-    findSFileSec();
+    // ./read [-q|-v] [index | list | bitmap | tar [out.tar|-]]
+    int arg = 1;
+    if (argc > arg && strcmp(argv[arg], "-q") == 0) {
+        lisafsSetLogLevel(LOG_QUIET);
+        arg++;
+    } else if (argc > arg && strcmp(argv[arg], "-v") == 0) {
+        lisafsSetLogLevel(LOG_DEBUG);
+        arg++;
+    }
+    if (argc > arg && strcmp(argv[arg], "list") == 0) {
+        return listFiles("WS_new.dc42");
+    }
+    const bool tar = argc > arg && strcmp(argv[arg], "tar") == 0;
+    int archiveFd = STDOUT_FILENO;
+    if (tar) {
+        lisafsSetLogLevel(LOG_QUIET); // the archive may be going to stdout
+    }
+    if (tar && (argc <= arg + 1 || strcmp(argv[arg + 1], "-") == 0)) {
+        // the library prints its errors to stdout, so point that at stderr and keep the real stdout for the archive
+        fflush(stdout);
+        archiveFd = dup(STDOUT_FILENO);
+        if (archiveFd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+            fprintf(stderr, "ERROR! Could not set up stdout for the archive\n");
+            return 1;
+        }
+    }
+
+    vol = lisafsOpenMapped("WS_new.dc42");
+    if (vol == NULL) {
+        return 1;
+    }
 
+    if (argc > arg && strcmp(argv[arg], "index") == 0) {
+        const bool ok = lisafsIndexWrite(vol, "WS_new.dc42");
+        lisafsClose(vol);
+        return ok ? 0 : 1;
+    }
+    if (argc > arg && strcmp(argv[arg], "bitmap") == 0) {
+        const lisafsBitmapCheck check = lisafsCheckBitmap(vol);
+        printf("Bitmap: %u sectors free, MDDF says %u\n", check.freeSectors, check.mddfFreeCount);
+        printf("Sectors with a file ID in their tag that the bitmap calls free: %d (%d if the bits went MSB first)\n",
+               check.taggedButFree, check.taggedButFreeMSBFirst);
+        lisafsClose(vol);
+        return check.taggedButFree == 0 && check.freeSectors == check.mddfFreeCount ? 0 : 1;
+    }
+    if (tar) {
+        const int result = exportTar(argc > arg + 1 ? argv[arg + 1] : NULL, archiveFd);
+        lisafsClose(vol);
+        return result;
+    }
     dumpFiles();
+    lisafsClose(vol);
     return 0;
 }
@@ -1,998 +1,522 @@
+#define _GNU_SOURCE // for FNM_CASEFOLD
+
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <stdbool.h>
-#include <ctype.h>
-#include <assert.h>
-#include <math.h>
 #include <string.h>
+#include <strings.h>
+#include <fnmatch.h>
 
-#define bytes uint8_t*
-
-enum filetype {
-    PASCAL, NONPASCAL, DATA
-};
-
-// ---------- Constants ----------
-// bytes
-const int FILE_LENGTH = 0x4EF854; // length of a standard 5MB ProFile image
-const int SECTOR_SIZE = 0x200; // bytes per sector
-const int DATA_OFFSET = 0x54; // length of BLU file header
-const int TAG_SIZE = 0x14; // for ProFile disks
-// sectors
-const int CATALOG_SEC_OFFSET = 61; // Which sector the catalog listing starts on
-const int SECTORS_IN_DISK = 0x2600; // for 5MB ProFile
-// MDDF offsets
-const uint8_t MDDF_BITMAP_ADDR = 0x88;
-const uint8_t MDDF_SLIST_ADDR = 0x94;
-const uint8_t MDDF_SLIST_PACKING = 0x98;
-const uint8_t MDDF_SLIST_BLOCK_COUNT = 0x9A;
-const uint8_t MDDF_FIRST_FILE = 0x9C;
-const uint8_t MDDF_EMPTY_FILE = 0x9E;
-const uint8_t MDDF_FILECOUNT = 0xB0;
-const uint8_t MDDF_FREECOUNT = 0xBA;
-const uint16_t MDDF_ROOT_PAGE = 0x12E;
-// s-file
-const int SFILE_RECORD_LENGTH = 14;
-// catalog
-const int CATALOG_RECORD_LENGTH = 64;
-const int CATALOG_NONLEAF_RECORD_LENGTH = 0x28;
-// file IDs
-const uint16_t FREE_FILE_ID = 0x0000;
-const uint16_t MDDF_FILE_ID = 0x0001;
-const uint16_t BITMAP_FILE_ID = 0x0002;
-const uint16_t SFILE_FILE_ID = 0x0003;
-const uint16_t CATALOG_FILE_ID = 0x0004;
-const uint16_t DELETED_FILE_ID = 0x7FFF;
-const uint16_t BOOT_SEC_FILE_ID = 0xAAAA;
-const uint16_t OS_LOADER_FILE_ID = 0xBBBB;
-const uint16_t INITIAL_HINT_FILE_ID = 0xFFFB; //the file ID for a hint; seems to be where these start
+#include "lisafs.h"
 
 // ---------- Variables ----------
 
-bytes image = NULL;
-int MDDFSec;
-int bitmapSec;
-int sFileSec;
-int nonLeafCatalogSec;
-int sfileBlockCount;
-uint16_t lastUsedHintIndex = INITIAL_HINT_FILE_ID;
-bool initialized = false;
+lisafsVolume *vol = NULL;
 
 // ---------- Functions ----------
 
-bytes getImage() {
-    assert(image != NULL);
-    assert(initialized);
-    return image;
-}
-
-uint16_t readInt(const bytes data, const int offset) {
-    assert(data != NULL);
-    return ((data[offset] & 0xFF) << 8) | ((data[offset + 1] & 0xFF));
-}
-
-uint32_t readLong(const bytes data, const int offset) {
-    assert(data != NULL);
-    return ((data[offset] & 0xFF) << 24) | ((data[offset + 1] & 0xFF) << 16) | ((data[offset + 2] & 0xFF) << 8) | ((data[offset + 3] & 0xFF));
-}
-
-void readFile() {
-    FILE *fileptr = fopen("WS_MASTER.dc42", "rb");
-    image = (bytes) malloc(FILE_LENGTH);
-    fread(image, FILE_LENGTH, 1, fileptr);
-    fclose(fileptr);
-    initialized = true;
-}
-
-bytes readSector(const int sector) {
-    bytes sec = malloc(SECTOR_SIZE);
-    for (int i = 0; i < SECTOR_SIZE; i++) {
-        sec[i] = 0x00;
-    }
-    const int startIdx = DATA_OFFSET + (sector * SECTOR_SIZE);
-    for (int i = 0; i < SECTOR_SIZE; i++) {
-        sec[i] = getImage()[startIdx + i];
-    }
-
-    return sec;
-}
-
-bytes read4Sectors(const int sector) {
-    bytes sec = malloc(SECTOR_SIZE * 4);
-    const int startIdx = DATA_OFFSET + (sector * SECTOR_SIZE);
-    for (int i = 0; i < SECTOR_SIZE * 4; i++) {
-        sec[i] = getImage()[startIdx + i];
-    }
-
-    return sec;
-}
-
-bytes readTag(const int sector) {
-    bytes tag = malloc(TAG_SIZE);
-    const int startIdx = DATA_OFFSET + (SECTORS_IN_DISK * SECTOR_SIZE) + (sector * TAG_SIZE);
-    for (int i = 0; i < TAG_SIZE; i++) {
-        tag[i] = getImage()[startIdx + i];
+// reads toinsert/<srcFileName> and writes it to the volume as name
+void writeFile(const char *srcFileName, const char *name, enum filetype fileType) {
+    char fullpath[256];
+    fullpath[0] = '\0';
+    strcat(fullpath, "toinsert/");
+    strcat(fullpath, srcFileName);
+    FILE *fileptr = fopen(fullpath, "rb"); // Open the file in binary mode
+    if (fileptr == NULL) {
+        printf("ERROR! Could not open %s\n", fullpath);
+        return;
     }
+    fseek(fileptr, 0, SEEK_END);
+    const size_t rawFileSize = (size_t) ftell(fileptr);
+    fseek(fileptr, 0, SEEK_SET);
+    bytes filedata = malloc(rawFileSize); // Enough memory for the file
+    fread(filedata, rawFileSize, 1, fileptr); // Read in the entire file
+    fclose(fileptr); // Close the file
 
-    return tag;
-}
-
-uint8_t readMDDFByte(const int offset) {
-    bytes sec = readSector(MDDFSec);
-    const uint8_t b = sec[offset];
-    free(sec);
-    return b;
-}
-
-uint16_t readMDDFInt(const int offset) {
-    bytes sec = readSector(MDDFSec);
-    const uint16_t i = readInt(sec, offset);
-    free(sec);
-    return i;
-}
-
-uint32_t readMDDFLong(const int offset) {
-    bytes sec = readSector(MDDFSec);
-    const uint32_t i = readLong(sec, offset);
-    free(sec);
-    return i;
-}
-
-void writeTag(const int sector, const int offset, const uint8_t data) {
-    getImage()[DATA_OFFSET + (SECTORS_IN_DISK * SECTOR_SIZE) + (sector * TAG_SIZE) + offset] = data;
-}
-
-void writeTagInt(const int sector, const int offset, const uint16_t data) {
-    getImage()[DATA_OFFSET + (SECTORS_IN_DISK * SECTOR_SIZE) + (sector * TAG_SIZE) + offset] = (data >> 8) & 0xFF;
-    getImage()[DATA_OFFSET + (SECTORS_IN_DISK * SECTOR_SIZE) + (sector * TAG_SIZE) + offset + 1] = data & 0xFF;
-}
-
-// uses 3 LSB
-void writeTag3Byte(const int sector, const int offset, const uint32_t data) {
-    getImage()[DATA_OFFSET + (SECTORS_IN_DISK * SECTOR_SIZE) + (sector * TAG_SIZE) + offset] = (data >> 16) & 0xFF;
-    getImage()[DATA_OFFSET + (SECTORS_IN_DISK * SECTOR_SIZE) + (sector * TAG_SIZE) + offset + 1] = (data >> 8) & 0xFF;
-    getImage()[DATA_OFFSET + (SECTORS_IN_DISK * SECTOR_SIZE) + (sector * TAG_SIZE) + offset + 2] = data & 0xFF;
-}
-
-void writeSector(const int sector, const int offset, const uint8_t data) {
-    getImage()[DATA_OFFSET + (sector * SECTOR_SIZE) + offset] = data;
-}
-
-void writeSectorInt(const int sector, const int offset, const uint16_t data) {
-    getImage()[DATA_OFFSET + (sector * SECTOR_SIZE) + offset] = (data >> 8) & 0xFF;
-    getImage()[DATA_OFFSET + (sector * SECTOR_SIZE) + offset + 1] = data & 0xFF;
+    lisafsWriteFile(vol, filedata, rawFileSize, name, fileType);
+    free(filedata);
 }
 
-void writeSectorLong(const int sector, const int offset, const uint32_t data) {
-    getImage()[DATA_OFFSET + (sector * SECTOR_SIZE) + offset] = (data >> 24) & 0xFF;
-    getImage()[DATA_OFFSET + (sector * SECTOR_SIZE) + offset + 1] = (data >> 16) & 0xFF;
-    getImage()[DATA_OFFSET + (sector * SECTOR_SIZE) + offset + 2] = (data >> 8) & 0xFF;
-    getImage()[DATA_OFFSET + (sector * SECTOR_SIZE) + offset + 3] = data & 0xFF;
+void printFreeSpace() {
+    const lisafsFragmentation frag = lisafsMeasureFragmentation(vol);
+    printf("Free space: %d sectors in %d runs, largest run %d sectors\n", frag.freeSectors, frag.freeRuns, frag.largestFreeRun);
 }
 
-void zeroSector(const int sector) {
-    // "tomorrow I want you to take that sector to Anchorhead and have its memory erased. It belongs to us now"
-    for (int i = 0; i < SECTOR_SIZE; i++) {
-        writeSector(sector, i, 0x00);
+// hotList names one Lisa file name per line, hottest first
+bool defragment(const char *hotList) {
+    char **hotNames = NULL;
+    int hotCount = 0;
+    FILE *list = hotList != NULL ? fopen(hotList, "r") : NULL;
+    if (hotList != NULL && list == NULL) {
+        printf("Could not open hotness list %s, using catalog order\n", hotList);
     }
-}
-
-void findMDDFSec() {
-    for (int i = 0; i < SECTORS_IN_DISK; i++) {
-        bytes tag = readTag(i);
-        const uint16_t type = readInt(tag, 4);
-        free(tag);
-        if (type == MDDF_FILE_ID) {
-            MDDFSec = i;
-            printf("mddfsec: 0x%02X\n", MDDFSec);
-            return;
+    if (list != NULL) {
+        char line[256];
+        while (fgets(line, sizeof(line), list) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            hotNames = realloc(hotNames, (hotCount + 1) * sizeof(char *));
+            hotNames[hotCount++] = strdup(line);
         }
+        fclose(list);
     }
-}
-
-void findBitmapSec() {
-    bitmapSec = (int) readMDDFLong(MDDF_BITMAP_ADDR) + MDDFSec;
-}
-
-void findSFileSec() {
-    sFileSec = (int) readMDDFLong(MDDF_SLIST_ADDR) + MDDFSec;
-    sfileBlockCount = (int) readMDDFInt(MDDF_SLIST_BLOCK_COUNT);
-    printf("emptyfile: 0x%02X\n", readMDDFInt(MDDF_EMPTY_FILE));
-}
-
-void printSectorType(const int sector) {
-    bytes tag = readTag(sector);
-    const uint16_t type = readInt(tag, 4);
-    free(tag);
-    // thanks, Ray
-    if (type == BOOT_SEC_FILE_ID) {
-        printf("(boot sector)");
-    } else if (type == OS_LOADER_FILE_ID) {
-        printf("(OS loader)");
-    } else if (type == FREE_FILE_ID) {
-        printf(""); // free
-    } else if (type == MDDF_FILE_ID) {
-        printf("(MDDF)");
-    } else if (type == BITMAP_FILE_ID) {
-        printf("(free bitmap)");
-    } else if (type == SFILE_FILE_ID) {
-        printf("(s-file)");
-    } else if (type == CATALOG_FILE_ID) {
-        printf("(catalog)");
-    } else if (type == DELETED_FILE_ID) {
-        printf("<deleted>");
-    } else {
-        printf("file 0x%02X", type);
+    const bool ok = lisafsDefragment(vol, (const char **) hotNames, hotCount);
+    for (int i = 0; i < hotCount; i++) {
+        free(hotNames[i]);
     }
+    free(hotNames);
+    return ok;
 }
 
-uint8_t bitmapByte(const int sec) {
-    const int sectorToCorrect = (sec - MDDFSec);
-    const int freeBitmapSector = ((sectorToCorrect / 8) / SECTOR_SIZE) + bitmapSec; //8 sectors per byte
-    const int byteIndex = (sectorToCorrect / 8) % SECTOR_SIZE;
-    bytes s = readSector(freeBitmapSector);
-    const uint8_t previousByte = s[byteIndex];
-    free(s);
-    return previousByte;
-}
-
-bool isFreeSector(const int sector) {
-    return bitmapByte(sector) == 0x00; //TODO this is supremely cautious, for now. Fix this later
-}
-
-void decrementMDDFFreeCount() {
-    uint32_t freeCount = readMDDFLong(MDDF_FREECOUNT);
-    freeCount--;
-    writeSectorLong(MDDFSec, MDDF_FREECOUNT, freeCount);
-}
-
-void fixFreeBitmap(const int sec) {
-    const int sectorToCorrect = (sec - MDDFSec);
-    const int freeBitmapSector = ((sectorToCorrect / 8) / SECTOR_SIZE) + bitmapSec; //8 sectors per byte
-    const int byteIndex = (sectorToCorrect / 8) % SECTOR_SIZE;
-    const int baseSec = ((sectorToCorrect / 8) * 8) + MDDFSec;
-
-    const uint8_t oldByte = bitmapByte(sec);
-    const uint8_t byteToWrite = oldByte | (1 << (sec - baseSec)); //TODO check for off-by-1 errors here
-
-    bytes s = readSector(freeBitmapSector);
-    free(s);
-    writeSector(freeBitmapSector, byteIndex, byteToWrite & 0xFF);
-}
-
-/*
-AABBBBBB BBBBBBBB BBBBBB00 CCCCCCCC ???????? / ________ ________ ________ ____@@@@ @@@@____ ________ ____DDDD DDDD@@@@ @@@@EEEE EEEE____ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ________ ______## ________ ____!!!! __##____ / (0 until end of 0x200)
-0A7B7B7B 546F6D2E 4F626A00 2E4F626A 00180000 / 002E0BF8 002E0C00 000000CC 5ED4A24A 228C0100 00000015 0E009D27 FAC7A24A 22A29D27 FACB0000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 0C005407 54000C00 00000000 4E56FEFC 206E000C 00000001 00000000 00000000 00000000 00000000 0000000A 00090001 00001BF4 000A0000  00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000 00000000
-
-A = name length (bytes)
-B = name
-C = type (".Obj")
-D = creation date (aligns with catalog listing)
-E = modification date (aligns with catalog listing)
-_ = (standardized? Check more examples?)
-@ = ascending? Looks like a date, maybe?
-# = # of sectors (?)
-! = Sector offset to first sector of data (- MDDFSec)
-*/
-
-void writeHintEntry(const int sector, const int startSector, const int sectorCount, const int nameLength, const char *name) {
-    zeroSector(sector);
-    writeSector(sector, 0, nameLength); //name length
-    for (int i = 0; i < nameLength; i++) { //bytes we have to write
-        writeSector(sector, i + 1, name[i]);
-    }
-    writeSector(sector, nameLength + 1, 0x00); //padding
-    for (int i = 0; i < 4; i++) { //bytes we have to write
-        writeSector(sector, nameLength + i + 2, name[nameLength - (3 - i) - 1]);
-    }
-
-    writeSectorLong(sector, 34, 0xA24A228C); // date (?)
-    writeSectorLong(sector, 38, 0x01000000); // standardized (?)
-    writeSectorLong(sector, 42, 0x00150E00); // this may be the serial number of the Lisa, actually. http://www.applerepairmanuals.com/lisa/deserial/pg05.html
-    writeSectorLong(sector, 46, 0x9D27FAC7); // creation date (should match file)
-    writeSectorLong(sector, 50, 0xA24A22A2); // date (?)
-    writeSectorLong(sector, 54, 0x9D27FACB); // modification date (should match file)
-
-    writeSectorLong(sector, 100, 0x4E56FEFC); // standardized (?)
-    writeSectorLong(sector, 104, 0x206E000C); // standardized (?)
-    writeSectorLong(sector, 108, 0x00000001); // standardized (?)
-
-    writeSectorInt(sector, 130, sectorCount & 0xFF); // number of sectors
-    writeSectorLong(sector, 132, 0x00090001); // standardized (?)
-
-    writeSectorInt(sector, 138, startSector - MDDFSec); // offset to first sector of data (-MDDFSec)
-    writeSectorInt(sector, 140, sectorCount & 0xFF); // number of sectors, again (?)
-}
-
-void claimNextFreeHintSector(const int sec, const int startSector, const int sectorCount, const int nameLength, const char *name) {
-    //version
-    writeTagInt(sec, 0, 0x0000);
-
-    //volid (TODO 0x0100 seems standard for this type of record at least?)
-    writeTagInt(sec, 2, 0x0100);
-
-    //fileid (seems to decrement)
-    writeTagInt(sec, 4, --lastUsedHintIndex);
-
-    //dataused (0x8000 seems standard)
-    writeTagInt(sec, 6, 0x8000);
-
-    //abspage
-    writeTag3Byte(sec, 8, sec - MDDFSec);
-
-    //index 11 is a checksum we'll in later
-
-    //relpage (0x0000 always)
-    writeTagInt(sec, 12, 0x0000);
-
-    //fwdlink (0xFFFFFF always)
-    writeTag3Byte(sec, 14, 0xFFFFFF);
-
-    //bkwdlink (0xFFFFFF always)
-    writeTag3Byte(sec, 17, 0xFFFFFF);
-
-    writeHintEntry(sec, startSector, sectorCount, nameLength, name);
-
-    fixFreeBitmap(sec);
-
-    decrementMDDFFreeCount();
-}
-
-int getSectorCount(const int fileSize) {
-    return (int) ceil((double) fileSize / SECTOR_SIZE);
-}
-
-int findNextFreeSFileIndex() {
-    const uint16_t slist_packing = readMDDFInt(MDDF_SLIST_PACKING); //number of s_entries per block in slist
-    int lastIdx = readMDDFInt(MDDF_FIRST_FILE); //the minimum sfile we can use per the MDDF
-    uint16_t idx = 0;
-    for (int i = sFileSec; i < (sFileSec + sfileBlockCount); i++) {
-        bytes data = readSector(i);
-        for (int sfileIdx = 0; sfileIdx < slist_packing; sfileIdx++) {
-            const int srec = sfileIdx * SFILE_RECORD_LENGTH;
-            const uint32_t hintAddr = readLong(data, srec);
-            /*
-            printf("IDX = 0x%02X: ", idx);
-            printf("hintAddr = 0x%08X, ", hintAddr);
-            printf("fileAddr = 0x%08X, ", readLong(data, srec + 4));
-            printf("fileSize = 0x%08X, ", readLong(data, srec + 8));
-            printf("version = 0x%04X\n", readInt(data, srec + 12));
-            */
-            if (hintAddr != 0x00000000) { // claimed s-record
-                bytes hintTag = readTag((int) hintAddr + MDDFSec);
-                const uint16_t index = readInt(hintTag, 4);
-                free(hintTag);
-                if (index < lastUsedHintIndex && index != 0x0000) { //index is 0x0000 for the 4 reserved S-file entries at the start of the listing
-                    lastUsedHintIndex = index;
-                }
-                lastIdx = idx;
-            }
-            idx++;
-        }
-        free(data);
-    }
-
-    lastIdx++; //next one is free, then
-    return lastIdx;
-}
-
-//returns the index of the s-file (the file ID)
-uint16_t claimNextFreeSFileIndex(const int startSector, const int sectorCount, const int nameLength, const char *name) {
-    const int emptyFile = readMDDFInt(MDDF_EMPTY_FILE);
-
-    const int whereToStart = sFileSec + sfileBlockCount; // TODO start after this, roughly. Might need to be more stringent
-
-    const uint16_t slist_packing = readMDDFInt(MDDF_SLIST_PACKING); //number of s_entries per block in slist
-
-    //claim it and return it
-    const int sFileSectorToWrite = (emptyFile / slist_packing) + sFileSec;
-    const int indexWithinSectorToWrite = (emptyFile - ((sFileSectorToWrite - sFileSec) * slist_packing)) * SFILE_RECORD_LENGTH; //length of srecord
-    for (int s = whereToStart; s < SECTORS_IN_DISK; s++) {
-        if (isFreeSector(s)) {
-            //printf("Claiming new s-file at index=0x%04X, hint sector=0x%08X, fileAddr=0x%08X, fileSize=0x%08X\n", emptyFile, s, startSector, fileSize);
-            //TODO responsibleSector could overflow to the next one if we're unlucky. For now, don't worry about it.
-            writeSectorLong(sFileSectorToWrite, indexWithinSectorToWrite, s - MDDFSec); //location of our hint sector
-            writeSectorLong(sFileSectorToWrite, indexWithinSectorToWrite + 4, startSector - MDDFSec); // fileAddr
-            writeSectorLong(sFileSectorToWrite, indexWithinSectorToWrite + 8, sectorCount * SECTOR_SIZE); // fileSize TODO for now, use physical since it's likely safer
-            writeSectorInt(sFileSectorToWrite, indexWithinSectorToWrite + 12, 0x0000); //version
-
-            claimNextFreeHintSector(s, startSector, sectorCount, nameLength, name);
-
-            const int newEmptyFile = findNextFreeSFileIndex();
-            writeSectorInt(MDDFSec, MDDF_EMPTY_FILE, newEmptyFile);
-
-            return emptyFile;
-        }
+// trace names the sectors a boot read, in order, one per line (the last number on each line counts, decimal or
+// 0x hex, so emulator logs work as they are). '#' starts a comment.
+void optimizeForBoot(const char *traceFile) {
+    FILE *input = fopen(traceFile, "r");
+    if (input == NULL) {
+        printf("ERROR! Could not open %s\n", traceFile);
+        return;
     }
-
-    return -1; // no space
-}
-
-void printSFile() {
-    const uint16_t slist_packing = readMDDFInt(MDDF_SLIST_PACKING); //number of s_entries per block in slist
-    uint16_t idx = 0;
-    for (int i = sFileSec; i < (sFileSec + sfileBlockCount); i++) {
-        bytes data = readSector(i);
-        for (int sfileIdx = 0; sfileIdx < slist_packing; sfileIdx++) {
-            const int srec = sfileIdx * SFILE_RECORD_LENGTH; //length of srecord
-            const uint32_t hintAddr = readLong(data, srec);
-            printf("IDX = 0x%02X: ", idx);
-            printf("hintAddr = 0x%08X, ", hintAddr);
-            printf("fileAddr = 0x%08X, ", readLong(data, srec + 4));
-            printf("fileSize = 0x%08X, ", readLong(data, srec + 8));
-            printf("version = 0x%04X\n", readInt(data, srec + 12));
-            idx++;
+    int *trace = NULL;
+    int traceLength = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), input) != NULL) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        char *last = NULL;
+        for (char *token = strtok(line, " \t,:"); token != NULL; token = strtok(NULL, " \t,:")) {
+            last = token;
         }
-        free(data);
-    }
-}
-
-uint8_t calculateChecksum(const int sector) {
-    uint8_t checksumByte = 0x00;
-    bytes data = readSector(sector);
-    for (int i = 0; i < SECTOR_SIZE; i++) {
-        checksumByte = checksumByte ^ (data[i] & 0xFF);
-    }
-    free(data);
-
-    bytes tag = readTag(sector);
-    for (int i = 0; i < TAG_SIZE; i++) {
-        if (i != 11) { //the checksum byte isn't included
-            checksumByte = checksumByte ^ (tag[i] & 0xFF);
+        if (last != NULL) {
+            trace = realloc(trace, (traceLength + 1) * sizeof(int));
+            trace[traceLength++] = (int) strtol(last, NULL, 0);
         }
     }
-    free(tag);
+    fclose(input);
 
-    return checksumByte;
-}
-
-void findNonLeafCatalogSec() {
-    // for the first moved entry, fix the non-leaf
-    nonLeafCatalogSec = -1;
-    for (int d = 0; d < SECTORS_IN_DISK; d++) {
-        //in all the possible catalogSectors. They come in 4s, always
-        bytes tag = readTag(d);
-        const uint16_t fileId = readInt(tag, 4);
-        free(tag);
-        if (fileId != CATALOG_FILE_ID) {
+    // which files the boot touched, in the order it first touched them
+    lisafsEntry *entries;
+    const int entryCount = lisafsList(vol, &entries);
+    int *touches = calloc(0x10000, sizeof(int));
+    printf("Files read during boot, in the order they were first read:\n");
+    for (int t = 0; t < traceLength; t++) {
+        const uint16_t owner = lisafsSectorOwner(vol, trace[t]);
+        if (touches[owner]++ > 0) {
             continue;
         }
-        bytes nonleaf = read4Sectors(d);
-        if (nonleaf[0] == 0x24 && nonleaf[1] == 0x00 && nonleaf[2] == 0x00) {
-            free(nonleaf);
-            d += 3;
-            continue; //leaf
-        }
-        nonLeafCatalogSec = d;
-        return;
-    }
-}
-
-// returns the first sector of the 4
-int claimNextFreeCatalogBlock() {
-    for (int i = CATALOG_SEC_OFFSET; i < SECTORS_IN_DISK; i += 4) { //let's start looking after where the directories tend to begin
-        if (isFreeSector(i) && isFreeSector(i + 1) && isFreeSector(i + 2) && isFreeSector(i + 3)) {
-            for (int j = 0; j < 4; j++) {
-                //version
-                writeTagInt(i + j, 0, 0x0000);
-
-                //volid (TODO 0x2500 is used sometimes for this disk at least?)
-                writeTagInt(i + j, 2, 0x0000);
-
-                //fileid (always 0x0004 for catalog sectors)
-                writeTagInt(i + j, 4, 0x0004);
-
-                //dataused (0x8200 seems standard)
-                writeTagInt(i + j, 6, 0x8200);
-
-                //abspage
-                const int abspage = (i + j) - MDDFSec; //account for magic offset
-                writeTag3Byte(i + j, 8, abspage);
-
-                //index 11 is a checksum we'll fill in later
-
-                //relpage
-                writeTag(i + j, 12, 0x00);
-                writeTag(i + j, 13, j);
-
-                //fwdlink
-                if (j == 3) {
-                    writeTag3Byte(i + j, 14, 0xFFFFFF);
-                } else {
-                    const int fwdlink = abspage + 1;
-                    writeTag3Byte(i + j, 14, fwdlink);
-                }
-
-                //bkwdlink
-                if (j == 0) {
-                    writeTag3Byte(i + j, 17, 0xFFFFFF);
-                } else {
-                    const int bkwdlink = abspage - 1;
-                    writeTag3Byte(i + j, 17, bkwdlink);
-                }
-            }
-            // "tomorrow I want you to take those sectors to Anchorhead and have their memory erased. They belong to us now"
-            zeroSector(i);
-            zeroSector(i + 1);
-            zeroSector(i + 2);
-            zeroSector(i + 3);
-            // inscribe the ancient sigil 0x240000 into the start of the first sector to label it as a catalog sector
-            writeSector(i, 0, 0x24);
-            writeSector(i, 1, 0x00);
-            writeSector(i, 2, 0x00);
-
-            writeSector(i, SECTOR_SIZE - 11, 0x00); //0 valid entries here.
-
-            for (int j = 0; j < 32; j++) { //let's try 32
-                writeSectorInt(i+3, SECTOR_SIZE - 14 - (j * 2), j * CATALOG_RECORD_LENGTH); // set up the special index entries (not sure of the actual name)
+        for (int e = 0; e < entryCount; e++) {
+            if (entries[e].sfileid == owner) {
+                printf("  access %d: %s (s-file 0x%04X)\n", t, entries[e].name, owner);
             }
-
-            writeSectorLong(i + 3, SECTOR_SIZE - 10, 0xFFFFFFFF); //10-9-8-7
-            writeSectorLong(i + 3, SECTOR_SIZE - 6, 0xFFFFFFFF); //6-5-4-3
-
-            writeSectorInt(i + 3, SECTOR_SIZE - 2, 0x00FF); //2-1 standard
-
-            fixFreeBitmap(i);
-            fixFreeBitmap(i + 1);
-            fixFreeBitmap(i + 2);
-            fixFreeBitmap(i + 3);
-
-            decrementMDDFFreeCount();
-            decrementMDDFFreeCount();
-            decrementMDDFFreeCount();
-            decrementMDDFFreeCount();
-
-            return i;
         }
     }
-    return -1;
-}
-
-// Returns true if a < b, false otherwise (case insensitive)
-bool ci_a_before_b(const char *a, const int a_len, const char *b, const int b_len) {
-    int i = 0;
-    const int min_len = (a_len < b_len) ? a_len : b_len;
-
-    for (i = 0; i < min_len; i++) {
-        const int ac = toupper((unsigned char) a[i]);
-        const int bc = toupper((unsigned char) b[i]);
-        if (ac != bc) {
-            return ac < bc;
+    for (int e = 0; e < entryCount; e++) {
+        if (touches[entries[e].sfileid] > 0) {
+            printf("  %s: %d sector reads\n", entries[e].name, touches[entries[e].sfileid]);
         }
     }
+    free(touches);
+    free(entries);
 
-    // If equal so far, decide based on length
-    return a_len < b_len;
-}
-
-void incrementMDDFFileCount() {
-    uint16_t fileCount = readMDDFInt(MDDF_FILECOUNT);
-    fileCount++;
-    writeSectorInt(MDDFSec, MDDF_FILECOUNT, fileCount);
+    const lisafsTraceReport report = lisafsOptimizeForTrace(vol, trace, traceLength);
+    free(trace);
+    printf("Trace: %d reads, %d of them file data, %d files moved to the front\n", report.accesses, report.fileAccesses, report.hotFiles);
+    printf("Seeks: %d before, %d after; distance: %lld sectors before, %lld after", report.seeksBefore, report.seeksAfter, report.distanceBefore, report.distanceAfter);
+    if (report.distanceBefore > 0) {
+        printf(" (%.1f%% less)", 100.0 * (double) (report.distanceBefore - report.distanceAfter) / (double) report.distanceBefore);
+    }
+    printf("\n");
 }
 
-void writeCatalogEntry(const int offset, const int nextFreeSFileIndex, const int fileSize, const int sectorCount, const int nameLength, const char *name) {
-    const int physicalSize = sectorCount * SECTOR_SIZE;
+// ---------- Importing ----------
 
-    assert(image != NULL);
+// One member of a tar or cpio stream, read into memory
+typedef struct {
+    char name[256];
+    char type[16]; // from a LISA.type pax record, if there was one
+    bytes data;
+    size_t length;
+    bool regular;
+} member;
 
-    image[offset] = 0x24;
-
-    // write name
-    // 35 bytes total, padded with 0x00
-    image[offset + 1] = 0x00;
-    image[offset + 2] = 0x00;
-    int idx = 3;
-    for (int i = 0; i < nameLength; i++) {
-        image[offset + idx] = name[i];
-        idx++;
-    }
-    while (idx < 36) {
-        image[offset + idx] = 0x00;
-        idx++;
-    }
+enum memberResult {
+    MEMBER_READ,
+    MEMBER_END, // a zero block or the cpio trailer
+    MEMBER_ERROR // a broken or truncated stream, already reported
+};
 
-    const uint8_t restOfEntry[] = {
-        0x03, 0x06, //we're a file (lisa says 0x0306)
-        (nextFreeSFileIndex >> 8) & 0xFF, nextFreeSFileIndex & 0xFF, //sfile
-        0x9D, 0x27, 0xFA, 0x88, //creation date (this one is random, but I know it works)
-        0x9D, 0x27, 0xFA, 0x8F, //modification date (this one is random, but I know it works)
-        (fileSize >> 24) & 0xFF, (fileSize >> 16) & 0xFF, (fileSize >> 8) & 0xFF, fileSize & 0xFF, //file size
-        (physicalSize >> 24) & 0xFF, (physicalSize >> 16) & 0xFF, (physicalSize >> 8) & 0xFF, physicalSize & 0xFF, //physical file size (plus extra to fit sector bounds)
-        0x00, 0x01, //fsOvrhd (? - I know this one works so let's just use it for now),
-        0x00, 0xF7, //flags (lisa says 0x00F7)
-        0xCE, 0x06, 0x00, 0x00 //fileUnused (lisa says 0xCE060000)
-    };
-    // write the rest
-    for (int i = 0; i < (CATALOG_RECORD_LENGTH - 36); i++) {
-        image[offset + idx] = restOfEntry[i];
-        idx++;
-    }
-    incrementMDDFFileCount();
+static uint64_t parseNumber(const char *field, const int width, const int base) {
+    char text[32];
+    memcpy(text, field, width);
+    text[width] = '\0';
+    return strtoull(text, NULL, base);
 }
 
-uint8_t getCatalogEntryCountForBlock(const int dirSec) {
-    bytes sec = readSector(dirSec + 3);
-    const uint8_t count = sec[SECTOR_SIZE - 11];
-    free(sec);
-    return count;
+static bool readExactly(FILE *in, void *buffer, const size_t length) {
+    return length == 0 || fread(buffer, 1, length, in) == length;
 }
 
-void claimNewCatalogEntrySpace(const int dirSec, const int entryOffset, const int sfileid, const int fileSize, const int sectorCount, const int nameLength, const char *name) {
-    const int entry = getCatalogEntryCountForBlock(dirSec) + 1;
-    writeSector(dirSec + 3, SECTOR_SIZE - 11, entry); //claim another valid entry in this sector
-    writeCatalogEntry(DATA_OFFSET + (dirSec * SECTOR_SIZE) + entryOffset, sfileid, fileSize, sectorCount, nameLength, name);
+static bool skipBytes(FILE *in, size_t length) {
+    uint8_t scratch[4096];
+    while (length > 0) {
+        const size_t take = length < sizeof(scratch) ? length : sizeof(scratch);
+        if (!readExactly(in, scratch, take)) {
+            return false;
+        }
+        length -= take;
+    }
+    return true;
 }
 
-// given a filename, return the beginning sector number of the relevant catalog block.
-// - if contained by an existing block, return that block regardless if it has space or not
-// - if not contained by an existing block, return the block that ends closest (alphanumerically) to the filename, regardless if it has space or not
-int findRelevantCatalogSector(const int nameLength, const char *name) {
-    int closestDirSec = -1;
-    char *closestDirName = NULL;
-    const int first = (int) readMDDFLong(MDDF_ROOT_PAGE);
-    int dirSec = first;
-    while (dirSec != -1) {
-        bytes dirBlock = read4Sectors(dirSec);
-        int offsetToFirstEntry = 0;
-        if (dirSec == first) {
-            closestDirSec = dirSec; // if we're the first entry, we'll need somewhere to go
-            offsetToFirstEntry = 0x4E; //seems to be the case for the first catalog sector block only
+// pax records are "<length> <key>=<value>\n"; the path and our own LISA.type are the only ones that matter here.
+// Returns false if the path is too long to keep.
+static bool parsePax(const uint8_t *data, const size_t length, member *next) {
+    size_t at = 0;
+    while (at < length) {
+        char *end;
+        const unsigned long recordLength = strtoul((const char *) data + at, &end, 10);
+        if (recordLength == 0 || at + recordLength > length || *end != ' ') {
+            return true;
         }
-
-        const uint8_t validEntryCount = getCatalogEntryCountForBlock(dirSec);
-        const int firstEntryOffset = offsetToFirstEntry;
-        const int lastEntryOffset = offsetToFirstEntry + ((validEntryCount - 1) * CATALOG_RECORD_LENGTH);
-
-        const bool nameBeforeFirst = ci_a_before_b(name, nameLength, (char *) dirBlock + firstEntryOffset + 3, 32);
-        const bool nameBeforeLast = ci_a_before_b(name, nameLength, (char *) dirBlock + lastEntryOffset + 3, 32);
-
-        if (!nameBeforeFirst && nameBeforeLast) {
-            free(dirBlock);
-            if (closestDirName != NULL) {
-                free(closestDirName);
+        const char *key = end + 1;
+        const char *equals = memchr(key, '=', (const char *) data + at + recordLength - key);
+        if (equals != NULL) {
+            const int valueLength = (int) ((const char *) data + at + recordLength - 1 - (equals + 1));
+            if (strncmp(key, "path=", 5) == 0) {
+                if (valueLength >= (int) sizeof(next->name)) {
+                    return false;
+                }
+                snprintf(next->name, sizeof(next->name), "%.*s", valueLength, equals + 1);
+            } else if (strncmp(key, "LISA.type=", 10) == 0) {
+                snprintf(next->type, sizeof(next->type), "%.*s", valueLength, equals + 1);
             }
-            printf("Contained in a block!\n");
-            return dirSec; // this block contains us
         }
-
-        if (!nameBeforeLast) { //if this block ends before us
-            if (closestDirName == NULL) { //the first time
-                closestDirName = (char *) malloc(32 * sizeof(char));
-                for (int i = 0; i < 32; i++) {
-                    closestDirName[i] = (char) dirBlock[lastEntryOffset + 3 + i];
-                }
-                closestDirSec = dirSec;
-            } else {
-                // compare the endings to see who's closer. Keep a running count
-                const bool lastAfterRunningClosest = ci_a_before_b(closestDirName, 32, (char *) dirBlock + lastEntryOffset + 3, 32);
-                if (lastAfterRunningClosest) {
-                    for (int i = 0; i < 32; i++) {
-                        closestDirName[i] = (char) dirBlock[lastEntryOffset + 3 + i];
-                    }
-                    closestDirSec = dirSec;
-                    printf("closestDirSec now = %d\n", closestDirSec);
-                }
+        at += recordLength;
+    }
+    return true;
+}
+
+// The next member of a ustar (or pax, or GNU long name) stream. A clean end of input where a header would start is
+// taken as the end, like tar does.
+static enum memberResult readTarMember(FILE *in, uint8_t *header, bool haveHeader, member *out) {
+    memset(out, 0, sizeof(*out));
+    bool extended = false; // an extended header was read, so a member has to follow
+    while (true) {
+        if (!haveHeader) {
+            const size_t got = fread(header, 1, 512, in);
+            if (got == 0 && !extended) {
+                return MEMBER_END;
+            } else if (got != 512) {
+                printf("ERROR! The tar stream ends in the middle of a header\n");
+                return MEMBER_ERROR;
             }
         }
-
-        free(dirBlock);
-
-        bytes sec = readSector(dirSec + 3);
-        const uint32_t next = readLong(sec, SECTOR_SIZE - 6);
-        free(sec);
-        if (next == 0xFFFFFFFF) {
-            dirSec = -1;
-        } else {
-            dirSec = (int) next + MDDFSec;
+        haveHeader = false;
+        unsigned int checksum = 0;
+        bool zero = true;
+        for (int i = 0; i < 512; i++) {
+            checksum += (i >= 148 && i < 156) ? ' ' : header[i];
+            zero = zero && header[i] == 0;
         }
-    }
-
-    if (closestDirName != NULL) {
-        free(closestDirName);
-    }
-    printf("Not contained in any sector\n");
-    return closestDirSec; // we weren't contained in any, so return the closest one
-}
-
-int getEntryToMove(bytes dirBlock, const int offsetToFirstEntry, const int entryCount, const char *name, const int nameLength, const int recordLength, const int nameOffset) {
-    for (int e = 0; e < entryCount; e++) {
-        const int entryOffset = offsetToFirstEntry + (e * recordLength);
-        const bool nameBeforeExistingEntry = ci_a_before_b(name, nameLength, (char *) dirBlock + entryOffset + nameOffset, 32);
-        if (nameBeforeExistingEntry) {
-            return e;
+        if (zero) {
+            return MEMBER_END; // the end of the archive
         }
-    }
-    return entryCount;
-}
-
-void claimNewCatalogEntry(const uint16_t sfileid, const int fileSize, const int sectorCount, const int nameLength, char *name) {
-    const int firstCatalogSector = (int) readMDDFLong(MDDF_ROOT_PAGE);
-    const int relevantCatalogSec = findRelevantCatalogSector(nameLength, name);
-    uint8_t entryCount = getCatalogEntryCountForBlock(relevantCatalogSec);
-    printf("The relevant catalog sec is: 0x%02X and the count is 0x%02X, and the variable is 0x%02X\n", relevantCatalogSec, getCatalogEntryCountForBlock(relevantCatalogSec), entryCount);
-    int offsetToFirstEntry = 0;
-    const bool catalogFull = (entryCount == 0x1E);
-    if (relevantCatalogSec == firstCatalogSector) { //TODO this is a hack to handle the fact there's a directory in the first catalog block.
-        offsetToFirstEntry = 0x4E;
-        entryCount--;
-    }
-    bytes dirBlock = read4Sectors(relevantCatalogSec);
-    const int entryToMove = getEntryToMove(dirBlock, offsetToFirstEntry, entryCount, name, nameLength, CATALOG_RECORD_LENGTH, 3);
-
-    if (!catalogFull) { // if there's space to add the new entry to this block
-        if (entryToMove != -1) { // if we fit in the middle
-            const int entryOffset = offsetToFirstEntry + (entryToMove * CATALOG_RECORD_LENGTH);
-            const int catalogEntryOffset = DATA_OFFSET + (relevantCatalogSec * SECTOR_SIZE) + entryOffset; //offset to the place to write in the file
-            printf("Found space for a new catalog entry (shifting) at offset 0x%X\n", catalogEntryOffset);
-            //shift
-            for (int rest = entryToMove; rest < entryCount; rest++) {
-                const int originalOffsetOfEntryWithinBlock = offsetToFirstEntry + (rest * CATALOG_RECORD_LENGTH);
-                const int destinationOffsetOfEntryWithinBlock = originalOffsetOfEntryWithinBlock + CATALOG_RECORD_LENGTH;
-                for (int eIdx = 0; eIdx < CATALOG_RECORD_LENGTH; eIdx++) {
-                    const int off = originalOffsetOfEntryWithinBlock + eIdx;
-                    getImage()[DATA_OFFSET + (SECTOR_SIZE * relevantCatalogSec) + destinationOffsetOfEntryWithinBlock + eIdx] = dirBlock[off];
-                }
-            }
-
-            claimNewCatalogEntrySpace(relevantCatalogSec, entryOffset, sfileid, fileSize, sectorCount, nameLength, name);
-            free(dirBlock);
-            return;
+        if (checksum != parseNumber((const char *) header + 148, 8, 8)) {
+            printf("ERROR! Bad tar header checksum\n");
+            return MEMBER_ERROR;
         }
-        //if we have space at the end
-        printf("We fit at the end.\n");
-        const int entryOffset = offsetToFirstEntry + (CATALOG_RECORD_LENGTH * entryCount);
-        printf("Found space for a new catalog entry (appending) at offset 0x%X\n", entryOffset);
-        claimNewCatalogEntrySpace(relevantCatalogSec, entryOffset, sfileid, fileSize, sectorCount, nameLength, name);
-        free(dirBlock);
-    } else {
-        //no space found, so let's make some
-        printf("No space found for a new entry (entryCount = 0x%02X). Creating some...\n", entryCount);
-        const int nextFreeBlock = claimNextFreeCatalogBlock();
-        printf("Space to create new catalog block claimed at sector = %d\n", nextFreeBlock);
-        printf("Entry index to move from old block is: 0x%02X\n", entryToMove);
-        int movedEntries = 0;
-        bool first = true;
-        char *firstname = malloc(36 * sizeof(char));
-        for (int e = (3 * entryCount) / 4; e < entryCount; e++) { // move 3/4 to the new block
-            const int entryOffsetInSource = offsetToFirstEntry + (e * CATALOG_RECORD_LENGTH);
-            const int entryOffsetInDestination = (movedEntries * CATALOG_RECORD_LENGTH);
-            if (first) {
-                first = false;
-                for (int i = 0; i < 36; i++) {
-                    firstname[i] = (char) getImage()[DATA_OFFSET + (relevantCatalogSec * SECTOR_SIZE) + entryOffsetInSource + 3 + i];
-                }
+        const size_t length = (size_t) parseNumber((const char *) header + 124, 12, 8);
+        const size_t padded = (length + 511) / 512 * 512;
+        const char type = (char) header[156];
+        if (type == 'x' || type == 'L') { // extended header or GNU long name, for the member after it
+            bytes data = malloc(padded + 1);
+            if (!readExactly(in, data, padded)) {
+                free(data);
+                printf("ERROR! The tar stream ends in the middle of an extended header\n");
+                return MEMBER_ERROR;
             }
-            for (int j = 0; j < CATALOG_RECORD_LENGTH; j++) {
-                getImage()[DATA_OFFSET + (nextFreeBlock * SECTOR_SIZE) + entryOffsetInDestination + j] = getImage()[DATA_OFFSET + (relevantCatalogSec * SECTOR_SIZE) + entryOffsetInSource + j];
+            data[length] = '\0';
+            const bool fits = type == 'x' ? parsePax(data, length, out) : strlen((const char *) data) < sizeof(out->name);
+            if (fits && type == 'L') {
+                snprintf(out->name, sizeof(out->name), "%s", (const char *) data);
             }
-            movedEntries++;
-        }
-
-        // for the first moved entry, fix the non-leaf
-        bytes nonleaf = read4Sectors(nonLeafCatalogSec);
-        const int nonLeafEntryCount = getImage()[DATA_OFFSET + (SECTOR_SIZE * (nonLeafCatalogSec + 3 + 1)) - 11];
-        const int nonLeafEntryToMove = getEntryToMove(nonleaf, 0, nonLeafEntryCount, firstname, 32, CATALOG_NONLEAF_RECORD_LENGTH, 7);
-
-        for (int rest = nonLeafEntryToMove; rest < nonLeafEntryCount; rest++) {
-            printf("Moving entry at index = %d: ", rest);
-            const int originalOffsetOfNonLeafEntryWithinBlock = (rest * CATALOG_NONLEAF_RECORD_LENGTH);
-            const int destinationOffsetOfNonLeafEntryWithinBlock = originalOffsetOfNonLeafEntryWithinBlock + CATALOG_NONLEAF_RECORD_LENGTH;
-            for (int eIdx = 0; eIdx < CATALOG_NONLEAF_RECORD_LENGTH; eIdx++) {
-                const int off = originalOffsetOfNonLeafEntryWithinBlock + eIdx;
-                getImage()[DATA_OFFSET + (SECTOR_SIZE * nonLeafCatalogSec) + destinationOffsetOfNonLeafEntryWithinBlock + eIdx] = nonleaf[off];
+            free(data);
+            if (!fits) {
+                printf("ERROR! A tar member name is longer than %d bytes\n", (int) sizeof(out->name) - 1);
+                return MEMBER_ERROR;
             }
+            extended = true;
+            continue;
         }
-
-        const int os = nonLeafEntryToMove * CATALOG_NONLEAF_RECORD_LENGTH;
-        printf("Writing new nonleaf entry to offset = 0x%02X\n", DATA_OFFSET + (SECTOR_SIZE * nonLeafCatalogSec) + os);
-        const uint32_t newBk = (uint32_t) (nextFreeBlock - MDDFSec);
-        getImage()[DATA_OFFSET + (SECTOR_SIZE * nonLeafCatalogSec) + os] = (newBk >> 24) & 0xFF;
-        getImage()[DATA_OFFSET + (SECTOR_SIZE * nonLeafCatalogSec) + os + 1] = (newBk >> 16) & 0xFF;
-        getImage()[DATA_OFFSET + (SECTOR_SIZE * nonLeafCatalogSec) + os + 2] = (newBk >> 8) & 0xFF;
-        getImage()[DATA_OFFSET + (SECTOR_SIZE * nonLeafCatalogSec) + os + 3] = newBk & 0xFF;
-
-        getImage()[DATA_OFFSET + (SECTOR_SIZE * nonLeafCatalogSec) + os + 4] = 0x24;
-        getImage()[DATA_OFFSET + (SECTOR_SIZE * nonLeafCatalogSec) + os + 5] = 0x00;
-        getImage()[DATA_OFFSET + (SECTOR_SIZE * nonLeafCatalogSec) + os + 6] = 0x00;
-        for (int kk = 0; kk < 32; kk++) {
-            getImage()[DATA_OFFSET + (SECTOR_SIZE * nonLeafCatalogSec) + os + 7 + kk] = firstname[kk];
-        }
-        getImage()[DATA_OFFSET + (SECTOR_SIZE * (nonLeafCatalogSec + 3 + 1)) - 11] = nonLeafEntryCount + 1; //increment entry count
-        free(nonleaf);
-        free(firstname);
-
-        // fix valid counts
-        writeSector(relevantCatalogSec + 3, SECTOR_SIZE - 11, getCatalogEntryCountForBlock(relevantCatalogSec) - movedEntries);
-        writeSector(nextFreeBlock + 3, SECTOR_SIZE - 11, movedEntries);
-
-        bytes srcSec = readSector(relevantCatalogSec + 3);
-        const uint32_t forward = readLong(readSector(relevantCatalogSec + 3), SECTOR_SIZE - 6);
-        free(srcSec);
-
-        // fix linked list of blocks
-        writeSectorLong(relevantCatalogSec + 3, SECTOR_SIZE - 6, (uint32_t) (nextFreeBlock - MDDFSec));
-        writeSectorLong((int) forward + MDDFSec + 3, SECTOR_SIZE - 10, (uint32_t) (nextFreeBlock - MDDFSec));
-
-        writeSectorLong(nextFreeBlock + 3, SECTOR_SIZE - 10, (uint32_t) (relevantCatalogSec - MDDFSec));
-        writeSectorLong(nextFreeBlock + 3, SECTOR_SIZE - 6, forward);
-
-        // recursively re-call this because we have more space now
-        claimNewCatalogEntry(sfileid, fileSize, sectorCount, nameLength, name);
-    }
-}
-
-void fixAllTagChecksums() {
-    for (int i = 0; i < SECTORS_IN_DISK; i++) {
-        bytes tag = readTag(i);
-        const uint8_t checksum = calculateChecksum(i);
-        if ((checksum & 0xFF) != (tag[11] & 0xFF)) {
-            writeTag(i, 11, (checksum & 0xFF));
+        if (out->name[0] == '\0') {
+            const char *prefix = (const char *) header + 345;
+            snprintf(out->name, sizeof(out->name), "%.*s%s%.*s", (int) strnlen(prefix, 155), prefix, prefix[0] != '\0' ? "/" : "",
+                     (int) strnlen((const char *) header, 100), (const char *) header);
         }
-        free(tag);
-    }
-}
-
-void writeFileTagBytes(const int startSector, const int sectorCount, const uint16_t sfileid) {
-    for (int i = 0; i < sectorCount; i++) {
-        const int sectorToWrite = startSector + i;
-        const uint32_t abspage = sectorToWrite - MDDFSec;
-        writeTagInt(sectorToWrite, 0, 0x0000); //version (2 bytes)
-        writeTagInt(sectorToWrite, 2, 0x0000); //vol (2 bytes)
-        writeTagInt(sectorToWrite, 4, sfileid); //file ID (2 bytes)
-        writeTagInt(sectorToWrite, 6, 0x8200); //dataused. 2 bytes. 0x8200, standard, it seems
-        writeTag3Byte(sectorToWrite, 8, abspage);
-        // index 11 is checksum (1 byte - will be fixed later)
-        writeTagInt(sectorToWrite, 12, i); // relpage (2 bytes)
-        if (i == (sectorCount - 1)) {
-            writeTag3Byte(sectorToWrite, 14, 0xFFFFFF); // fwdlink (3 bytes. 0xFFFFFF says none)
+        out->regular = type == '0' || type == '\0';
+        bool ok;
+        if (out->regular) {
+            out->data = malloc(padded > 0 ? padded : 1);
+            ok = readExactly(in, out->data, padded);
         } else {
-            writeTag3Byte(sectorToWrite, 14, abspage + 1); // fwdlink (3 bytes. 0xFFFFFF says none)
+            ok = skipBytes(in, padded);
         }
-        if (i == 0) {
-            writeTag3Byte(sectorToWrite, 17, 0xFFFFFF); // bkwdlink (3 bytes. 0xFFFFFF says none)
-        } else {
-            writeTag3Byte(sectorToWrite, 17, abspage - 1); // bkwdlink (3 bytes. 0xFFFFFF says none)
+        if (!ok) {
+            printf("ERROR! The tar stream ends in the middle of %s\n", out->name);
+            free(out->data);
+            out->data = NULL;
+            return MEMBER_ERROR;
         }
-        fixFreeBitmap(sectorToWrite);
-        decrementMDDFFreeCount();
-    }
-}
-
-int findStartingSector(const int contiguousSectors) {
-    for (int i = SECTORS_IN_DISK - contiguousSectors - 0x400; i > MDDFSec + 0x400; i--) { //TODO let's start a bit in to be safe. Also start at the end to avoid clobbering by Lisa
-        bool free = true;
-        for (int j = 0; j < contiguousSectors; j++) {
-            if (!isFreeSector(i + j)) {
-                free = false;
-                break;
-            }
-        }
-        if (free) {
-            return i;
+        out->length = out->regular ? length : 0;
+        return MEMBER_READ;
+    }
+}
+
+// The next member of a cpio "newc" stream: a 110 byte header of hex fields, the name, then the data, each padded to 4
+static enum memberResult readCpioMember(FILE *in, uint8_t *header, bool haveHeader, member *out) {
+    memset(out, 0, sizeof(*out));
+    if (!haveHeader && !readExactly(in, header, 6)) {
+        printf("ERROR! The cpio stream ends before its trailer\n");
+        return MEMBER_ERROR;
+    }
+    if (memcmp(header, "070701", 6) != 0 && memcmp(header, "070702", 6) != 0) {
+        printf("ERROR! Bad cpio header\n");
+        return MEMBER_ERROR;
+    }
+    if (!readExactly(in, header + 6, 104)) {
+        printf("ERROR! The cpio stream ends in the middle of a header\n");
+        return MEMBER_ERROR;
+    }
+    const uint32_t mode = (uint32_t) parseNumber((const char *) header + 14, 8, 16);
+    const size_t length = (size_t) parseNumber((const char *) header + 54, 8, 16);
+    const size_t nameSize = (size_t) parseNumber((const char *) header + 94, 8, 16);
+    char name[256];
+    if (nameSize == 0 || nameSize > sizeof(name)) {
+        printf("ERROR! A cpio member name is empty or longer than %d bytes\n", (int) sizeof(name) - 1);
+        return MEMBER_ERROR;
+    }
+    if (!readExactly(in, name, nameSize) || !skipBytes(in, (4 - ((110 + nameSize) % 4)) % 4)) {
+        printf("ERROR! The cpio stream ends in the middle of a name\n");
+        return MEMBER_ERROR;
+    }
+    name[nameSize - 1] = '\0';
+    if (strcmp(name, "TRAILER!!!") == 0) {
+        return MEMBER_END;
+    }
+    snprintf(out->name, sizeof(out->name), "%s", name);
+    out->regular = (mode & 0170000) == 0100000;
+    const size_t padding = (4 - (length % 4)) % 4;
+    bool ok;
+    if (out->regular) {
+        out->data = malloc(length > 0 ? length : 1);
+        ok = readExactly(in, out->data, length) && skipBytes(in, padding);
+    } else {
+        ok = skipBytes(in, length + padding);
+    }
+    if (!ok) {
+        printf("ERROR! The cpio stream ends in the middle of %s\n", out->name);
+        free(out->data);
+        out->data = NULL;
+        return MEMBER_ERROR;
+    }
+    out->length = out->regular ? length : 0;
+    return MEMBER_READ;
+}
+
+// .text files are text, Pascal if they match one of the patterns; everything else is data. A LISA.type pax record
+// wins over both. Text that already starts with the 1KB header of zeros (as `./read tar` writes it) is already in
+// Lisa form, so it goes in as it is.
+static enum filetype memberType(const member *m, const char *name, char **pascalPatterns, const int patternCount) {
+    if (strcmp(m->type, "pascal") == 0) {
+        return PASCAL;
+    } else if (strcmp(m->type, "text") == 0) {
+        return NONPASCAL;
+    } else if (strcmp(m->type, "data") == 0) {
+        return DATA;
+    }
+    const size_t nameLength = strlen(name);
+    if (nameLength < 5 || strcasecmp(name + nameLength - 5, ".text") != 0) {
+        return DATA;
+    }
+    bool encoded = m->length >= 1024 && m->length % 1024 == 0;
+    for (size_t i = 0; i < 1024 && encoded; i++) {
+        encoded = m->data[i] == 0x00;
+    }
+    if (encoded) {
+        return DATA;
+    }
+    for (int p = 0; p < patternCount; p++) {
+        if (fnmatch(pascalPatterns[p], name, FNM_CASEFOLD) == 0) {
+            return PASCAL;
         }
     }
-    return -1; // not found
-}
-
-void writeFile(const char *srcFileName, char *name, enum filetype fileType) {
-    const int nameLength = (int) strlen(name);
-    printf("_________________ Writing file: ");
-    for (int i = 0; i < nameLength; i++) {
-        printf("%c", name[i]);
-    }
-    printf(" ________________\n");
-    char fullpath[256];
-    fullpath[0] = '\0';
-    strcat(fullpath, "toinsert/");
-    strcat(fullpath, srcFileName);
-    FILE *fileptr = fopen(fullpath, "rb"); // Open the file in binary mode
-    fseek(fileptr, 0, SEEK_END);
-    const int rawFileSize = (int) ftell(fileptr);
-    fseek(fileptr, 0, SEEK_SET);
-    bytes filedata = malloc(rawFileSize); // Enough memory for the file
-    fread(filedata, rawFileSize, 1, fileptr); // Read in the entire file
-    fclose(fileptr); // Close the file
-
-    const int BLOCK_SIZE = SECTOR_SIZE * 2;
-
-    // write the data to a buffer
-    bytes dataBuf = malloc(rawFileSize * 100); // Enough memory for the file with lots of leeway
-    int bytesWritten = 0;
-    if (fileType == PASCAL || fileType == NONPASCAL) {
-        for (int i = 0; i < BLOCK_SIZE; i++) { //1KB of header on text files
-            dataBuf[bytesWritten++] = 0x00;
+    return NONPASCAL;
+}
+
+// Reads a whole tar or cpio stream, then writes every regular file in it as one batch. Member paths are the Lisa
+// names, less any leading ./ or /. *imported gets how many files were written, 0 if the stream was broken.
+int importStream(FILE *in, char **pascalPatterns, const int patternCount, int *imported) {
+    *imported = 0;
+    uint8_t header[512];
+    if (!readExactly(in, header, 6)) {
+        printf("ERROR! Nothing to import\n");
+        return 1;
+    }
+    const bool cpio = memcmp(header, "0707", 4) == 0;
+    if (!cpio && !readExactly(in, header + 6, 512 - 6)) {
+        printf("ERROR! Not a tar or cpio stream\n");
+        return 1;
+    }
+    member *members = NULL;
+    lisafsNewFile *files = NULL;
+    int fileCount = 0;
+    bool haveHeader = true;
+    member m;
+    bool failed = false;
+    enum memberResult result;
+    while ((result = cpio ? readCpioMember(in, header, haveHeader, &m) : readTarMember(in, header, haveHeader, &m)) == MEMBER_READ) {
+        haveHeader = false;
+        const char *name = m.name;
+        while (strncmp(name, "./", 2) == 0 || name[0] == '/') {
+            name += name[0] == '/' ? 1 : 2;
         }
-    }
-    bool justWroteSemi = false;
-    bool justWroteNewline = false;
-    for (int i = 0; i < rawFileSize; i++) { // for every byte of the input data
-        uint8_t b = filedata[i];
-        if (b == 0x0A) {
-            b = 0x0D; //replace Mac style line breaks with Lisa style
+        if (!m.regular || name[0] == '\0') {
+            free(m.data);
+            continue;
         }
-        if ((fileType == PASCAL || fileType == NONPASCAL) && (bytesWritten % BLOCK_SIZE == BLOCK_SIZE - 1)) {
-            printf("ERROR! There was no padding added here.\n");
-            assert(false);
+        bool duplicate = lisafsLookup(vol, name) != -1;
+        for (int f = 0; f < fileCount && !duplicate; f++) {
+            duplicate = strcasecmp(members[f].name, name) == 0;
         }
-        if (bytesWritten % BLOCK_SIZE > (BLOCK_SIZE - 0x190) && justWroteNewline) {
-            const int padding = BLOCK_SIZE - (bytesWritten % BLOCK_SIZE);
-            for (int j = 0; j < padding; j++) {
-                //write the footer to each sector
-                dataBuf[bytesWritten++] = 0x00;
-            }
-            dataBuf[bytesWritten++] = b;
-            justWroteNewline = false;
-        } else {
-            dataBuf[bytesWritten++] = b;
-            if (b == ';' || b == '}' || b == ')') {
-                justWroteSemi = true;
-                justWroteNewline = false;
-            } else if (b == 0x0D) {
-                if (justWroteSemi || fileType != PASCAL) {
-                    justWroteNewline = true;
-                } else {
-                    justWroteSemi = false;
-                    justWroteNewline = false;
-                }
-            } else {
-                justWroteSemi = false;
-                justWroteNewline = false;
-            }
+        if (strlen(name) > (size_t) CATALOG_MAX_NAME_LENGTH || duplicate) {
+            printf("ERROR! Skipping %s: %s\n", name, duplicate ? "the volume already has a file by that name" : "the name is longer than 33 characters");
+            failed = true;
+            free(m.data);
+            continue;
         }
+        members = realloc(members, (fileCount + 1) * sizeof(member));
+        members[fileCount] = m;
+        memmove(members[fileCount].name, name, strlen(name) + 1);
+        fileCount++;
+    }
+    if (result == MEMBER_ERROR) {
+        // a stream that breaks off part way isn't imported at all, rather than leaving an image with some of it
+        for (int f = 0; f < fileCount; f++) {
+            free(members[f].data);
+        }
+        free(members);
+        printf("Imported 0 files: the stream is broken\n");
+        return 1;
+    }
+    // the names only stop moving once members is done growing
+    files = malloc((fileCount > 0 ? fileCount : 1) * sizeof(lisafsNewFile));
+    for (int f = 0; f < fileCount; f++) {
+        files[f] = (lisafsNewFile) {members[f].data, members[f].length, members[f].name,
+                                    memberType(&members[f], members[f].name, pascalPatterns, patternCount), -1};
+    }
+    // one thread keeps the layout in stream order, so the same input always makes the same image
+    const int written = lisafsWriteFiles(vol, files, fileCount, 1);
+    *imported = written;
+    for (int f = 0; f < fileCount; f++) {
+        free(members[f].data);
+    }
+    printf("Imported %d of %d files\n", written, fileCount);
+    free(members);
+    free(files);
+    return written == fileCount && !failed ? 0 : 1;
+}
+
+// Copies the named files (or all of them) from another image, sectors as they are: no extracting and re-encoding
+int copyFrom(const char *sourcePath, char **names, const int nameCount) {
+    lisafsVolume *source = lisafsOpenMapped(sourcePath);
+    if (source == NULL) {
+        return 1;
+    }
+    lisafsEntry *entries = NULL;
+    const int count = nameCount > 0 ? nameCount : lisafsList(source, &entries);
+    int copied = 0;
+    for (int i = 0; i < count; i++) {
+        copied += lisafsCopyFile(vol, source, nameCount > 0 ? names[i] : entries[i].name) != -1 ? 1 : 0;
+    }
+    printf("Copied %d of %d files from %s\n", copied, count, sourcePath);
+    free(entries);
+    lisafsClose(source);
+    return copied == count ? 0 : 1;
+}
+
+// with -DLISAFS_STATS, what this run did goes to WS_new.stats.json
+void writeStats() {
+#ifdef LISAFS_STATS
+    FILE *stats = fopen("WS_new.stats.json", "w");
+    if (stats == NULL) {
+        printf("ERROR! Could not create WS_new.stats.json\n");
+        return;
     }
-    const int remaining = BLOCK_SIZE - (bytesWritten % BLOCK_SIZE);
-    for (int i = 0; i < remaining; i++) {
-        dataBuf[bytesWritten++] = 0x00;
-    }
-
-    // do the work
-    const int sectorCount = getSectorCount(bytesWritten);
-    const int startSector = findStartingSector(sectorCount); // allocate contiguously to be nice about it
-
-    const uint16_t sfileid = claimNextFreeSFileIndex(startSector, sectorCount, nameLength, name);
-
-    claimNewCatalogEntry(sfileid, bytesWritten, sectorCount, nameLength, name);
+    lisafsWriteStats(vol, stats);
+    fclose(stats);
+#endif
+}
 
-    // write the data from buffer
-    for (int i = 0; i < sectorCount; i++) {
-        for (int j = 0; j < SECTOR_SIZE; j++) {
-            writeSector(startSector + i, j, dataBuf[(i * SECTOR_SIZE) + j]);
+int main(int argc, char *argv[]) {
+    // ./write [-q|-v] [defrag [hotlist] | boot <trace> | import [pascal patterns...] < tree.tar | copy <source.dc42> [names...]]
+    int arg = 1;
+    if (argc > arg && strcmp(argv[arg], "-q") == 0) {
+        lisafsSetLogLevel(LOG_QUIET);
+        arg++;
+    } else if (argc > arg && strcmp(argv[arg], "-v") == 0) {
+        lisafsSetLogLevel(LOG_DEBUG);
+        arg++;
+    }
+
+    vol = lisafsOpenFile("WS_MASTER.dc42");
+    if (vol == NULL) {
+        return 1;
+    }
+
+    if (argc > arg + 1 && strcmp(argv[arg], "boot") == 0) {
+        optimizeForBoot(argv[arg + 1]);
+        lisafsSaveFile(vol, "WS_new.dc42");
+        writeStats();
+        lisafsClose(vol);
+        return 0;
+    }
+
+    if (argc > arg && strcmp(argv[arg], "import") == 0) {
+        int imported;
+        const int result = importStream(stdin, argv + arg + 1, argc - arg - 1, &imported);
+        printFreeSpace();
+        if (imported > 0) { // a broken stream, or one with nothing new in it, leaves WS_new.dc42 as it was
+            lisafsSaveFile(vol, "WS_new.dc42");
         }
+        writeStats();
+        lisafsClose(vol);
+        return result;
     }
 
-    writeFileTagBytes(startSector, sectorCount, sfileid);
-    free(dataBuf);
-    free(filedata);
-    printf("\n");
-}
+    if (argc > arg + 1 && strcmp(argv[arg], "copy") == 0) {
+        const int result = copyFrom(argv[arg + 1], argv + arg + 2, argc - arg - 2);
+        printFreeSpace();
+        lisafsSaveFile(vol, "WS_new.dc42");
+        writeStats();
+        lisafsClose(vol);
+        return result;
+    }
 
-int main(int argc, char *argv[]) {
-    FILE *output = fopen("WS_new.dc42", "w");
-    //initialize all global vars
-    readFile();
-    findMDDFSec();
-    findBitmapSec();
-    findSFileSec();
-    findNonLeafCatalogSec();
+    if (argc > arg && strcmp(argv[arg], "defrag") == 0) {
+        const bool ok = defragment(argc > arg + 1 ? argv[arg + 1] : NULL);
+        if (ok) {
+            lisafsSaveFile(vol, "WS_new.dc42");
+        }
+        writeStats();
+        lisafsClose(vol);
+        return ok ? 0 : 1;
+    }
 
     /*
     for (int i = 0; i < 200; i++) {
-        const uint8_t calculatedChecksum = calculateChecksum(i);
-        printf("sec %d (0x%02X) (offset=0x%02X) with chksum 0x%02X:", i, i, DATA_OFFSET + (i * SECTOR_SIZE), (calculatedChecksum & 0xFF));
-        bytes tag = readTag(i);
-        for (int j = 0; j < TAG_SIZE; j++) {
-            printf("%02X ", tag[j] & 0xFF);
-        }
-        printf(" ");
-        printSectorType(i);
-        if (i > MDDFSec) {
-            printf(" ");
-            printf("0x%02X", bitmapByte(i));
-        }
+        printf("sec %d (0x%02X): ", i, i);
+        lisafsPrintSectorType(vol, i);
         printf("\n");
     }
+    lisafsPrintSFile(vol);
     */
 
     // get the file we want to write
@@ -1042,9 +566,10 @@ int main(int argc, char *argv[]) {
     writeFile("gdev.text", "gdev.text", NONPASCAL);
 
     // cleanup and close
-    fixAllTagChecksums();
-    fwrite(image, 1, FILE_LENGTH, output);
-    fclose(output);
+    printFreeSpace();
+    lisafsSaveFile(vol, "WS_new.dc42");
+    writeStats();
+    lisafsClose(vol);
 
     return 0;
 }